@@ -29,16 +29,22 @@ Copyright 2018 Peter VanDerWal
 #include <time.h>
 #include <unistd.h>		//usleep
 #include <sys/stat.h>
-//#include <fcntl.h>
+#include <fcntl.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 //#include "ecmR.h"
 #include "etsd.h"
 #include "etsdSave.h"
+#include "etsdJournal.h"
+#include "etsdRollup.h"
 #include "errorlog.h"
 
 int8_t Interval;
-volatile sig_atomic_t Reload;    // reload config file
+volatile sig_atomic_t Reload;    // reload config file, 2 when it was asked for by SIGUSR2
+volatile sig_atomic_t Quit;      // termination signal, the main loop saves the block and exits
 
 void *handle[3]={NULL}; // pointer to dynamically loaded plugins //is NULL redundant?
 uint8_t (*edoSave)(uint32_t timeStamp, uint8_t interval, uint32_t *dataArray, uint8_t *statusArray, uint8_t *xData);
@@ -52,15 +58,196 @@ typedef struct {
 
 SRC_PLUGIN SrcPlugin[4];
 
+uint32_t RollTiers[ROLL_TIERS];  // rollup tiers (seconds) from the config file, see etsdRollOpen()
+uint8_t RollCnt;
+
+// Background writer.  At the end of a block the main loop packs every group's block and picks its sector (etsdSeal()), copies it
+// into the ring and goes back to reading the sources.  The writer thread does the slow parts: xdRead(), the write, the sync, the
+// index files (etsdBlockWritten(), only once the block is in the file) and edoSave(), so a slow SD card or RRD update doesn't delay
+// the next interval.  The main loop is the only producer and the writer the only consumer, so the ring just needs the two counters.
+// EtsdInfo, PBlock/RBlock and the index files are shared, the main loop holds EtsdLock except while it sleeps, waits for the sources
+// or waits for the writer, and the writer only takes it for etsdBlockWritten().  etsdSeal() journals the whole block, a block still
+// in the ring or not synced yet is written by etsdJnlReplay() after a crash (without its xData, xdRead() is only called here).
+// The writer syncs at least every JNL_SYNC blocks so the journal never has to drop a block that isn't on the disk yet
+#define WR_RING  64     // blocks and EDO intervals the writer can fall behind by before the main loop waits for it
+#if WR_RING + JNL_SYNC > JNL_SLOTS
+#error the journal has to hold every block in the ring and every block written since the last sync
+#endif
+#define WR_BLOCK 1      // job types
+#define WR_EDO   2
+#define WR_XDATA 1      // job flags, fill xData (xdRead) before writing the block
+#define WR_LAST  2      // last group of the block, count it for the sync policy (EtsdWrite)
+#define WR_SYNC  4      // sync even if the policy doesn't ask for it, the file is about to be rotated
+#define WR_INDEX 8      // group 0's block, add it to the index files once it's written
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t interV;
+    uint8_t cnt;            // WR_EDO: number of EDO channels
+    uint16_t bs;            // WR_BLOCK: block size
+    uint16_t xDataStart;
+    uint8_t xDataSize;
+    int64_t offset;         // WR_BLOCK: where the block goes, see etsdSeal()
+    int32_t sector;         // WR_BLOCK: the block's sector
+    union {
+        PBLOCK blk;
+        struct {
+            uint32_t data[MAX_CHANNELS];
+            uint8_t stat[MAX_CHANNELS];
+            uint8_t xData[256];
+        } edo;
+    };
+} WR_JOB;
+
+static WR_JOB WrRing[WR_RING];
+static atomic_uint WrHead, WrTail;      // jobs queued by the main loop, jobs finished by the writer
+static atomic_int WrReopen = 1;         // the ETSD file was rotated or reloaded, the writer opens it again
+static sem_t WrSem;
+static char *WrFile;
+static pthread_mutex_t EtsdLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *wrThread(void *arg){
+    int fd = -1;
+    uint8_t grp;
+    WR_JOB *job;
+
+    while (1){
+        while (sem_wait(&WrSem));   // EINTR
+        job = &WrRing[atomic_load_explicit(&WrTail, memory_order_relaxed) % WR_RING];
+        if (WR_EDO == job->type){
+            if (edoSave)
+                edoSave(0, job->interV, job->edo.data, job->edo.stat, job->edo.xData);
+        } else {
+            if (atomic_exchange(&WrReopen, 0) || 0 > fd){
+                if (0 <= fd)
+                    close(fd);
+                fd = open(WrFile, O_RDWR);
+            }
+            if (job->flags & WR_XDATA)
+                xdRead(job->interV, job->xDataSize, &job->blk.byteD[job->xDataStart]);
+            if (0 > fd || etsdWriteBlock(fd, &job->blk, job->bs, job->offset)){  // if we can't write to etsd File, error and exit
+                Log("<3> Error! Can't write to ETSD file %s, exiting\n", WrFile);
+                LogBlock(&job->blk.byteD, "ETSD", job->bs);     // try to save the block to the error log
+                exit(1);
+            }
+            if ((job->flags & WR_LAST) && etsdSync(fd, (job->flags & WR_SYNC) || JNL_SYNC <= EtsdWrite.pending+1))
+                Log("<3> Error! Can't sync ETSD file %s\n", WrFile);
+            if (job->flags & WR_INDEX){     // the main loop may be part way through the other groups, put them back after
+                pthread_mutex_lock(&EtsdLock);
+                grp = EtsdInfo.group;
+                if (etsdSaveGroup(0))
+                    ELog("wrThread", 1);
+                else {
+                    etsdBlockWritten(&job->blk, job->sector);
+                    etsdSaveGroup(grp);
+                }
+                pthread_mutex_unlock(&EtsdLock);
+            }
+        }
+        atomic_fetch_add_explicit(&WrTail, 1, memory_order_release);
+    }
+    return NULL;
+}
+
+// waits a bit for the writer, EtsdLock is released meanwhile so the writer can finish a block
+static void wrWait(){
+    pthread_mutex_unlock(&EtsdLock);
+    usleep(10000);
+    pthread_mutex_lock(&EtsdLock);
+}
+
+// returns the next free job in the ring, if the writer is a whole ring behind waits for it
+static WR_JOB *wrNext(){
+    uint32_t head = atomic_load_explicit(&WrHead, memory_order_relaxed);
+    if (head - atomic_load_explicit(&WrTail, memory_order_acquire) >= WR_RING){
+        Log("<4> ETSD writer is %d jobs behind, waiting for it\n", WR_RING);
+        while (head - atomic_load_explicit(&WrTail, memory_order_acquire) >= WR_RING)
+            wrWait();
+    }
+    return &WrRing[head % WR_RING];
+}
+
+static void wrPush(){
+    atomic_fetch_add_explicit(&WrHead, 1, memory_order_release);
+    sem_post(&WrSem);
+}
+
+// waits until the writer has finished every job queued
+static void wrDrain(){
+    while (atomic_load_explicit(&WrTail, memory_order_acquire) != atomic_load_explicit(&WrHead, memory_order_relaxed))
+        wrWait();
+}
+
+// hands every group's block to the writer, xData = have the writer fill group 0's xData first.  Leaves group 0 selected
+static void commitBlocks(uint8_t interV, uint8_t xData){
+    uint8_t grp;
+    WR_JOB *job;
+
+    for (grp=0; grp<EtsdInfo.groups; grp++){   // the groups are committed together so they stay in step
+        etsdSaveGroup(grp);
+        if (LogLvl > 2) {
+            Log("<5> About to write the following to the ETSD file: %s\n", EtsdInfo.fileName);
+            LogBlock(&PBlock.byteD, "ETSD", ETSD_BSIZE);
+        }
+        job = wrNext();
+        if (etsdSeal(interV, &job->offset)){
+            ELog(__func__, 1);
+            LogBlock(&PBlock.byteD, "ETSD", ETSD_BSIZE);
+            exit(1);
+        }
+        memcpy(&job->blk, &PBlock, ETSD_BSIZE);
+        job->sector = EtsdInfo.sector;
+        job->type = WR_BLOCK;
+        job->interV = interV;
+        job->bs = ETSD_BSIZE;
+        job->xDataStart = EtsdInfo.xDataStart;
+        job->xDataSize = EtsdInfo.xDataSize;
+        job->flags = (!grp && xData && xdRead ? WR_XDATA : 0) | (grp+1 == EtsdInfo.groups ? WR_LAST : 0) | (RotateEtsd ? WR_SYNC : 0)
+                | (!grp ? WR_INDEX : 0);
+        wrPush();
+    }
+    etsdSaveGroup(0);
+    if (RotateEtsd){    // the writer has to finish with the old file first
+        wrDrain();
+        if (etsdRotate())
+            ELog(__func__, 1);
+        RotateEtsd = 0;
+        WrReopen = 1;
+    }
+}
+
+// queues one interval for the external data out plugin
+static void edoQueue(uint8_t interV, uint8_t cnt, uint32_t *data, uint8_t *stat){
+    WR_JOB *job = wrNext();
+    job->type = WR_EDO;
+    job->interV = interV;
+    job->cnt = cnt;
+    memcpy(job->edo.data, data, cnt * sizeof(uint32_t));
+    memcpy(job->edo.stat, stat, cnt);
+    memcpy(job->edo.xData, &PBlock.byteD[EtsdInfo.xDataStart], EtsdInfo.xDataSize);
+    wrPush();
+}
+
+// only sets a flag, the main loop does the work.  Nothing it would call (the writer, etsdCommit(), Log()) is safe in a signal handler
 void sig_handler(int signum) {
-    if (SIGUSR2!=signum){
-        Log("Received termination signal, attempting to save ETSD block and exiting.\n");
-        if (NULL != EtsdInfo.fileName)
+    if (SIGUSR2!=signum)
+        Quit = 1;
+    else
+        Reload = 2;
+}
+
+// called by the main loop once Quit is set, saves the blocks in progress and exits
+static void quit(){
+    uint8_t grp;
+    Log("Received termination signal, attempting to save ETSD block and exiting.\n");
+    if (NULL != EtsdInfo.fileName){
+        wrDrain();      // blocks already handed to the writer go first
+        for (grp=0; grp<EtsdInfo.groups; grp++){     // every channel group has a block in progress
+            etsdSaveGroup(grp);
             etsdCommit(Interval);
-        exit(0);
+        }
     }
-    Log("Received Reload signal.  Finishing current interval and then reloading configuration");
-    Reload=1;
+    exit(0);
 }
 
 #ifdef DAEMON  
@@ -93,6 +280,11 @@ uint16_t readConfig( char *configFileName, SRC_PLUGIN SrcPlugin[4], uint16_t *ch
     } cfgStrings[6]={NULL,NULL}; // cfgStrings[0]-[3] source, [4] edo. [5]=xData
     
     *checkTime=0;
+    EtsdWrite.syncBlocks = EtsdWrite.syncSecs = 0;  // defaults unless the config file says otherwise
+    EtsdWrite.direct = 0;
+    EtsdWrite.prealloc = 0;
+    JnlSync = 0;
+    RollCnt = 0;
 
     if ( NULL == (fptr = fopen(configFileName, "r")) ) {
         Log("<3> Error! Can't open config file: %s\n", configFileName);
@@ -158,6 +350,34 @@ uint16_t readConfig( char *configFileName, SRC_PLUGIN SrcPlugin[4], uint16_t *ch
                     LogLvl = atoi(ptr);
                 }
                 break; 
+            case 'W':                       // how ETSD blocks are written, see ETSD_WRITE (and JnlSync)
+                if ('S'==configLine[1] ){
+                    EtsdWrite.syncBlocks = atoi(ptr);
+                } else if ('T'==configLine[1] ){
+                    EtsdWrite.syncSecs = atoi(ptr);
+                } else if ('D'==configLine[1] ){
+                    EtsdWrite.direct = atoi(ptr);
+                } else if ('P'==configLine[1] ){
+                    EtsdWrite.prealloc = atoi(ptr) * 1024;  // in KB
+                } else if ('J'==configLine[1] ){
+                    JnlSync = atoi(ptr);
+                }
+                break;
+            case 'R':                       // rollup tiers
+                if ('U'==configLine[1] ){
+                    while (*ptr && RollCnt < ROLL_TIERS){   // i.e. RU:1m,30m,1d
+                        RollTiers[RollCnt] = strtoul(ptr, &ptr, 10);
+                        switch (*ptr|32){
+                            case 'm': RollTiers[RollCnt] *= 60; break;
+                            case 'h': RollTiers[RollCnt] *= 3600; break;
+                            case 'd': RollTiers[RollCnt] *= 86400; break;
+                        }
+                        if (RollTiers[RollCnt])
+                            RollCnt++;
+                        while (*ptr && ','!=*ptr++);
+                    }
+                }
+                break;
             case 'X':                       // xData (Extra Data) plugin
                 if ('N'==configLine[1] ){
                     handle[1] = dlopen (ptr, RTLD_LAZY);
@@ -239,7 +459,8 @@ uint16_t readConfig( char *configFileName, SRC_PLUGIN SrcPlugin[4], uint16_t *ch
 int main(int argc, char *argv[])  {
 
     uint16_t sleepTime, checkTime;
-    uint8_t srcCnt, edoCnt, saveEDO;
+    uint8_t srcCnt, edoCnt, saveEDO, resumed = 0;
+    uint32_t slotWait = 0;     // aligned files, start of the next block's slot while the slot of a block committed early runs out
     
 #ifdef DAEMON  
     pid_t process_id = 0;
@@ -283,22 +504,49 @@ int main(int argc, char *argv[])  {
     signal(SIGHUP, sig_handler);    // user closed virtual terminal.  //Pete possibly restart as daemon?
     signal(SIGUSR2, sig_handler);   // reload config file
 
+    {   // the writer thread doesn't take signals, they are all handled by the main loop
+        sigset_t all, old;
+        pthread_t writer;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        sem_init(&WrSem, 0, 0);
+        if (pthread_create(&writer, NULL, wrThread, NULL)){
+            Log("<3> Error! Can't start the ETSD writer thread\n");
+            exit(1);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+
     //ecmSetup(TTYPort, EcmShmAddr);
     ELog("Main Clear Errors", 1);      //log any errors and zero ErrorCode
 
     //while (Check_src[0](110, 0));   // Pete need a better way to check multiple sources.  // wait for good data, 110 = 11 second 
 
     Reload = 1;
+    pthread_mutex_lock(&EtsdLock);      // released while waiting, see wrThread()
     while (1) {
         uint32_t data, dataArray[EtsdInfo.edoCnt]; 
-        uint8_t lp, checkstat;
+        uint8_t lp, checkstat, grp;
+        uint32_t blockTime = 0;
         uint8_t  srcReset=0, status[4]={0}, pause=10, statArr[EtsdInfo.edoCnt];
 
         if(Reload){
+            if (2 == Reload)
+                Log("Received Reload signal.  Finishing current interval and then reloading configuration");
             Reload = 0;
-            Interval = 0;
+            wrDrain();          // the writer and plugins have to be finished with the old config
+            etsdJnlClose();     // the config may name a different ETSD file
+            etsdRollClose();
             srcCnt = readConfig( argv[1], SrcPlugin, &checkTime);
+            WrFile = EtsdInfo.fileName;
+            WrReopen = 1;
             sleepTime = EtsdInfo.intervalTime - checkTime/2;
+            if (0 > etsdRollOpen(RollTiers, RollCnt, 1))    // catches up on blocks saved while edd wasn't running
+                ELog("Main rollup", 1);
+            if (etsdJnlOpen())  // keep going without it, the block in progress just isn't protected
+                ELog("Main journal", 1);
+            resumed = Interval = etsdJnlReplay();   // pick up the block that was in progress when edd stopped
+            slotWait = 0;
 
             if (LogLvl){
                 Log("<5> %s starting up with the following settings:\n  EtsdFile = %s \n  logLevel = %d\n", argv[0], EtsdInfo.fileName, LogLvl);
@@ -306,82 +554,103 @@ int main(int argc, char *argv[])  {
             }
         }
 
+        pthread_mutex_unlock(&EtsdLock);
         for(lp=0; lp<srcCnt; lp++){     // check sources
             status[lp] = SrcPlugin[lp].Check_src(checkTime, Interval);
         }
+        pthread_mutex_lock(&EtsdLock);
         ELog("Main 1", 1);
 //        if ( Interval == EtsdInfo.blockIntervals && NULL != xDataLock) {  // if saving Xdata
   //          xDataLock(1); // Lock xData
     //    }
 //        usleep(pause*100000);       // wait time between checking for new data and reading the data
         
-        if(Interval) {
+        if(Interval && !resumed) {  // a resumed block already has this interval
             edoCnt=0;
-
-            for (lp=0; lp<EtsdInfo.channels; lp++){
-                // checkstat=(status>>(SRC_TYPE(lp)*2))&3;
-                if( status[SRC_TYPE(lp)]){
-                    data = 0xFFFFFFFF;
-                    if (status[SRC_TYPE(lp)]&2){ // source reset
-                        srcReset != 1<<(7-lp);
-                    }
-                } else {
-                    data = SrcPlugin[SRC_TYPE(lp)].Read_src(SRC_CHAN(lp));
+            for (grp=0; grp<EtsdInfo.groups; grp++){   // every channel group saves the interval, external data out only gets group 0
+                uint32_t chanData[MAX_CHANNELS];
+                uint8_t chanStat[MAX_CHANNELS];
+                etsdSaveGroup(grp);
+
+                for (lp=0; lp<EtsdInfo.channels; lp++){
+                    // checkstat=(status>>(SRC_TYPE(lp)*2))&3;
+                    if( status[SRC_TYPE(lp)]){
+                        data = 0xFFFFFFFF;
+                        if (status[SRC_TYPE(lp)]&2){ // source reset
+                            srcReset != 1<<(7-lp);
+                        }
+                    } else {
+                        data = SrcPlugin[SRC_TYPE(lp)].Read_src(SRC_CHAN(lp));
  //fprintf(stderr,"Channel %u data = %u \n",lp,data);               
-                } 
+                    } 
          
-                if(EDO_BIT(lp)) {     // save channel to external Data out
-                    statArr[edoCnt]=status[SRC_TYPE(lp)];
-                    dataArray[edoCnt++]=data;
+                    if(!grp && EDO_BIT(lp)) {     // save channel to external Data out
+                        statArr[edoCnt]=status[SRC_TYPE(lp)];
+                        dataArray[edoCnt++]=data;
+                    }
+                    // Save to ETSD
+                    chanData[lp] = data;
+                    chanStat[lp] = status[SRC_TYPE(lp)];
                 }
-                // Save to ETSD
- 
-                if(ETSD_TYPE(lp)){    // save channel to etsd
-                    saveChan(Interval, lp, status[SRC_TYPE(lp)], data);  
+                etsdSaveInterval(Interval, chanData, chanStat);     // save all the channels to etsd
+                //if(NULL !=(*edoSave)){
+                if(!grp && edoSave){
+                    edoQueue(Interval, edoCnt, dataArray, statArr);
                 }
             }
-            //if(NULL !=(*edoSave)){
-            if(edoSave){
-                edoSave( 0, Interval, dataArray, statArr, &PBlock.byteD[EtsdInfo.xDataStart] );
-            }
             if (srcReset){
-                etsdCommit(Interval);
+                commitBlocks(Interval, 0);
                 Interval=0;
             }
+            etsdSaveGroup(0);
         }
 //Log("main() Interval = %d and blockIntervals = %d\n", Interval, EtsdInfo.blockIntervals);
         ELog("Main 2", 1);
-        if ( Interval == EtsdInfo.blockIntervals ) {
-            if (LogLvl > 2) {
-                Log("<5> About to write the following to the ETSD file: %s\n", EtsdInfo.fileName);
-                LogBlock(&PBlock.byteD, "ETSD", 512);
-            }
-            if (NULL != (*xdRead)) {  // if saving Xdata
-            xdRead(Interval, EtsdInfo.xDataSize, &PBlock.byteD[EtsdInfo.xDataStart]);
-//                for(lp=0; lp < EtsdInfo.xDataSize; lp++){
-  //                  PBlock.byteD[EtsdInfo.xDataStart+lp]=xData[lp];
-    //            }
-      //          xDataLock(0); // unlock xData
-            }
-            etsdCommit(Interval);
+        if ( Interval == EtsdInfo.blockIntervals || EtsdBlockFull ) {  // compressed channels can fill a block early
+            commitBlocks(Interval, 1);
             Interval = 0;
         }
         ELog("Main 3", 1);  
         
-        if (!Interval){   
-            etsdBlockClear(0xffff); // by default 0xffff indicates invalid value
-            etsdBlockStart();  
-            PBlock.byteD[6] = srcReset;
-            for (lp=0; lp<EtsdInfo.channels; lp++){
-                if(ETSD_TYPE(lp)){    // save channel to etsd
-                    saveChan(Interval, lp, status[SRC_TYPE(lp)], data);
-                    //checkstat=(status>>(SRC_TYPE(lp)*2))&3;
+        if (!Interval && !slotWait){   
+            for (grp=EtsdInfo.groups; grp--; ){     // ends on group 0
+                etsdSaveGroup(grp);
+                etsdBlockClear(0xffff); // by default 0xffff indicates invalid value
+                etsdBlockStart();  
+                if (grp == EtsdInfo.groups-1)
+                    blockTime = PBlock.longD[0];
+                PBlock.longD[0] = blockTime;    // every group's block starts at the same time
+                PBlock.byteD[6] = srcReset;
+                for (lp=0; lp<EtsdInfo.channels; lp++){
+                    if(ETSD_TYPE(lp)){    // save channel to etsd
+                        saveChan(Interval, lp, status[SRC_TYPE(lp)], data);
+                        //checkstat=(status>>(SRC_TYPE(lp)*2))&3;
 //pete fix                    saveChan(Interval, lp, checkstat, checkstat?0xFFFFFFFF:(Read_src[SRC_TYPE(lp)](SRC_CHAN(lp), Interval)));  
+                    }
                 }
+                etsdJnlStart();
+            }
+            Interval = etsdAlignInterval();     // aligned files start part way through the block's time slot
+            blockTime = ETSD_NOW();
+            if (PBlock.longD[0] > blockTime){   // or after the slot of a block that was committed early, its slot is already used
+                slotWait = PBlock.longD[0];
+                Log("<4> Block committed early, readings for the %u seconds left in its slot aren't saved\n", slotWait - blockTime);
             }
         }
         ELog("Main 4", 1);
-        sleep(sleepTime);
+        pthread_mutex_unlock(&EtsdLock);
+        if (!Quit)
+            sleep(sleepTime);   // a signal cuts the sleep short
+        pthread_mutex_lock(&EtsdLock);
+        if (Quit)
+            quit();
+        if (slotWait){      // keep checking the sources and signals every interval until the new block's slot starts
+            if (ETSD_NOW() < slotWait)
+                continue;
+            slotWait = 0;
+            Interval = etsdAlignInterval();
+        }
         Interval++;
+        resumed = 0;
     }
 }
@@ -39,7 +39,7 @@ extern "C" {
 #define E_NOT_ETSD     1024     // File header block(0) not from ETSD file
 #define E_NOT_TTY      2048     // Device specified is not a TTY device
 #define E_RRD          4096     // Excessive RRD errors, aborting
-//#define E_UN           8192
+#define E_FULL         8192     // compressed stream ran out of room in the current block
 #define E_WARN        16384     //Generic Warning
 #define E_TTY_STAT    32768     // Can't get status of tty device
 #define E_SHM         65536     // Can't open/create shared memory object
@@ -14,68 +14,156 @@ Copyright 2018 Peter VanDerWal
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 *********************************************************************************/
-    
+
+#define _GNU_SOURCE             // O_DIRECT, fallocate()
+#define _FILE_OFFSET_BITS 64    // 64 bit off_t so sector offsets don't overflow past 2GB on 32 bit systems
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "etsd.h"
 #include "errorlog.h"
 
 PBLOCK PBlock;
+PBLOCK *RBlock = &PBlock;
 ETSD_INFO EtsdInfo;
+ETSD_WRITE EtsdWrite = {0, 0, 0, 0, 0, 0, -1, 0, 0};
+ETSD_CHAN *EtsdChan;
 uint32_t *LastReading;
 uint8_t *MissedUpdate;;
 
+// layouts of the channel groups that have been loaded, see etsdGroup()
+typedef struct {
+    ETSD_INFO info;
+    ETSD_CHAN *chan;
+    uint32_t *last;
+    uint8_t *missed;
+} ETSD_GRP;
+static ETSD_GRP *Grp = NULL;
+
 // send 'kill -SIGUSR1 <process id>' to rotate ETSD File at the end of the current block (when saving data)
 // send 'kill -SIGUSR2 <process id>' to reload configuration file after current 'interval'
 volatile sig_atomic_t RotateEtsd;
+uint8_t EtsdBlockFull;
 
 void etsdSigHandler(int signum) {
     RotateEtsd = 1;
 }
 
 
-// etsdInit returns zero on success or -1 on error  See errorlog.h for error codes. 
-int32_t etsdInit(char *fName, uint8_t loadLabels) {
+// loads the layout of the header sector in <hdr> (sector 0 of the current group) into EtsdInfo and EtsdChan
+// returns zero on success or -1 on error
+static int32_t hdrLoad(PBLOCK *hdr, uint8_t loadLabels){
     //float streams=0.0;
-    uint16_t lp, idx=0, streams=0;
-    int8_t error, extSCnt=0;
+    uint16_t lp, idx=0, streams=0, QS=0;
+    uint8_t *rec, len;
+    int8_t error, extSCnt=0, ASCnt=0, regCnt=0;
+    // bits per interval for each stream type, and how many Quarter Streams each type occupies
+    const uint8_t typeBits[16] = {0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 32, 16, 16};
+    const uint8_t typeQS[16]   = {0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 8, 4, 4};
 
-    signal(SIGUSR1, etsdSigHandler);   // Rotate etsd file on signal from user app
-    
-    EtsdInfo.fileName = (char*) malloc(strlen(fName)+1);
-    strcpy(EtsdInfo.fileName,fName); 
-    if (etsdRW("r", 0)){  // opens EtsdInfo.fileName for reading and reads first sector into Pblock;
-        ELog(__func__, 0);
-        return -1; // error can't open etsdFile for reading
-    }
-    if (ETSD_HEADER != PBlock.longD[0]){ // check to make sure block starts with "ETSD"
+    if (ETSD_HEADER != hdr->longD[0]){ // check to make sure block starts with "ETSD"
         ErrorCode |= E_NOT_ETSD; //error not etsd file
         ELog(__func__, 0);
         return -1;
     }
-    EtsdInfo.header = PBlock.data[2] & 65408;  	//grab the MSbx9
-    EtsdInfo.blockIntervals = (PBlock.data[2] >> 7) & 127;
-    EtsdInfo.channels = PBlock.data[2] & 127;    // etsd ver 1.0 supports 127 channels max
-    EtsdInfo.intervalTime = PBlock.data[3];     // ~18.2 hours maximum interval.
-    EtsdInfo.labelSize = PBlock.byteD[8];
-    EtsdInfo.xDataSize = PBlock.byteD[9];
+    EtsdInfo.header = hdr->data[2] & 65408;  	//grab the MSbx9
+    EtsdInfo.blockIntervals = (hdr->data[2] >> 7) & 127;
+    EtsdInfo.channels = hdr->data[2] & 127;    // etsd ver 1.0 supports 127 channels max
+    EtsdInfo.intervalTime = hdr->data[3];     // ~18.2 hours maximum interval.
+    EtsdInfo.labelSize = hdr->byteD[8];
+    EtsdInfo.xDataSize = hdr->byteD[9];
     
+    EtsdInfo.registers = 0;
+    EtsdInfo.edoCnt = 0;
     EtsdInfo.source=(uint8_t*)malloc(EtsdInfo.channels);
     EtsdInfo.destination=(uint8_t*)malloc(EtsdInfo.channels);
+    free(EtsdChan);
+    EtsdChan = (ETSD_CHAN*)calloc(EtsdInfo.channels ? EtsdInfo.channels : 1, sizeof(ETSD_CHAN));
+
+    // optional header extension after the labels
+    EtsdInfo.hdrExt = 10 + 2*EtsdInfo.channels + 2*EtsdInfo.labelSize;
+    if (BLOCKSIZE-2 <= EtsdInfo.hdrExt || HX_MAGIC0 != hdr->byteD[EtsdInfo.hdrExt] || HX_MAGIC1 != hdr->byteD[EtsdInfo.hdrExt+1])
+        EtsdInfo.hdrExt = 0;
+    if ((rec = etsdHdrTag(hdr->byteD, HX_CODEC, &len))){
+        for (lp=0; lp<EtsdInfo.channels && 2*lp+1 < len; lp++){
+            EtsdChan[lp].codec = rec[2*lp];
+            EtsdChan[lp].zQS = EtsdChan[lp].codec ? rec[2*lp+1] : 0;
+        }
+    }
+    if ((rec = etsdHdrTag(hdr->byteD, HX_ZERR, &len))){
+        for (lp=0; lp<EtsdInfo.channels && 2*lp+1 < len; lp++)
+            EtsdChan[lp].zErr = rec[2*lp] | rec[2*lp+1]<<8;
+    }
+    if ((rec = etsdHdrTag(hdr->byteD, HX_BSIZE, &len)) && len){
+        if (rec[0] < 2 || ETSD_MAX_BLOCK/BLOCKSIZE < rec[0] || (rec[0] & (rec[0]-1))){
+            ErrorCode |= E_NOT_ETSD;    // block size this build can't handle
+            ELog(__func__, 0);
+            return -1;
+        }
+        EtsdInfo.blockSize = rec[0] * BLOCKSIZE;
+    }
+    EtsdInfo.srcUnit = 0;
+    rec = etsdHdrTag(hdr->byteD, HX_GROUP, &len);
+    if (rec ? len < 3 || rec[0] != EtsdInfo.group || rec[0] >= rec[1] || MAX_GROUPS < rec[1] || (1 < EtsdInfo.groups && rec[1] != EtsdInfo.groups) : 1 < EtsdInfo.groups){
+        ErrorCode |= E_NOT_ETSD;    // not the header of the group we asked for
+        ELog(__func__, 0);
+        return -1;
+    }
+    if (rec){
+        EtsdInfo.groups = rec[1];
+        EtsdInfo.srcUnit = rec[2] & 3;
+    }
+    EtsdInfo.alignSpan = (rec = etsdHdrTag(hdr->byteD, HX_ALIGN, &len)) && len && 1 == rec[0] ? EtsdInfo.intervalTime * EtsdInfo.blockIntervals : 0;
+    EtsdInfo.alignBase = 0;
+    if ((rec = etsdHdrTag(hdr->byteD, HX_ASCALE, &len))){
+        for (lp=0; lp<EtsdInfo.channels && lp < len; lp++)
+            EtsdChan[lp].scaled = rec[lp];   // checked against the stream type below
+    }
+    if ((rec = etsdHdrTag(hdr->byteD, HX_FLOAT, &len))){
+        for (lp=0; lp<EtsdInfo.channels && lp < len; lp++)
+            EtsdChan[lp].isFloat = rec[lp];  // checked against the stream type below
+    }
 
     
     for(lp=0;lp<EtsdInfo.channels; lp++){
-        EtsdInfo.source[lp] = PBlock.byteD[lp*2 + 10];  
-        EtsdInfo.destination[lp] = PBlock.byteD[lp*2 + 11];  
+        EtsdInfo.source[lp] = hdr->byteD[lp*2 + 10];  
+        EtsdInfo.destination[lp] = hdr->byteD[lp*2 + 11];  
+
+        // layout table, offsets are counted across ALL preceding channels the same way saveChan()/readChan() always have
+        EtsdChan[lp].QS = QS;
+        EtsdChan[lp].bits = typeBits[ETSD_TYPE(lp)];
+        EtsdChan[lp].reg = REG_BIT(lp) ? ++regCnt : 0;
+        EtsdChan[lp].isFloat = EtsdChan[lp].isFloat && 13 == ETSD_TYPE(lp) && !CNT_BIT(lp);
+        if (EtsdChan[lp].codec && ETSD_TYPE(lp)){  // compressed, bit stream replaces the fixed width stream (and extended stream)
+            EtsdChan[lp].zStart = 8 + (QS*EtsdInfo.blockIntervals + 1)/2;
+            EtsdChan[lp].zSize = EtsdChan[lp].zQS*EtsdInfo.blockIntervals/2;
+            QS += EtsdChan[lp].zQS;
+            streams += 2*EtsdChan[lp].zQS;
+            if (REG_BIT(lp))
+                EtsdInfo.registers++;
+            if (EDO_BIT(lp))
+                EtsdInfo.edoCnt++;
+            EtsdChan[lp].scaled = 0;
+            continue;
+        }
+        EtsdChan[lp].codec = 0;
+        EtsdChan[lp].extS = EXTS_BIT(lp) ? ++extSCnt : 0;
+        EtsdChan[lp].scaled = AUTOSC(lp) || (EtsdChan[lp].scaled && (4 == ETSD_TYPE(lp) || 6 == ETSD_TYPE(lp) || 8 == ETSD_TYPE(lp) || 10 == ETSD_TYPE(lp)));
+        EtsdChan[lp].AS = EtsdChan[lp].scaled ? ASCnt++ : 0;
+        QS += typeQS[ETSD_TYPE(lp)];
+
         if (ETSD_TYPE(lp)){  // if saving to etsd
             if (13> ETSD_TYPE(lp)){
                 streams += ETSD_TYPE(lp)&14; //drop the last bit
-                if (EXTS_BIT(lp)){  // is this an EXTended Stream (+2bits) ?
-                    extSCnt++;
-                }
             } else {
                 if (13== ETSD_TYPE(lp)){
                     streams +=16;
@@ -96,7 +184,7 @@ int32_t etsdInit(char *fName, uint8_t loadLabels) {
         EtsdInfo.labelBlob = (char*)calloc(EtsdInfo.labelSize*2, sizeof(char));  // allocate blob of space to hold all the labels
         EtsdInfo.label = malloc(EtsdInfo.channels * sizeof(char*)); // allocate an array of pointers to individual labels in blob
 
-        memcpy(EtsdInfo.labelBlob, PBlock.byteD+10+2*EtsdInfo.channels, EtsdInfo.labelSize*2);
+        memcpy(EtsdInfo.labelBlob, hdr->byteD+10+2*EtsdInfo.channels, EtsdInfo.labelSize*2);
         EtsdInfo.label[0]=EtsdInfo.labelBlob;      // point to first label
         for (lp=1; lp<EtsdInfo.channels;lp++){
             while (EtsdInfo.labelBlob[idx++]); //search for next null at the end of each lable
@@ -107,7 +195,11 @@ int32_t etsdInit(char *fName, uint8_t loadLabels) {
     }
 
     EtsdInfo.extStart = 8.75 + EtsdInfo.blockIntervals * streams/4.0; 
-    EtsdInfo.xDataStart =  EtsdInfo.extStart + extSCnt/4.0 + 0.75;
+    EtsdInfo.xDataStart =  EtsdInfo.extStart + (extSCnt*EtsdInfo.blockIntervals + 3)/4;   // each extended stream is blockIntervals/4 bytes
+    EtsdInfo.scaleSlots = ASCnt;
+    EtsdInfo.scaleStart = EtsdInfo.xDataStart + EtsdInfo.xDataSize;
+    EtsdInfo.groupPos = EtsdInfo.scaleStart + (AS_DATA3_SLOTS < ASCnt ? (ASCnt - AS_DATA3_SLOTS + 3) / 4 : 0);
+    EtsdInfo.layoutSig = etsdLayoutSig();
 //    etsdBlockClear(0xFFFF);
 
 // initialize LastReading and MissedUpdate; arrays
@@ -122,46 +214,451 @@ int32_t etsdInit(char *fName, uint8_t loadLabels) {
     return 0;
 }
 
-// mode r=read, w=write, a=append.  For read, sector = which sector to read, negative sectors are relative to end of file
-// returns zero on success, or  -1(DATA_INVALID) on failure and sets ErrorCode , see errorlog.h for error codes
-int32_t etsdRW(char *mode, int32_t sector){
-    FILE *etsd;
 
-    if (mode[0] < 97){
-        mode[0] += 32; //convert upper case to lower case
+// etsdInit returns zero on success or -1 on error  See errorlog.h for error codes. 
+int32_t etsdInit(char *fName, uint8_t loadLabels) {
+    signal(SIGUSR1, etsdSigHandler);   // Rotate etsd file on signal from user app
+
+    etsdClose();    // in case we are re-initializing
+    EtsdInfo.blockSize = BLOCKSIZE;     // everything etsdInit() needs is in the first BLOCKSIZE bytes of the header
+    EtsdInfo.group = 0;
+    EtsdInfo.groups = 1;                // until sector 0 says otherwise
+    free(Grp);
+    Grp = NULL;
+    EtsdInfo.fileName = (char*) malloc(strlen(fName)+1);
+    strcpy(EtsdInfo.fileName,fName); 
+    if (etsdRW("r", 0)){  // opens EtsdInfo.fileName for reading and reads first sector into Pblock;
+        ELog(__func__, 0);
+        return -1; // error can't open etsdFile for reading
+    }
+    return hdrLoad(&PBlock, loadLabels);
+}
+
+// the file, its mapping and the last sector read are shared by every group
+static void grpShare(ETSD_INFO *from){
+    EtsdInfo.fileName = from->fileName;
+    EtsdInfo.fd = from->fd;
+    EtsdInfo.fdMode = from->fdMode;
+    EtsdInfo.map = from->map;
+    EtsdInfo.mapSize = from->mapSize;
+    EtsdInfo.sector = from->sector;
+    EtsdInfo.alignBase = from->alignBase;
+}
+
+// loads the layout of channel group <group>, the layout of the group being left is kept so switching back doesn't re-read it
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdGroup(uint8_t group){
+    ETSD_INFO cur = EtsdInfo, live;
+
+    if (group == EtsdInfo.group)
+        return 0;
+    if (group >= EtsdInfo.groups){
+        ErrorCode |= E_ARG;
+        ELog(__func__, 0);
+        return DATA_INVALID;
+    }
+    if (!Grp && !(Grp = (ETSD_GRP*)calloc(EtsdInfo.groups, sizeof(ETSD_GRP)))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    Grp[cur.group].info = cur;
+    Grp[cur.group].chan = EtsdChan;
+    Grp[cur.group].last = LastReading;
+    Grp[cur.group].missed = MissedUpdate;
+
+    if (Grp[group].chan){
+        EtsdInfo = Grp[group].info;
+        EtsdChan = Grp[group].chan;
+        LastReading = Grp[group].last;
+        MissedUpdate = Grp[group].missed;
+        grpShare(&cur);
+        return 0;
+    }
+    EtsdChan = NULL;    // still belongs to the group we are leaving
+    EtsdInfo.group = group;
+    if (etsdRW("r", 0) || hdrLoad(RBlock, NULL != cur.label)){
+        live = EtsdInfo;
+        EtsdInfo = cur;
+        EtsdChan = Grp[cur.group].chan;
+        LastReading = Grp[cur.group].last;
+        MissedUpdate = Grp[cur.group].missed;
+        grpShare(&live);
+        return DATA_INVALID;
+    }
+    return 0;
+}
+
+// opens EtsdInfo.fileName and keeps it open until etsdClose(). mode 'r' = read only, 'w' = read/write (creates file if needed)
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdOpen(char mode){
+    etsdClose();
+    if ('w' == (mode|32)){
+        EtsdInfo.fd = open(EtsdInfo.fileName, O_RDWR|O_CREAT, 0644);
+        if (0 > EtsdInfo.fd){
+            ErrorCode |= E_CANT_WRITE;
+            return DATA_INVALID;
+        }
+        EtsdInfo.fdMode = 'w';
+    } else {
+        EtsdInfo.fd = open(EtsdInfo.fileName, O_RDONLY);
+        if (0 > EtsdInfo.fd){
+            ErrorCode |= E_CANT_READ;
+            return DATA_INVALID;
+        }
+        EtsdInfo.fdMode = 'r';
+    }
+    return 0;
+}
+
+void etsdClose(){
+    etsdUnmap();
+    if (0 <= EtsdWrite.dfd)
+        close(EtsdWrite.dfd);
+    EtsdWrite.dfd = -1;
+    EtsdWrite.ino = 0;
+    if (EtsdInfo.fdMode){
+        close(EtsdInfo.fd);
+        EtsdInfo.fdMode = 0;
+    }
+    EtsdInfo.fd = -1;
+}
+
+// maps the ETSD file read only, blocks read by etsdRW("r",..) are then used in place (RBlock) instead of copied into PBlock
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode.  On failure etsdRW() keeps using pread()
+int32_t etsdMap(){
+    struct stat st;
+    void *map;
+
+    if (!EtsdInfo.fdMode && etsdOpen('r'))
+        return DATA_INVALID;
+    if (fstat(EtsdInfo.fd, &st)){
+        ErrorCode |= E_SEEK;
+        return DATA_INVALID;
+    }
+    if (EtsdInfo.map){
+        if (st.st_size == EtsdInfo.mapSize)
+            return 0;   // nothing new to map
+        munmap(EtsdInfo.map, EtsdInfo.mapSize);
+        EtsdInfo.map = NULL;
+    }
+    if (!st.st_size){
+        ErrorCode |= E_EOF;
+        return DATA_INVALID;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, EtsdInfo.fd, 0);
+    if (MAP_FAILED == map){
+        ErrorCode |= E_MEM;
+        RBlock = &PBlock;
+        return DATA_INVALID;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);  // most queries scan forward through the file
+    EtsdInfo.map = map;
+    EtsdInfo.mapSize = st.st_size;
+    return 0;
+}
+
+void etsdUnmap(){
+    if (EtsdInfo.map){
+        munmap(EtsdInfo.map, EtsdInfo.mapSize);
+        EtsdInfo.map = NULL;
+        EtsdInfo.mapSize = 0;
+    }
+    RBlock = &PBlock;
+}
+
+// number of group <group> sectors in the first <sectors> sectors of the file
+static int32_t etsdCount(off_t sectors, uint8_t group){
+    return sectors > group ? (sectors - group + EtsdInfo.groups - 1) / EtsdInfo.groups : 0;
+}
+
+// returns the number of complete sectors in the ETSD file (including the header sector) or -1 on error
+// in a grouped file only the current group's sectors are counted
+int32_t etsdSectors(){
+    return etsdGroupSectors(EtsdInfo.group);
+}
+
+int32_t etsdGroupSectors(uint8_t group){
+    struct stat st;
+    if (!EtsdInfo.fdMode && etsdOpen('r'))
+        return DATA_INVALID;
+    if (fstat(EtsdInfo.fd, &st)){
+        ErrorCode |= E_SEEK;
+        return DATA_INVALID;
+    }
+    return etsdCount(st.st_size / ETSD_BSIZE, group);
+}
+
+int32_t etsdSync(int32_t fd, uint8_t force){
+    EtsdWrite.pending++;
+    if (!force && (!EtsdWrite.syncBlocks || EtsdWrite.pending < EtsdWrite.syncBlocks)
+            && (!EtsdWrite.syncSecs || ETSD_NOW() - EtsdWrite.lastSync < EtsdWrite.syncSecs))
+        return 0;
+    EtsdWrite.pending = 0;
+    EtsdWrite.lastSync = ETSD_NOW();
+    return fdatasync(fd) ? DATA_INVALID : 0;
+}
+
+// returns a pointer to the data of header extension record <tag> in header sector <hdr>, and its length in *len
+// returns NULL if the ETSD has no header extension or no such record.  Call after etsdInit() has found the extension
+uint8_t *etsdHdrTag(uint8_t *hdr, uint8_t tag, uint8_t *len){
+    uint16_t idx;
+    if (!EtsdInfo.hdrExt)
+        return NULL;
+    for (idx = EtsdInfo.hdrExt+2; idx+2 <= BLOCKSIZE && HX_END != hdr[idx]; idx += 2+hdr[idx+1]){
+        if (tag == hdr[idx] && idx+2+hdr[idx+1] <= BLOCKSIZE){
+            *len = hdr[idx+1];
+            return hdr+idx+2;
+        }
+    }
+    return NULL;
+}
+
+// FNV-1a over everything that decides where a channel's data is in a block (not the labels, unit ID or interval time)
+uint32_t etsdLayoutSig(){
+    uint32_t sig = 2166136261u;
+    uint8_t lp, cnt, hdr[8] = {ETSD_BSIZE>>8, EtsdInfo.blockIntervals, EtsdInfo.channels, EtsdInfo.xDataSize,
+                               EtsdInfo.extStart, EtsdInfo.extStart>>8, EtsdInfo.xDataStart, EtsdInfo.xDataStart>>8};
+
+    for (lp=0; lp<8; lp++)
+        sig = (sig ^ hdr[lp]) * 16777619u;
+    for (lp=0; lp<EtsdInfo.channels; lp++){
+        hdr[0] = EtsdInfo.destination[lp];
+        hdr[1] = EtsdChan[lp].codec;
+        hdr[2] = EtsdChan[lp].zQS;
+        hdr[3] = EtsdChan[lp].scaled;
+        hdr[4] = EtsdChan[lp].zErr;
+        hdr[5] = EtsdChan[lp].zErr>>8;
+        for (cnt=0; cnt<6; cnt++)
+            sig = (sig ^ hdr[cnt]) * 16777619u;
+        if (EtsdChan[lp].isFloat)
+            sig = (sig ^ HX_FLOAT) * 16777619u;
     }
+    return sig;
+}
+
+uint8_t etsdScale(const PBLOCK *blk, uint8_t slot){
+    if (AS_DATA3_SLOTS > slot)
+        return (blk->data[3] >> (2*slot)) & 3;
+    slot -= AS_DATA3_SLOTS;
+    return (blk->byteD[EtsdInfo.scaleStart + slot/4] >> (2*(slot&3))) & 3;
+}
+
+// round to nearest even, overflow becomes infinity
+uint16_t etsdFloatToHalf(uint32_t f){
+    uint32_t sign = (f >> 16) & 0x8000, mant = f & 0x007FFFFF, half, rem, halfway;
+    int32_t exp = ((f >> 23) & 0xFF) - 127 + 15;
+    uint8_t shift;
+
+    if (0xFF == ((f >> 23) & 0xFF))     // Inf or NaN
+        return mant ? HALF_NAN : sign | 0x7C00;
+    if (31 <= exp)                      // too big
+        return sign | 0x7C00;
+    if (0 >= exp){                      // half subnormal (or zero)
+        if (-10 > exp)
+            return sign;
+        mant |= 0x00800000;
+        shift = 14 - exp;
+        half = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        half = (exp << 10) | (mant >> 13);
+        rem = mant & 0x1FFF;
+        halfway = 0x1000;
+    }
+    if (rem > halfway || (rem == halfway && (half & 1)))
+        half++;     // a carry into the exponent is still correct, including rounding up to Inf
+    return sign | half;
+}
+
+uint32_t etsdHalfToFloat(uint16_t h){
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 31, mant = h & 0x3FF;
+
+    if (31 == exp)      // Inf or NaN, NaN's are quieted the same as F16C/NEON hardware conversion
+        return sign | 0x7F800000 | (mant << 13) | (mant ? 0x00400000 : 0);
+    if (exp)
+        return sign | ((exp + 112) << 23) | (mant << 13);
+    if (!mant)
+        return sign;
+    exp = 113;          // subnormal, normalize it
+    while (!(mant & 0x400)){
+        mant <<= 1;
+        exp--;
+    }
+    return sign | (exp << 23) | ((mant & 0x3FF) << 13);
+}
+
+uint32_t etsdAlignBase(){
+    uint32_t timeStamp;
+    if (!EtsdInfo.alignBase && (EtsdInfo.fdMode || !etsdOpen('r'))
+            && sizeof(timeStamp) == pread(EtsdInfo.fd, &timeStamp, sizeof(timeStamp), ETSD_OFFSET(1, 0)))
+        EtsdInfo.alignBase = timeStamp;
+    return EtsdInfo.alignBase;
+}
+
+char *etsdSidecarName(const char *fName, const char *suffix){
+    char *name = (char*)malloc(strlen(fName) + strlen(suffix) + 1);
+    if (NULL == name){
+        ErrorCode |= E_MEM;
+        return NULL;
+    }
+    sprintf(name, "%s%s", fName, suffix);
+    return name;
+}
+
+// aligned files, fills PBlock with the gap block for a slot that was never written (a hole in the file)
+static void gapBlock(int32_t sector){
+    uint16_t lp;
+    for (lp=4; lp<ETSD_BSIZE/2; lp++)
+        PBlock.data[lp] = 0xFFFF;   // invalid readings and registers, same as etsdBlockClear()
+    PBlock.longD[0] = etsdAlignBase() + (sector-1) * EtsdInfo.alignSpan;
+    PBlock.data[2] = EtsdInfo.header;   // no valid intervals
+    PBlock.data[3] = 0;
+    if (1 < EtsdInfo.groups)
+        PBlock.byteD[EtsdInfo.groupPos] = EtsdInfo.group;
+    RBlock = &PBlock;
+}
+
+// allocates <fd> up to at least <end> in EtsdWrite.prealloc sized chunks, so appends don't have to find space one block at a
+// time and the file's extents line up with the flash erase blocks.  The file size isn't changed, unwritten space still reads as holes
+static void etsdPrealloc(int32_t fd, uint16_t bs, off_t end, off_t size){
+    off_t chunk = EtsdWrite.prealloc < bs ? bs : EtsdWrite.prealloc - EtsdWrite.prealloc % bs;
+    off_t from = EtsdWrite.allocEnd ? EtsdWrite.allocEnd : size;
+
+    if (from < end - bs)    // skipped slots of an aligned file stay holes
+        from = end - bs;
+    end = (end + chunk - 1) / chunk * chunk;
+    if (end > from && fallocate(fd, FALLOC_FL_KEEP_SIZE, from, end - from)){
+        Log("<4> Can't preallocate the ETSD file, it will grow as blocks are written\n");
+        EtsdWrite.prealloc = 0;
+        return;
+    }
+    EtsdWrite.allocEnd = end;
+}
 
-    etsd = fopen(EtsdInfo.fileName, mode);
+int32_t etsdWriteBlock(int32_t fd, const PBLOCK *blk, uint16_t bs, int64_t offset){
+    static PBLOCK *aligned = NULL;
+    struct stat st;
+    char name[32];
 
-    switch (mode[0]){
+    if (fstat(fd, &st))
+        return DATA_INVALID;
+    if ((uint64_t)st.st_ino != EtsdWrite.ino){     // a different file (rotated), the O_DIRECT descriptor and preallocation were for the old one
+        if (0 <= EtsdWrite.dfd)
+            close(EtsdWrite.dfd);
+        EtsdWrite.dfd = -1;
+        EtsdWrite.allocEnd = 0;
+        EtsdWrite.ino = st.st_ino;
+    }
+    if (EtsdWrite.prealloc && offset + bs > EtsdWrite.allocEnd)
+        etsdPrealloc(fd, bs, offset + bs, st.st_size);
+    if (EtsdWrite.direct){
+        if (!aligned && posix_memalign((void**)&aligned, ETSD_MAX_BLOCK, sizeof(PBLOCK)))
+            aligned = NULL;
+        if (aligned && 0 > EtsdWrite.dfd){
+            sprintf(name, "/proc/self/fd/%d", fd);
+            EtsdWrite.dfd = open(name, O_WRONLY|O_DIRECT);
+        }
+        if (0 <= EtsdWrite.dfd){
+            memcpy(aligned, blk, bs);
+            if (bs == pwrite(EtsdWrite.dfd, aligned, bs, offset))
+                return 0;
+            close(EtsdWrite.dfd);   // device needs larger alignment than the block size, or the file system doesn't do O_DIRECT
+            EtsdWrite.dfd = -1;
+        }
+        Log("<4> Can't use O_DIRECT on the ETSD file, writing through the page cache\n");
+        EtsdWrite.direct = 0;
+    }
+    return bs == pwrite(fd, blk, bs, offset) ? 0 : DATA_INVALID;
+}
+
+// mode r=read, w=write, a=append.  For read, sector = which sector to read, negative sectors are relative to end of file
+// For append, sector = zero or the sector to write (aligned files), a sector past the end of the file leaves a hole
+// returns zero on success, or  -1(DATA_INVALID) on failure and sets ErrorCode , see errorlog.h for error codes
+// The file stays open between calls, offsets are 64 bit so there is no 2GB limit
+int32_t etsdRW(char *mode, int32_t sector){
+    off_t offset, next;
+    struct stat st;
+    uint16_t bs = ETSD_BSIZE;
+
+    switch (mode[0]|32){    // convert upper case to lower case
         case 'r':     
-            if (etsd > 0) {
-                if(sector){
-                    if(fseek(etsd, sector*BLOCKSIZE, sector<0?SEEK_END:SEEK_SET)){ 
-                        ErrorCode |= E_SEEK;
-                    }
+            if (!EtsdInfo.fdMode && etsdOpen('r')) 
+                return DATA_INVALID;
+            if (0 > sector){
+                if (EtsdInfo.map && etsdMap()){     // file may have grown since we mapped it
+                    ErrorCode |= E_EOF;
+                    return DATA_INVALID;
+                }
+                if (EtsdInfo.map)
+                    sector += etsdCount(EtsdInfo.mapSize / bs, EtsdInfo.group);
+                else if (fstat(EtsdInfo.fd, &st)){
+                    ErrorCode |= E_SEEK;
+                    return DATA_INVALID;
+                } else
+                    sector += etsdCount(st.st_size / bs, EtsdInfo.group);   // ignore any partial sector at the end of the file
+                if (0 > sector){
+                    ErrorCode |= E_SEEK;
+                    return DATA_INVALID;
+                }
+            }
+            offset = ETSD_OFFSET(sector, EtsdInfo.group);
+            if (EtsdInfo.map){  // zero copy, point RBlock into the mapping
+                if (offset + bs > EtsdInfo.mapSize && etsdMap()){ // file may have grown since we mapped it
+                    ErrorCode |= E_EOF;
+                    return DATA_INVALID;
                 }
-                if(1 != fread(&PBlock, BLOCKSIZE, 1, etsd)){ 
+                if (offset + bs > EtsdInfo.mapSize){
                     ErrorCode |= E_EOF;
                     return DATA_INVALID;
                 }
+                RBlock = (PBLOCK*)(EtsdInfo.map + offset);
             } else {
-                ErrorCode |= E_CANT_READ;
+                RBlock = &PBlock;
+                if (bs != pread(EtsdInfo.fd, &PBlock, bs, offset)){ 
+                    ErrorCode |= E_EOF;
+                    return DATA_INVALID;
+                }
+            }
+            EtsdInfo.sector = sector;
+            if (EtsdInfo.alignSpan && sector && !RBlock->longD[0])
+                gapBlock(sector);
+            if (1 < EtsdInfo.groups && sector && EtsdInfo.group != RBlock->byteD[EtsdInfo.groupPos]){
+                ErrorCode |= E_DATA;    // not one of this group's blocks
                 return DATA_INVALID;
             }
             break;
+        case 'w':   // truncate/create file and write PBlock as sector zero
+            etsdClose();
+            EtsdInfo.fd = open(EtsdInfo.fileName, O_RDWR|O_CREAT|O_TRUNC, 0644);
+            if (0 > EtsdInfo.fd){
+                ErrorCode |= E_CANT_WRITE;
+                return DATA_INVALID;
+            }
+            EtsdInfo.fdMode = 'w';
+            if (bs != pwrite(EtsdInfo.fd, &PBlock, bs, ETSD_OFFSET(0, EtsdInfo.group))){
+                ErrorCode |= E_CANT_WRITE;
+                return DATA_INVALID;
+            }
+            EtsdInfo.sector = 0;
+            break;
         case 'a':
-        case 'w':
-            if (etsd > 0) {
-                fwrite(&PBlock, BLOCKSIZE, 1, etsd);
-            } else {
+            if ('w' != EtsdInfo.fdMode && etsdOpen('w'))
+                return DATA_INVALID;
+            if (fstat(EtsdInfo.fd, &st)){
                 ErrorCode |= E_CANT_WRITE;
                 return DATA_INVALID;
             }
+            next = etsdCount((st.st_size + bs - 1) / bs, EtsdInfo.group);   // keep blocks sector aligned even after a partial write
+            if (sector < next)  // never overwrite, a later sector (aligned files) leaves a hole
+                sector = next;
+            offset = ETSD_OFFSET(sector, EtsdInfo.group);
+            if (etsdWriteBlock(EtsdInfo.fd, &PBlock, bs, offset)){
+                ErrorCode |= E_CANT_WRITE;
+                return DATA_INVALID;
+            }
+            EtsdInfo.sector = sector;
             break;
     }
-    fclose(etsd);
     return 0;
 }
-
-
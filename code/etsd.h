@@ -27,47 +27,47 @@ Copyright 2018 Peter VanDerWal
 extern "C" {
 #endif
 
+// BLOCKSIZE is the header sector size and the default block size.  Each file records its own block size (see HX_BSIZE),
+// any size from BLOCKSIZE up to ETSD_MAX_BLOCK can be read and written by the same build
 #ifndef BLOCKSIZE
 #define BLOCKSIZE 512
 #endif
+#define ETSD_MAX_BLOCK 4096
+#define ETSD_BSIZE (EtsdInfo.blockSize ? EtsdInfo.blockSize : BLOCKSIZE)    // block size of the current ETSD
 
 #define SRC_TYPE(a) ((EtsdInfo.source[(a)]>>6)&3)
 //#define SRC_PRIMARY(a)  (!(EtsdInfo.source[(a)]&192)) 
 #define SRC_SHM(a)  (64==(EtsdInfo.source[(a)]&192))
-#define SRC_CHAN(a) (EtsdInfo.source[(a)]&63)
+#define SRC_CHAN(a) ((EtsdInfo.source[(a)]&63) + 64*EtsdInfo.srcUnit)    // channel groups can read a second, third or fourth unit
 #define SRC_RESET(a) (PBlock.data[3] |= 1<<(15-a))  // use an autoscale channel for reset indicator on ECM & SHM, use 2 to handle 4 sources
-#define BLOCK_RESET ((PBlock.data[3] >> 14) & 3)    // Pete only checking two sources right now
+#define BLOCK_RESET ((RBlock->data[3] >> 14) & 3)    // Pete only checking two sources right now
 
-#define CHK_RESET (PBlock.data[3]>>14&3)
+#define CHK_RESET (RBlock->data[3]>>14&3)
 
 #define EDO_BIT(a) (EtsdInfo.destination[(a)]&128)  // External DB
-#define CNT_BIT(a) (EtsdInfo.destination[(a)]&64)
+// half float streams (14) can't be counters
+#define CNT_BIT(a) (EtsdInfo.destination[(a)]&64 && 14!=(EtsdInfo.destination[(a)]&15))
+#define FLOAT_BIT(a) (EtsdChan[(a)].isFloat)   // type 13 float32 stream, see HX_FLOAT
+#define ETSD_FLOAT(a) (FLOAT_BIT(a) || 14==(EtsdInfo.destination[(a)]&15))     // channel values are float bit patterns
 #define REG_BIT(a) (EtsdInfo.destination[(a)]&32)
 #define SIGNED(a) (EtsdInfo.destination[(a)]&16)  
-#define AUTOSC(a) (10==EtsdInfo.destination[(a)]&15?1:0)
-// Pete #define AUTOSC(a) (15==EtsdInfo.destination[(a)]&15?1:0)
+#define AUTOSC(a) (15==(EtsdInfo.destination[(a)]&15))
 //#define EXTS_BIT(a) (EtsdInfo.destination[(a)]&1)
 // EXTS_BIT = Extended Stream (2 bits)
 #define EXTS_BIT(a) (EtsdInfo.destination[(a)]&1 && 13>(EtsdInfo.destination[(a)]&15))
 
 #define ETSD_TYPE(a) (EtsdInfo.destination[(a)]&15) 
 
-#define VALID_INTERVALS (PBlock.data[2] & 127 )
+#define VALID_INTERVALS (RBlock->data[2] & 127 )
 
-#if BLOCKSIZE==512
-#ifndef MAX_CHANNELS
-#define MAX_CHANNELS 63
-#endif
-#define QS_SIZE uint8_t QS
-#else
+// the header has 7 bits for the number of channels, larger blocks can have more than 256 Quarter Streams
 #if MAX_CHANNELS>127
-#undefine MAX_CHANNELS
+#undef MAX_CHANNELS
 #endif
 #ifndef MAX_CHANNELS
 #define MAX_CHANNELS 127
-#define QS_SIZE uint16_t QS
-#endif    
 #endif
+#define QS_SIZE uint16_t QS
 
 #include <signal.h>
 
@@ -76,6 +76,48 @@ const uint32_t ETSD_HEADER = 1146311749 ;   // decimal value of "ETSD"
 
 const uint32_t DATA_INVALID = 0xFFFFFFFF ;  // all ones
 
+// type 14 (half precision float) streams.  NaN is always saved as HALF_NAN so all ones can still mean invalid
+#define HALF_NAN     0x7E00
+#define HALF_INVALID 0xFFFF
+#define HALF_INVALID_F 0xFFFFE000  // HALF_INVALID converted to single precision
+
+// type 13 signed (int32) streams can use all 32 bits, so the most negative value means invalid
+#define INT32_INVALID 0x80000000
+// type 13 float (float32) streams.  All ones (a negative NaN) means invalid, any other NaN is saved as FLOAT_NAN
+#define FLOAT_NAN     0x7FC00000
+
+// Header extension, optional, starts right after the labels in sector 0: "EX" followed by records of
+// tag(1 byte), length(1 byte), data(length bytes).  Ends with tag HX_END or the end of the sector.  Unknown tags are skipped.
+#define HX_MAGIC0 'E'
+#define HX_MAGIC1 'X'
+#define HX_END      0
+#define HX_CODEC    1   // 2 bytes per channel: codec (ZC_xxx), budget in Quarter Streams
+#define HX_ZERR     2   // 2 bytes per channel: ZC_SDOOR max error (little endian)
+#define HX_ASCALE   3   // 1 byte per channel: non zero = auto-scaled 8, 12, 16 or 20 bit stream (types 4, 6, 8, 10)
+#define HX_BSIZE    4   // 1 byte: block size / 512 (2, 4 or 8).  No record = 512 byte blocks.  The header sector is a whole block
+#define HX_GROUP    5   // 3 bytes: this group, number of groups, source unit.  No record = one group, see etsdGroup()
+#define HX_ALIGN    6   // 1 byte: 1 = aligned blocks, every block starts on a multiple of intervalTime * blockIntervals
+#define HX_FLOAT    7   // 1 byte per channel: non zero = type 13 stream of float32 values (gauge)
+
+// Aligned blocks, block s starts at the time of block 1 + (s-1) * EtsdInfo.alignSpan so the sector for any time is one division and no
+// index is needed.  Block slots nothing was saved in are left as holes in the (sparse) file, etsdRW() reads them as gap blocks:
+// the slot's time stamp and no valid intervals
+
+// Channel groups, a file with more than 127 channels is split into groups of up to 127 channels.  Each group has its own
+// header sector, sectors 0 to groups-1, and each logical block is one sector per group: sector s of group g is at g + s*groups.
+// Every group has the same number of intervals per block so the groups stay in step, and a query only reads its own group's sectors
+#define MAX_GROUPS 16
+#define ETSD_OFFSET(s, g) (((int64_t)(s) * EtsdInfo.groups + (g)) * ETSD_BSIZE)  // file offset of sector s of group g, 64 bit in every unit
+
+// Auto-Scaling, each auto-scaled channel has a slot holding its 2 bit scale factor (readings are saved >> scale).
+// Slots 0-6 are in PBlock.data[3] (bits 14-15 are the reset bits), the rest are in the block's scale table at EtsdInfo.scaleStart
+#define AS_DATA3_SLOTS 7
+
+// channel codecs, compressed channels use a variable length bit stream in place of a fixed width stream
+#define ZC_NONE     0
+#define ZC_GORILLA  1   // delta of delta (integers) or XOR (floats), gauges only
+#define ZC_SDOOR    2   // lossy, swinging door breakpoints of a piecewise linear fit, integer gauges only
+
 //const uint32_t ETSD_EPOCH = 1365361200 ;    // Arbitrary value used to extend useful life of ETSD databases.  
                                             // This value will be subtracted from the epoch time to create ETSD timestamps.  
                                             // Any value will work (including 0 ) as long as you are consistent.
@@ -95,6 +137,9 @@ extern uint8_t *MissedUpdate;
 
 extern volatile sig_atomic_t RotateEtsd;
 
+// set when a compressed stream can't be sure of fitting another interval, commit the block before the next interval
+extern uint8_t EtsdBlockFull;
+
 typedef struct { 
     uint16_t header;
     uint16_t extStart;
@@ -111,19 +156,74 @@ typedef struct {
     char *fileName;         // ETSD filename
     char *labelBlob;        // blob of labels, allocated if needed
     uint8_t **label;        // allocated array of pointers to channel labels, points to individual label in labels blob, allocated if needed
+    int32_t fd;             // file descriptor of the open ETSD file, kept open between calls to etsdRW()
+    uint8_t fdMode;         // 0 = closed, 'r' = open read only, 'w' = open read/write
+    int32_t sector;         // sector most recently read or written by etsdRW()
+    uint8_t *map;           // read only mapping of the ETSD file, NULL unless etsdMap() was called
+    int64_t mapSize;        // size in bytes of *map
+    uint16_t hdrExt;        // where the header extension starts in sector 0, zero = no extension
+    uint8_t scaleSlots;     // number of Auto-Scaling slots
+    uint16_t scaleStart;    // location in block of the scale table (slots 7 and up), right after xData
+    uint32_t layoutSig;     // etsdLayoutSig(), set by etsdInit()
+    uint16_t blockSize;     // bytes per block (and header sector), BLOCKSIZE - ETSD_MAX_BLOCK
+    uint8_t group;          // channel group currently loaded, see etsdGroup()
+    uint8_t groups;         // number of channel groups, 1 = not grouped
+    uint8_t srcUnit;        // source unit of this group, added to the source channel as 64*srcUnit
+    uint16_t groupPos;      // location in block of the group ID byte (grouped files only), right after the scale table
+    uint32_t alignSpan;     // aligned files: seconds per block (intervalTime * blockIntervals), zero = blocks aren't aligned
+    uint32_t alignBase;     // aligned files: time stamp of block 1, zero = not read yet, see etsdAlignBase()
 } ETSD_INFO;
 
 extern ETSD_INFO EtsdInfo;
 
+// How committed blocks reach the disk.  Set by the writer (edd config keys WS:, WT:, WD: and WP:), it belongs to the program rather
+// than the file so it isn't in EtsdInfo and is the same for every channel group.  All zero = buffered appends, the kernel decides when,
+// except the journal (etsdJournal.h) has the writer sync at least every JNL_SYNC blocks
+typedef struct {
+    uint16_t syncBlocks;    // fdatasync() after every syncBlocks blocks, zero = don't count blocks
+    uint16_t syncSecs;      // fdatasync() the first block committed syncSecs or more after the last sync, zero = don't check the time
+    uint8_t direct;         // append with O_DIRECT from an aligned buffer, falls back to buffered writes if the file system refuses
+    uint32_t prealloc;      // fallocate() the file this many bytes at a time (i.e. the flash erase block size), zero = grow as written
+    uint16_t pending;       // blocks committed since the last sync
+    uint32_t lastSync;      // time stamp of the last sync
+    int32_t dfd;            // O_DIRECT file descriptor, -1 = not open
+    int64_t allocEnd;       // end of the space allocated by fallocate()
+    uint64_t ino;           // inode of the file dfd and allocEnd belong to
+} ETSD_WRITE;
+
+extern ETSD_WRITE EtsdWrite;
+
+// Per channel stream layout, built once by etsdInit() so saveChan()/readChan() don't have to recount the preceding channels
+typedef struct {
+    uint16_t QS;        // Quarter Stream (4 bits x blockIntervals) where this channel's stream starts
+    uint8_t bits;       // bits saved per interval (including extended stream), zero = not saved to ETSD
+    uint8_t extS;       // 1-?? extended (2 bit) stream used by this channel, zero = none
+    uint8_t AS;         // Auto-Scaling slot, only valid on auto-scaled channels
+    uint8_t scaled;     // non zero = auto-scaled, type 15 or a stream flagged in HX_ASCALE
+    uint8_t isFloat;    // non zero = float32, a type 13 stream flagged in HX_FLOAT
+    uint8_t reg;        // 1-?? register saved at the end of the block, zero = not saving a register
+    uint8_t codec;      // ZC_xxx, zero = fixed width stream
+    uint8_t zQS;        // compressed channels: Quarter Streams reserved for the bit stream
+    uint16_t zStart;    // compressed channels: byte in block where the bit stream starts
+    uint16_t zSize;     // compressed channels: bytes reserved for the bit stream
+    uint16_t zErr;      // ZC_SDOOR channels: max error, readings are reconstructed within +/- zErr
+} ETSD_CHAN;
+
+extern ETSD_CHAN *EtsdChan;     // allocated array, one per channel
+
+// sized for the largest block, only the first EtsdInfo.blockSize bytes are used
 typedef union {
-    uint32_t longD[128];
-    uint16_t data[256];
-    uint8_t byteD[512];
+    uint32_t longD[ETSD_MAX_BLOCK/4];
+    uint16_t data[ETSD_MAX_BLOCK/2];
+    uint8_t byteD[ETSD_MAX_BLOCK];
 } PBLOCK ;
 
 extern PBLOCK PBlock;
+// block most recently read by etsdRW("r",..).  Points to PBlock, or directly into the file mapping after etsdMap()
+// PBlock is the block being built by the save functions, all read functions should use RBlock
+extern PBLOCK *RBlock;
 #define SCALING PBlock.data[3]
-#define TIME_STAMP PBlock.longD[0]
+#define TIME_STAMP RBlock->longD[0]
 
 
 //etsdInit returns zero on success or error code.  -11 can't open fName, -10= file header not etsd.
@@ -133,6 +233,64 @@ int32_t etsdInit(char *fName, uint8_t loadLabels);
 // returns zero on success or error code (see above)
 int32_t etsdRW(char *mode, int32_t sector);
 
+// opens EtsdInfo.fileName and keeps it open until etsdClose(). mode 'r' = read only, 'w' = read/write
+// etsdRW() opens the file automatically, only call this to force a specific mode
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdOpen(char mode);
+
+// closes the ETSD file if it is open
+void etsdClose();
+
+// maps the ETSD file read only.  Afterwards etsdRW("r",..) points RBlock into the mapping instead of copying to PBlock
+// mapping is extended automatically if the file grows. returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+// on failure etsdRW() keeps using pread() so callers can ignore the return value
+int32_t etsdMap();
+
+// drops the mapping created by etsdMap(), RBlock points back at PBlock
+void etsdUnmap();
+
+// returns the number of complete sectors in the ETSD file (including the header sector) or -1 on error
+// in a grouped file this only counts the sectors of the current group
+int32_t etsdSectors();
+
+// aligned files, returns the time stamp of block 1 (the time every other block is counted from) or zero if there are no blocks yet
+uint32_t etsdAlignBase();
+
+// returns the malloc'd name of a file kept next to the ETSD file <fName>, fName + suffix (i.e. "x" for the .tsdx index, "j" for the
+// journal).  Returns NULL and sets ErrorCode = E_MEM if it can't be allocated
+char *etsdSidecarName(const char *fName, const char *suffix);
+
+// same as etsdSectors() for channel group <group>
+int32_t etsdGroupSectors(uint8_t group);
+
+// writes <blk> (<bs> bytes) at <offset> in the ETSD file open as <fd>, using EtsdWrite's O_DIRECT and preallocation settings
+// Doesn't use EtsdInfo or ErrorCode, so a writer thread can call it while another thread builds the next block (see edd.c)
+// returns zero on success, or -1(DATA_INVALID) and errno is set
+int32_t etsdWriteBlock(int32_t fd, const PBLOCK *blk, uint16_t bs, int64_t offset);
+
+// counts a block written to <fd> and flushes the file to the disk (fdatasync) when EtsdWrite says it's time, or <force> is set
+// (i.e. before a rotate, or when the journal needs it, see JNL_SYNC).  Doesn't use EtsdInfo or ErrorCode either.  returns zero on success, or -1(DATA_INVALID) and errno is set
+int32_t etsdSync(int32_t fd, uint8_t force);
+
+// loads the layout of channel group <group>, channel numbers and sectors then refer to that group only.  Layouts are kept
+// so switching back is cheap.  returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdGroup(uint8_t group);
+
+// returns a pointer to the data of header extension record <tag> in header sector <hdr> (normally a copy of sector 0)
+// and its length in *len.  Returns NULL if there is no header extension or no such record
+uint8_t *etsdHdrTag(uint8_t *hdr, uint8_t tag, uint8_t *len);
+
+// returns a signature of the current ETSD's block layout.  Decoders generated by "etsdCmd gen" check it against EtsdInfo.layoutSig
+uint32_t etsdLayoutSig();
+
+// returns the scale factor (0-3) of Auto-Scaling slot <slot> in block <blk>
+uint8_t etsdScale(const PBLOCK *blk, uint8_t slot);
+
+// IEEE 754 single <-> half precision conversion, using the bit patterns so no float support is needed
+// etsdFloatToHalf() rounds to nearest even, NaN becomes HALF_NAN.  etsdHalfToFloat() is exact (NaN's are quieted)
+uint16_t etsdFloatToHalf(uint32_t f);
+uint32_t etsdHalfToFloat(uint16_t h);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,6 +23,7 @@ Copyright 2018 Peter VanDerWal
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>       // INFINITY
 //#include <ctype.h>      // for isalnum()
 #include <unistd.h>     //sleep() usleep()
 #include <termios.h>    //_getch*/
@@ -30,10 +31,17 @@ Copyright 2018 Peter VanDerWal
 #include "etsd.h"
 #include "etsdRead.h"
 #include "etsdQuery.h"
+#include "etsdIndex.h"
+#include "etsdRegIndex.h"
+#include "etsdRollup.h"
+#include "etsdZone.h"
 #include "etsdRRD.h"
+#include "etsdCodec.h"
 
 #define AC_OFFSET 1040
 
+static int32_t genLayout(char *hName);
+
 // returns zero(success) if string only contains alpha numerics and/or '_'
 int stralnum(char *str, uint8_t size){
     uint8_t lp;
@@ -71,6 +79,17 @@ char getch(){
     return buf;
  }
 
+// selects the channel group given by a g=<group> argument, files with channel groups default to group 0
+static void cmdGroup(int argc, char *argv[]){
+    int lp;
+    for (lp=3; lp<argc; lp++){
+        if ('g' == (argv[lp][0]|32) && '=' == argv[lp][1] && etsdGroup(atoi(argv[lp]+2))){
+            fprintf(stderr, "Error: %s has %u channel groups, can't select %s\n", EtsdInfo.fileName, EtsdInfo.groups, argv[lp]);
+            exit(1);
+        }
+    }
+}
+
 /*
 ./etsdCmd create /var/db/garage.tsd /var/db/garage.rrd u=1 T=10s GarageMain:9:E1:r Servers:15:E2:r Fridge_Freezer:8:E5:r AC_Voltage:4:E11:G Water_Heater:8:E7:r TV_Entertainment:8:E6:r Evap_Solar:8:E8:r Mini_Split:8:E9:r
 
@@ -80,26 +99,42 @@ if user specifies an rrd file, then automatically create rrd file, otherwise out
 t= Interval Time [optional]last character S,M,H  for seconds, minutes, hours
 u= UID
 x= extra data
+a=1 aligned blocks, each block starts on a multiple of its length (interval time x intervals) so finding a time needs no index
+g= starts a channel group (source unit 0-3), for more than 127 channels.  Each group has up to 127 channels and its own sectors, see etsd.h
 
 Channel Definitions =  ChanName:StreamType:Source&Channel:  I=Intiger(Signed) : G=Gauge(default counter) : R=RRD : S=Save Register(force on) <or> s=Register(force off)
+Type 13 (32 bit) channels are always gauges: plain = raw 32 bits, I = int32, F = float32.  Type 14 = half precision float.
+Z<n> = compressed gauge (see etsdCodec.c) with a budget of <n> Quarter Streams (4 bits per interval, default 1) in place of its fixed stream.
+    Blocks are committed early if a compressed channel runs out of room.  Not allowed on counters or AutoScaling (15) channels.
+A = Auto-Scaling on an 8, 12, 16 or 20 bit unsigned stream (types 4, 6, 8, 10), like type 15.  Readings up to ~8x the stream's range are
+    saved with the block's scale factor (1x, 2x, 4x or 8x).  Not allowed on compressed channels.
+L<n> = lossy compressed gauge, readings are saved as a piecewise linear fit within +/- <n> (swinging door).  Implies Z1 unless Z is given.  Not allowed on floats.
 32bit Registers are saved by default on 'counter' channels and off by degault on Gauge channels S/s can be used to change that behavior. 
 
 Source&Channel E# = ECM chan #, M# = shared Memory chan #.
 */
-// Must specify new ETSD file, if there is an RRD cmd line arguement it will create the rrd, 
-// otherwise it will output the text for creating an rrd
-int32_t createETSD(int argc, char *argv[]){
-    FILE *fd;
+
+// builds the header sector of one channel group in <block>, from the <cdx> channel definitions in chanDef.  Intervals per block
+// are limited to maxIntervals so every group can be given the same number.  Exits on any error
+// returns the number of intervals per block
+static uint8_t buildHeader(uint8_t *block, char **chanDef, uint16_t cdx, uint8_t maxIntervals, uint16_t intTime, uint8_t uID, uint16_t xData, 
+                           uint16_t blockSize, uint8_t group, uint8_t groups, uint8_t unit, uint8_t align, uint8_t report){
     uint8_t order[]={1, 2, 3, 6, 7, 10, 11, 4, 5, 12, 8, 9, 13, 14, 15};  // channel sort reverse order
-    uint8_t block[BLOCKSIZE] = {0};
-    char *chanDef[MAX_CHANNELS];
     char *sorted[MAX_CHANNELS];
-    char *ptr, *ptr2, *etsd, *rrd, *rraV[10];
-    uint8_t rraC, channels=0, uID=0, registers=0, cdx=0, source, destination, *chanMap;
-//pete create help variable
-    uint16_t streams = 0, QS=0, xData=0, intervals=0, intTime=10;
+    uint8_t zBudget[MAX_CHANNELS] = {0}, zCodec[MAX_CHANNELS] = {0}, zPass, zCnt = 0, sdCnt = 0;
+    uint16_t zErr[MAX_CHANNELS] = {0};
+    uint8_t asFlag[MAX_CHANNELS] = {0}, fFlag[MAX_CHANNELS] = {0}, fCnt = 0, asCnt = 0, scaleSlots = 0, scaleBytes = 0, quarter = 0, extCnt = 0;
+    char *ptr, *ptr2;
+    uint8_t channels=0, registers=0, source, destination;
+    uint16_t streams = 0, QS=0, intervals=0;
     int32_t lp=0, lp2, labelSize=0, idx=3; 
     uint32_t Time = ETSD_HEADER;
+
+    if (MAX_CHANNELS<cdx){
+        printf("Error: Total channels = %d, but the maximum allowes is %d.  Use channel groups (g=) for more.\n", cdx, MAX_CHANNELS);
+        exit(1);
+    }
+    memset(block, 0, blockSize);
     block[lp++]=Time;
     block[lp++]=Time>>8;
     block[lp++]=Time>>16;
@@ -117,54 +152,9 @@ int32_t createETSD(int argc, char *argv[]){
     } ht = {ETSD_HEADER}; // Ugly code but works, creates a header that matches ETSD_HEADER constant defined in etsdSave.h
     strncpy(block, ht.TIME, 4);  
 */
-   
-    if (1 < argc) {  // we have command line arguments
-
-        etsd=argv[2];
-        
-        if (strchr(argv[3], '/') || strcasestr(argv[3], ".rrd")){
-            rrd=argv[3];
-            idx=4;
-        } else {
-            rrd="";
-        }
-
-        for ( lp = idx; lp < argc; lp++ ){
-            if (ptr = strchr(argv[lp],'=')){ 
-                switch(ptr++[-1]){   //*(ptr-1)
-                    case 't':
-                    case 'T':
-                        intTime = atoi(ptr);
-                        switch(ptr[strlen(ptr)-1]){
-                            case 'm':
-                            case 'M':
-                                intTime *=60;
-                                break;
-                            case 'h':
-                            case 'H':
-                                intTime *=3600;
-                                break;
-                        }
-                        break;
-                    case 'u':
-                    case 'U':
-                        uID  = atoi(ptr)&3;
-                        break;
-                    case 'x':
-                    case 'X':
-                        xData = atoi(ptr);
-                        break;
-                }
-            } else { // no equals sign so must be a channel definition
-                chanDef[cdx++]=argv[lp];
-            }
-        }       
-    } else {
-        //printf("%s",help);
-        exit (1);
-    }
-//GarageMain:9:E1:r
-    for(lp2=15; lp2; lp2--){ // sort channels starting with large streams and work down to small streams
+    // sort channels starting with large streams and work down to small streams, compressed channels go after all the fixed streams
+    for(zPass=0; zPass<2; zPass++)
+    for(lp2=14; lp2>=0; lp2--){ 
         for(lp=0;lp<cdx;lp++){
             ptr2=chanDef[lp];
             ptr=strchr(ptr2,':');  
@@ -177,18 +167,13 @@ int32_t createETSD(int argc, char *argv[]){
                 fprintf(stderr,"Error, Bad channel name: %.*s\nChannel names can only contain alphanumeric characters and underscores '_' .\n", idx, ptr2);
                 exit(1);
             }
-            if(atoi(ptr+1) == order[lp2]){
+            if(atoi(ptr+1) == order[lp2] && zPass == (strcasestr(ptr, ":z") || strcasestr(ptr, ":l"))){
                 sorted[channels++]=ptr2;
                 labelSize += idx;
             }
         }
     }
 
-    if (MAX_CHANNELS<channels){
-        printf("Error: Total channels = %d, but the maximum allowes is %d.\n", channels, MAX_CHANNELS);
-        exit(1);
-    }
-    
     if (labelSize > BLOCKSIZE-10-channels*2){
         fprintf(stderr,"Error. Labels exceed available space by: %d characters.\n", labelSize-(BLOCKSIZE-10-channels*3));
         exit(1);
@@ -196,7 +181,8 @@ int32_t createETSD(int argc, char *argv[]){
     idx = 10; // set index to start of channel data
     cdx=10+2*channels;
     for(lp=0;lp<channels;lp++){
-        uint8_t gauge = 0;
+        uint8_t gauge = 0, chQS;
+        uint16_t chStreams;
         
         ptr=strchr(sorted[lp],':'); 
         memcpy(block+cdx,sorted[lp],ptr-sorted[lp]);
@@ -224,25 +210,21 @@ int32_t createETSD(int argc, char *argv[]){
         }
 */
         switch(destination){
-            case 14:
             case 13:
-                streams += 8;
-                QS += 4;
+                chStreams = 16;
+                chQS = 8;
+                break;
+            case 14:
             case 15:
-                streams += 8;
-                QS += 4;
+                chStreams = 8;
+                chQS = 4;
                 break;
             default:
-                streams += destination;  
-                QS += (destination&14)/2;
+                chStreams = destination;  
+                chQS = (destination&14)/2;
         }        
 
         // RRD:G/C:Reg:SignedInt:StreamType(4bits)
-#if BLOCKSIZE==512
-       if (QS>256)
-            printf("Too many channels, ran out of Quarter Streams.  Please reduce number of channels to use 255 Quarter Streams or less.\n");
-#endif
-        
         destination |= 96; // default stream type = counter & saved Registers
         registers++;
         while(ptr=strchr(ptr,':')){
@@ -257,6 +239,10 @@ int32_t createETSD(int argc, char *argv[]){
                     registers--;
                     gauge=1;
                     break;
+                case 'f':
+                case 'F':
+                    fFlag[lp] = 1;
+                    break;
                 case 'i':
                 case 'I':
                     destination |= 16;
@@ -281,24 +267,102 @@ int32_t createETSD(int argc, char *argv[]){
                         registers++;
                     }
                     break;
+                case 'z':
+                case 'Z':
+                    zBudget[lp] = atoi(ptr+1) ? atoi(ptr+1) : 1;
+                    break;
+                case 'a':
+                case 'A':
+                    asFlag[lp] = 1;
+                    break;
+                case 'l':
+                case 'L':
+                    zCodec[lp] = ZC_SDOOR;
+                    zErr[lp] = atoi(ptr+1);
+                    break;
             }
         }
-        if( 13==destination&15 || 14==destination&15){ 
+        if (zCodec[lp] && (14 == (destination&15) || (13 == (destination&15) && fFlag[lp]))){
+            fprintf(stderr,"Warning: %.*s, float channels can't use lossy compression, ignoring L.\n", (int)(strchr(sorted[lp],':')-sorted[lp]), sorted[lp]);
+            zCodec[lp] = ZC_NONE;
+        }
+        if (zCodec[lp] && !zBudget[lp])
+            zBudget[lp] = 1;
+        if (zBudget[lp]){
+            if (!gauge || 15 == (destination&15) || !(destination&15)){
+                fprintf(stderr,"Warning: %.*s, only gauges of type 1-14 can be compressed, ignoring Z and L.\n", (int)(strchr(sorted[lp],':')-sorted[lp]), sorted[lp]);
+                zBudget[lp] = 0;
+                zCodec[lp] = ZC_NONE;
+            } else {
+                if (!zCodec[lp])
+                    zCodec[lp] = ZC_GORILLA;
+                else
+                    sdCnt++;
+                chStreams = 2*zBudget[lp];
+                chQS = zBudget[lp];
+                zCnt++;
+            }
+        }
+        if (asFlag[lp]){
+            if (zBudget[lp] || destination&16 || (4 != (destination&15) && 6 != (destination&15) && 8 != (destination&15) && 10 != (destination&15))){
+                fprintf(stderr,"Warning: %.*s, only uncompressed, unsigned streams of type 4, 6, 8 or 10 can be auto-scaled, ignoring A.\n", (int)(strchr(sorted[lp],':')-sorted[lp]), sorted[lp]);
+                asFlag[lp] = 0;
+            } else
+                asCnt++;
+        }
+        if (asFlag[lp] || 15 == (destination&15))
+            scaleSlots++;
+        if (1&chQS && !zBudget[lp])
+            quarter = 1;
+        if (1&destination && 13 > (destination&15) && !zBudget[lp])   // extended (2 bit) stream
+            extCnt++;
+        streams += chStreams;
+        QS += chQS;
+
+        if( 13==(destination&15) || 14==(destination&15)){ 
             if (destination & 32)
                 registers--;
             destination &= 159;  // force 'counter' and save register off
+            if (14==(destination&15))
+                destination &= 239; // half floats are already signed
+            else if (fFlag[lp]){
+                destination &= 239; // floats are already signed
+                fCnt++;
+            }
         }
+        if (13 != (destination&15))
+            fFlag[lp] = 0;
         block[idx++]=source;
         block[idx++]=destination;
     }
 
-    intervals = (BLOCKSIZE-8-xData-registers*4) / (streams/4.0);
+    if (AS_DATA3_SLOTS < scaleSlots)     // scale table for the Auto-Scaling slots that don't fit in data[3]
+        scaleBytes = (scaleSlots - AS_DATA3_SLOTS + 3) / 4;
+    if (1 < groups && zCnt){     // the codec keeps its state by channel number, which every group reuses
+        fprintf(stderr,"Error: compressed channels (Z and L) can't be used in a file with channel groups.\n");
+        exit(1);
+    }
+    if (1 < groups)     // group ID byte
+        scaleBytes++;
+    intervals = (blockSize-8-xData-scaleBytes-registers*4) / (streams/4.0);
 
-    if(127<intervals){
-        intervals = 127 ;
+    if(maxIntervals<intervals){
+        intervals = maxIntervals;
     }  
+    if (quarter && 1&intervals)    // quarter streams are blockIntervals/2 bytes long, so they need an even number of intervals
+        intervals--;
+    // etsdInit() rounds the fixed streams and the extended streams up to whole bytes separately
+    while (intervals && 8 + ((streams-extCnt)*intervals+3)/4 + (extCnt*intervals+3)/4 > blockSize-xData-scaleBytes-registers*4)
+        intervals -= quarter ? 2 : 1;
+    if (2 > intervals){
+        fprintf(stderr,"Error: the channels%s don't fit in a %u byte block, use fewer channels or a larger block size (b=).\n", 1 < groups ? " of a group" : "", blockSize);
+        exit(1);
+    }
     
-    printf(" Saving %d registers | channels = %d | intervals = %d | interval time = %d seconds | bytes per interval = %.2f\n Wasted space = %d bytes.\n\n", registers, channels, intervals, intTime, streams/4.0, (BLOCKSIZE-8-xData-registers*4-(int)((intervals*streams+3)/4)));
+    if (report && 1 < groups)
+        printf(" Group %u, source unit %u:\n", group, unit);
+    if (report)
+        printf(" Saving %d registers | channels = %d | intervals = %d | interval time = %d seconds | bytes per interval = %.2f\n Wasted space = %d bytes.\n\n", registers, channels, intervals, intTime, streams/4.0, (blockSize-8-xData-scaleBytes-registers*4-(int)(((streams-extCnt)*intervals+3)/4 + (extCnt*intervals+3)/4)));
 
     block[4] = intervals<<7 | channels;  // little endian
     block[5] = uID<<6 | intervals>>1;
@@ -306,11 +370,179 @@ int32_t createETSD(int argc, char *argv[]){
     block[7] = intTime>>8;
     block[8] = (labelSize+channels+1)/2;
     block[9] = xData;
+
+    if (zCnt || asCnt || fCnt || BLOCKSIZE != blockSize || 1 < groups || align){  // header extension, has to fit in the first BLOCKSIZE bytes
+        idx = 10 + 2*channels + 2*block[8];
+        if (idx + 3 + (zCnt ? 2+2*channels : 0) + (sdCnt ? 2+2*channels : 0) + (asCnt ? 2+channels : 0) + (fCnt ? 2+channels : 0) + (BLOCKSIZE != blockSize ? 3 : 0) + (1 < groups ? 5 : 0) + (align ? 3 : 0) > BLOCKSIZE){
+            fprintf(stderr,"Error: no room in the header for the compressed/auto-scaled/float32 channel tables, use shorter channel names.\n");
+            exit(1);
+        }
+        block[idx++] = HX_MAGIC0;
+        block[idx++] = HX_MAGIC1;
+    }
+    if (zCnt){  // codec and budget for every channel, plus max error if any are lossy
+        block[idx++] = HX_CODEC;
+        block[idx++] = 2*channels;
+        for(lp=0;lp<channels;lp++){
+            block[idx++] = zCodec[lp];
+            block[idx++] = zBudget[lp];
+            lp2 = ZC_SDOOR == zCodec[lp] ? ZSD_RESERVE : ZMAX_BITS;
+            if (zBudget[lp] && zBudget[lp]*intervals*4 < 2*lp2){
+                fprintf(stderr,"Error: channel %d, Z%d is too small for %d intervals, needs at least %d bits per block.\n", lp, zBudget[lp], intervals, 2*lp2);
+                exit(1);
+            }
+        }
+        if (sdCnt){
+            block[idx++] = HX_ZERR;
+            block[idx++] = 2*channels;
+            for(lp=0;lp<channels;lp++){
+                block[idx++] = zErr[lp];
+                block[idx++] = zErr[lp]>>8;
+            }
+        }
+    }
+    if (asCnt){
+        block[idx++] = HX_ASCALE;
+        block[idx++] = channels;
+        for(lp=0;lp<channels;lp++)
+            block[idx++] = asFlag[lp];
+    }
+    if (fCnt){
+        block[idx++] = HX_FLOAT;
+        block[idx++] = channels;
+        for(lp=0;lp<channels;lp++)
+            block[idx++] = fFlag[lp];
+    }
+    if (BLOCKSIZE != blockSize){
+        block[idx++] = HX_BSIZE;
+        block[idx++] = 1;
+        block[idx++] = blockSize / BLOCKSIZE;
+    }
+    if (1 < groups){
+        block[idx++] = HX_GROUP;
+        block[idx++] = 3;
+        block[idx++] = group;
+        block[idx++] = groups;
+        block[idx++] = unit;
+    }
+    if (align){
+        block[idx++] = HX_ALIGN;
+        block[idx++] = 1;
+        block[idx++] = 1;
+    }
+    if (zCnt || asCnt || fCnt || BLOCKSIZE != blockSize || 1 < groups || align)
+        block[idx] = HX_END;
+    return intervals;
+}
+
+// Must specify new ETSD file, if there is an RRD cmd line arguement it will create the rrd, 
+// otherwise it will output the text for creating an rrd
+int32_t createETSD(int argc, char *argv[]){
+    FILE *fd;
+    static uint8_t block[MAX_GROUPS*ETSD_MAX_BLOCK];    // one header sector per channel group
+    char *chanDef[MAX_GROUPS*MAX_CHANNELS];
+    char *ptr, *etsd, *rrd, *rraV[10], *hFile = NULL;
+    uint8_t rraC, channels=0, uID=0, *chanMap, groups=0, grp, grpUnit[MAX_GROUPS] = {0}, cap, intervals=127, align=0;
+//pete create help variable
+    uint16_t xData=0, intTime=10, blockSize=BLOCKSIZE, cdx=0, grpStart[MAX_GROUPS+1] = {0};
+    int32_t lp=0, lp2, idx=3; 
     
+    if (1 < argc) {  // we have command line arguments
+
+        etsd=argv[2];
+        
+        if (strchr(argv[3], '/') || strcasestr(argv[3], ".rrd")){
+            rrd=argv[3];
+            idx=4;
+        } else {
+            rrd="";
+        }
+
+        for ( lp = idx; lp < argc; lp++ ){
+            if (ptr = strchr(argv[lp],'=')){ 
+                switch(ptr++[-1]){   //*(ptr-1)
+                    case 't':
+                    case 'T':
+                        intTime = atoi(ptr);
+                        switch(ptr[strlen(ptr)-1]){
+                            case 'm':
+                            case 'M':
+                                intTime *=60;
+                                break;
+                            case 'h':
+                            case 'H':
+                                intTime *=3600;
+                                break;
+                        }
+                        break;
+                    case 'u':
+                    case 'U':
+                        uID  = atoi(ptr)&3;
+                        break;
+                    case 'x':
+                    case 'X':
+                        xData = atoi(ptr);
+                        break;
+                    case 'h':
+                    case 'H':
+                        hFile = ptr;    // generate a specialized decoder, see genLayout()
+                        break;
+                    case 'g':
+                    case 'G':       // starts a channel group, the channels before the first g= are group 0 (source unit 0)
+                        if (cdx && !groups)
+                            groups = 1;
+                        if (MAX_GROUPS == groups){
+                            fprintf(stderr,"Error: too many channel groups, the maximum is %d.\n", MAX_GROUPS);
+                            exit(1);
+                        }
+                        grpStart[groups] = cdx;
+                        grpUnit[groups++] = atoi(ptr)&3;
+                        break;
+                    case 'a':
+                    case 'A':
+                        align = !!atoi(ptr);    // aligned blocks, see HX_ALIGN
+                        break;
+                    case 'b':
+                    case 'B':
+                        blockSize = atoi(ptr);
+                        if (blockSize < BLOCKSIZE || ETSD_MAX_BLOCK < blockSize || (blockSize & (blockSize-1))){
+                            fprintf(stderr,"Error: block size must be 512, 1024, 2048 or 4096 bytes.\n");
+                            exit(1);
+                        }
+                        break;
+                }
+            } else if (MAX_GROUPS*MAX_CHANNELS > cdx){ // no equals sign so must be a channel definition
+                chanDef[cdx++]=argv[lp];
+            }
+        }       
+    } else {
+        //printf("%s",help);
+        exit (1);
+    }
+    if (!groups)
+        groups = 1;
+    grpStart[groups] = cdx;
+    for (grp=0; grp<groups; grp++){
+        if (grpStart[grp] == grpStart[grp+1]){
+            fprintf(stderr,"Error: channel group %u has no channels.\n", grp);
+            exit(1);
+        }
+    }
+    // every group has to have the same number of intervals per block, trim them all to the smallest until they agree
+    do {
+        cap = intervals;
+        for (grp=0; grp<groups; grp++){
+            lp = buildHeader(block + grp*blockSize, chanDef + grpStart[grp], grpStart[grp+1] - grpStart[grp], cap, intTime, uID, xData, blockSize, grp, groups, grpUnit[grp], align, 0);
+            if (lp < intervals)
+                intervals = lp;
+        }
+    } while (intervals != cap);
+    for (grp=0; grp<groups; grp++)
+        buildHeader(block + grp*blockSize, chanDef + grpStart[grp], grpStart[grp+1] - grpStart[grp], intervals, intTime, uID, xData, blockSize, grp, groups, grpUnit[grp], align, 1);
     // Pete test to see if file already exists and prompt user to overwrite
  
     if (fd = fopen(etsd, "w")) {
-        fwrite(&block, BLOCKSIZE, 1, fd);
+        fwrite(block, blockSize, groups, fd);     // header sector is a whole block, one per group
         fclose(fd);
     } else{
         fprintf(stderr,"Error: Can't open %s for writing.\n", etsd);
@@ -318,6 +550,8 @@ int32_t createETSD(int argc, char *argv[]){
     }
 
     etsdInit(etsd, 1); // open newly created etsd so we can use it to create rrd
+    if (hFile && genLayout(hFile))
+        exit(1);
 
     chanMap=malloc(EtsdInfo.channels);
     for (lp=0; lp<EtsdInfo.channels; lp++){
@@ -343,11 +577,153 @@ int32_t createETSD(int argc, char *argv[]){
     }
 }
 
+// prints an etsdKS() time
+static void ksTime(char *name, uint32_t tTime){
+    char buf[22];
+    time_t t = ETSD_TO_EPOCH(tTime);
+    strftime(buf, sizeof(buf), "%D %T", localtime(&t));
+    printf(" %s %s", name, buf);
+}
+
+// prints an etsdKS() reading and its time if not zero
+static void ksPrint(char *name, uint8_t chan, uint32_t val, uint32_t tTime){
+    printf(" %s %.*g", name, ETSD_FLOAT(chan) ? 7 : 10, etsdKSDouble(chan, val));    // float32 has ~7 digits
+    if(tTime)
+        ksTime("at", tTime);
+}
+
+// q=stats, see etsdKS()
+static void queryKS(uint8_t *chans, uint16_t nChan, uint32_t start, uint32_t end, double *thresh, uint8_t have, uint8_t rate){
+    ETSD_KS *ks = calloc(nChan, sizeof(ETSD_KS));
+    uint16_t lp;
+    uint8_t chan;
+
+    if(!ks){
+        ErrorCode |= E_MEM;
+        ELog(__func__, 1);
+        exit(1);
+    }
+    for(lp=0; lp<nChan; lp++){
+        ks[lp].chan = chan = chans[lp];
+        ks[lp].start = start;
+        ks[lp].end = end;
+        ks[lp].rate = rate;
+        ks[lp].over = have&1 ? etsdKSValue(chan, thresh[0]) : etsdKSValue(chan, INFINITY);
+        ks[lp].under = have&2 ? etsdKSValue(chan, thresh[1]) : etsdKSValue(chan, -INFINITY);
+        ks[lp].equal = have&4 ? etsdKSValue(chan, thresh[2]) : etsdKSValue(chan, INFINITY);   // out of the way, so it doesn't stop blocks being skipped
+    }
+    if(etsdKS(ks, nChan)){
+        fprintf(stderr, "Error: query of %s failed\n", EtsdInfo.fileName);
+        exit(1);
+    }
+    for(lp=0; lp<nChan; lp++){
+        chan = ks[lp].chan;
+        printf("%s: %u intervals, %u invalid\n", EtsdInfo.label[chan], ks[lp].intvCnt, ks[lp].errCnt);
+        if(ks[lp].intvCnt == ks[lp].errCnt)
+            continue;
+        printf("  interval");
+        ksPrint("min", chan, ks[lp].iMin, ks[lp].tMin);
+        ksPrint("max", chan, ks[lp].iMax, ks[lp].tMax);
+        ksPrint("ave", chan, ks[lp].iAve, 0);
+        if(CNT_BIT(chan)){
+            printf("\n  per second");
+            ksPrint("min", chan, ks[lp].min, 0);
+            ksPrint("max", chan, ks[lp].max, 0);
+            ksPrint("ave", chan, ks[lp].ave, 0);
+        }
+        printf("\n  total %" PRId64 " raw total %" PRId64 "\n", ks[lp].Tot, ks[lp].RTot);
+        if(have&1){
+            printf("  over %g: %u intervals", thresh[0], ks[lp].nOver);
+            if(ks[lp].nOver){
+                ksPrint("average", chan, ks[lp].AWO, 0);
+                ksTime("first at", ks[lp].fOver);
+            }
+            printf("\n");
+        }
+        if(have&2){
+            printf("  under %g: %u intervals", thresh[1], ks[lp].nUnder);
+            if(ks[lp].nUnder){
+                ksPrint("average", chan, ks[lp].AWU, 0);
+                ksTime("first at", ks[lp].fUnder);
+            }
+            printf("\n");
+        }
+        if(have&4){
+            printf("  equal %g: %u intervals", thresh[2], ks[lp].nEqual);
+            if(ks[lp].nEqual)
+                ksTime("first at", ks[lp].fEqual);
+            printf("\n");
+        }
+    }
+    free(ks);
+}
+
+// res=<step>, prints each aggregate of each channel for every step from start to end, see etsdRollSeries()
+static void querySeries(uint8_t *chans, uint16_t nChan, uint8_t *aggs, uint8_t nAgg, uint32_t start, uint32_t end, uint32_t res){
+    const char *aggName[] = {"tot", "ave", "min", "max"};
+    uint32_t n, step;
+    int32_t used;
+    uint16_t c;
+    uint8_t a;
+    double v;
+    ETSD_ROLL *out, *r;
+
+    if(EtsdInfo.group){
+        printf("Rollup tiers are only kept for channel group 0\n");
+        exit(1);
+    }
+    start -= start % res;       // steps line up with the tiers' buckets
+    n = (end - start + res - 1) / res;
+    if(NULL == (out = malloc((size_t)n * nChan * sizeof(ETSD_ROLL)))){
+        ErrorCode |= E_MEM;
+        ELog(__func__, 1);
+        exit(1);
+    }
+    etsdRollOpen(NULL, 0, 0);
+    if(0 > (used = etsdRollSeries(chans, nChan, start, res, n, out))){
+        fprintf(stderr, "Error: query of %s failed\n", EtsdInfo.fileName);
+        exit(1);
+    }
+    fprintf(stderr, "%u second steps from the %d second %s\n", res, used, used == EtsdInfo.intervalTime ? "intervals" : "rollup tier");
+    printf("time");
+    for(c=0; c<nChan; c++)
+        for(a=0; a<nAgg; a++)
+            printf(",%s %s", EtsdInfo.label[chans[c]], aggName[aggs[a]]);
+    printf("\n");
+    for(step=0; step<n; step++){
+        printf("%u", start + step * res);
+        for(c=0; c<nChan; c++){
+            r = &out[step * nChan + c];
+            for(a=0; a<nAgg; a++){
+                if(!r->cnt){
+                    printf(",");
+                    continue;
+                }
+                switch(aggs[a]){
+                    case SCAN_MIN: v = r->min; break;
+                    case SCAN_MAX: v = r->max; break;
+                    case SCAN_AVE: v = CNT_BIT(chans[c]) ? r->sum / res : r->sum / r->cnt; break;   // counters per second
+                    default:       v = r->sum;
+                }
+                printf(",%.*g", ETSD_FLOAT(chans[c]) || SCAN_AVE == aggs[a] ? 7 : 15, v);
+            }
+        }
+        printf("\n");
+    }
+    free(out);
+    etsdRollClose();
+}
+
 //fName, start= end= output=[input|etsd/raw]
 int32_t queryETSD(int argc, char *argv[]){
-    uint8_t lp, lp2, chan=0, seRel=0;
+    uint8_t lp, lp2, chan=0, seRel=0, group=0, nAgg=0, aggs[4], chans[MAX_CHANNELS], stats=0, have=0, rate=0;
+    double thresh[3] = {0, 0, 0};  // over, under and equal for q=stats, bits 0-2 of have are set when given
+    uint16_t nChan=0, item;
+    uint32_t res=0;
+    const char *aggName[] = {"tot", "ave", "min", "max"};
+    ETSD_SCAN *items;
  //   uint8_t *chanMap;
-    char *ptr, *ptr2, *cmd;
+    char *ptr, *ptr2;
     uint32_t start=0, end=0; // modular arithmetic and integer promotion make this work even if we temporarily store a negative value in start
     time_t now=time(NULL);
 
@@ -357,6 +733,8 @@ int32_t queryETSD(int argc, char *argv[]){
             fprintf(stderr, "Error: can't open ETSD file %s \n", argv[2] );  // Log Error
             //exit(1);
         }    
+        etsdMap();  // queries only read, use the file in place rather than copying each block
+        cmdGroup(argc, argv);
 //        Line=malloc( EtsdInfo.channels*11);
 //        chanMap=malloc(EtsdInfo.channels);
         for(lp=3; lp< argc; lp++){
@@ -398,6 +776,11 @@ int32_t queryETSD(int argc, char *argv[]){
                         break;
                     case 'e':
                     case 'E':
+                        if('q' == (argv[lp][1]|32)){    // eq[ual]=
+                            thresh[2] = atof(ptr);
+                            have |= 4;
+                            break;
+                        }
                         end = etsdParseTime(ptr);
                         if(strcasestr(ptr,"start")){
                             if(!start) {
@@ -427,18 +810,54 @@ int32_t queryETSD(int argc, char *argv[]){
                         }
                         break;
                     case 'c':
-                    case 'C':
-                        if(!(chan=atoi(ptr))){
-                            if (255==(chan=etsdChanNum(ptr)) ){
-                                printf("Invalid channel name or number Chan=%s\n",ptr);
+                    case 'C':   // c=<chan>[,<chan>...] or c=all, every channel is totaled in the same pass
+                        for(ptr=strtok(ptr, ","); ptr && nChan<MAX_CHANNELS; ptr=strtok(NULL, ",")){
+                            if(!strcasecmp(ptr, "all")){
+                                for(chan=0; chan<EtsdInfo.channels && nChan<MAX_CHANNELS; chan++)
+                                    chans[nChan++] = chan;
+                                continue;
+                            }
+                            if(!(chan=atoi(ptr))){
+                                for (lp2=0; 255==(chan=etsdChanNum(ptr)) && lp2<EtsdInfo.groups; lp2++)
+                                    etsdGroup(lp2);     // look for the name in the other channel groups
+                                if (255==chan){
+                                    printf("Invalid channel name or number Chan=%s\n",ptr);
+                                    exit(1);
+                                }
+                            }
+                            if(nChan && group != EtsdInfo.group){
+                                printf("Channel %s is in channel group %u, all the channels of a query must be in group %u\n", ptr, EtsdInfo.group, group);
                                 exit(1);
                             }
+                            group = EtsdInfo.group;
+                            chans[nChan++] = chan;
                         }
-                        // Pete add code for selective channel output
                         break;
                     case 'q':
-                    case 'Q':
-                        cmd=ptr;
+                    case 'Q':   // q=<tot|ave|min|max>[,...] or q=stats
+                        for(ptr=strtok(ptr, ","); ptr && nAgg<4; ptr=strtok(NULL, ",")){
+                            if(strcasestr(ptr, "stat"))
+                                stats = 1;
+                            else
+                                aggs[nAgg++] = etsdScanAgg(ptr);
+                        }
+                        break;
+                    case 'o':
+                    case 'O':   // o[ver]=, u[nder]= and r[ate]=1 are for q=stats
+                        thresh[0] = atof(ptr);
+                        have |= 1;
+                        break;
+                    case 'u':
+                    case 'U':
+                        thresh[1] = atof(ptr);
+                        have |= 2;
+                        break;
+                    case 'r':
+                    case 'R':
+                        if(!strncasecmp(argv[lp], "res", 3))    // res=<step>, a time series from the rollup tiers
+                            res = parseT(ptr);
+                        else
+                            rate = atoi(ptr);
                         break;
                 }
             }
@@ -452,11 +871,50 @@ int32_t queryETSD(int argc, char *argv[]){
             start==etsdTimeS(1);
             ELog(__func__, 1);
         }
-        printf("Query result = %" PRId64 " \n", etsdAMT(cmd, chan, start, end));
+        if(!nChan)
+            chans[nChan++] = 0;
+        if(stats){
+            queryKS(chans, nChan, start, end, thresh, have, rate);
+            return 0;
+        }
+        if(!nAgg)
+            aggs[nAgg++] = SCAN_TOT;
+        if(res){
+            querySeries(chans, nChan, aggs, nAgg, start, end, res);
+            return 0;
+        }
+        items = malloc(nChan*nAgg*sizeof(ETSD_SCAN));
+        for(item=0; item<nChan*nAgg; item++){
+            items[item].chan = chans[item/nAgg];
+            items[item].agg = aggs[item%nAgg];
+        }
+        if(etsdScan(items, nChan*nAgg, start, end)){
+            fprintf(stderr, "Error: query of %s failed\n", argv[2]);
+            exit(1);
+        }
+        for(item=0; item<nChan*nAgg; item++){
+            if(1 < nChan*nAgg)
+                printf("%s %s = ", EtsdInfo.label[items[item].chan], aggName[items[item].agg]);
+            else
+                printf("Query result = ");
+            if(ETSD_FLOAT(items[item].chan))
+                printf("%g \n", items[item].fResult);
+            else
+                printf("%" PRId64 " \n", items[item].result);
+        }
+        free(items);
     } else {
         printf(" The 'Query' command requires at least the name of the ETSD to dump, Q=Type(tot/ave/min/max), C=Channel name/number\n");
         printf("        S[tart]=<start time> and E[nd]=<end time>\n ");
+        printf("        G[roup]=<channel group>, files with channel groups only.  Channel names are found in any group\n");
+        printf("        Q and C take comma separated lists (C=all for every channel), all of the results come from one pass over the file\n");
         printf(" Example: etsdCmd query /path/to/file.tsd q=ave c=5 s=now-4h e=now\n");
+        printf("        Q=stats gives every statistic of etsdKS() in one pass, add O[ver]=, U[nder]= and EQ[ual]=<value> to count the\n");
+        printf("        intervals over/under/equal to a value, and R[ate]=1 to adjust rate counters' total for clock skew\n");
+        printf("          etsdCmd query /path/to/file.tsd q=tot,ave,min,max c=all s=midnight e=now\n");
+        printf("        RES=<step> prints Q for every step i.e. res=30m, read from the coarsest rollup tier that fits (see etsdCmd rollup)\n");
+        printf("          etsdCmd query /path/to/file.tsd q=stats c=Fridge over=150 s=now-1d\n");
+        printf("          etsdCmd query /path/to/file.tsd q=ave,max c=all res=30m s=now-30d\n");
         printf("          etsdCmd dump /path/to/file.tsd Channel=Main Query=Total Start=midnight-4days End=midnight+3h\n");
     }
 
@@ -468,19 +926,16 @@ int32_t dumpETSD(int argc, char *argv[]){
     char *ptr, temp[100], tTime[25];
     time_t now=time(NULL);
     struct tm *t=localtime(&now);
-    FILE* fp = fopen(argv[2], "r");
    
         // checking if the file exist or not 
-    if (fp == NULL) { 
+    if (etsdInit(argv[2], 1)) { 
         fprintf(stderr,"Error: File %s Not Found!\n", argv[2]); 
         exit(1); 
-    } else {
-        printf("\n\n");
-        fseek(fp, 0L, SEEK_END);
-        end = (ftell(fp)+BLOCKSIZE-1) / BLOCKSIZE -1;
-        fclose(fp);
-    }
-    etsdInit(argv[2], 1);
+    } 
+    etsdMap();
+    cmdGroup(argc, argv);
+    printf("\n\n");
+    end = etsdSectors() - 1;
         
     for ( lp = 3; lp < argc; lp++ ){
         if(ptr = strchr(argv[lp],'=')){
@@ -523,7 +978,7 @@ int32_t dumpETSD(int argc, char *argv[]){
         strftime(tTime,22,"%D %T ", t);
         printf("Block: #%u of %u    Time Stamp: %s  (%u)\n", sector, end, tTime,Time);
         
-        LogBlock(&PBlock.byteD, "", BLOCKSIZE);
+        LogBlock(RBlock->byteD, "", ETSD_BSIZE);
         printf("Display (N)ext block, (P)revious block, or (Q)uit (N/P/Q) ");
         c = getch( );
         if(c=='n' || c=='N'){
@@ -554,6 +1009,9 @@ int32_t examinETSD(int argc, char *argv[]){
         //Pete for now just exit, in future search archived ETSD files
         exit(1);
     }
+    cmdGroup(argc, argv);
+    if (1 < EtsdInfo.groups)
+        printf("\n  Channel group %u of %u (0-%u), source unit %u\n", EtsdInfo.group, EtsdInfo.groups, EtsdInfo.groups-1, EtsdInfo.srcUnit);
 
     printf("\n  Channel                  Source     Stream    Counter    Save    Save to   Save As\n");
     printf ( " #   Name                type  Chan    Type     /Guage   Register  Ext DB?   Integer?\n\n");
@@ -563,10 +1021,15 @@ int32_t examinETSD(int argc, char *argv[]){
                 sprintf(sType,"AutoScale");
                 break;
             case 14:
-                sprintf(sType,"Float");
+                sprintf(sType,"HalfFloat");
                 break;
             case 13:
-                sprintf(sType,"Double");
+                if (FLOAT_BIT(lp))
+                    sprintf(sType,"Float32");
+                else if (SIGNED(lp))
+                    sprintf(sType,"Int32");
+                else
+                    sprintf(sType,"Double");
                 break;
             case 12:
                 sprintf(sType,"24 bit");
@@ -606,15 +1069,345 @@ int32_t examinETSD(int argc, char *argv[]){
                 break;
         }
         printf("%2d %-20s  %s   %2u    %-9s  %-7s     %c         %c         %c\n", lp, EtsdInfo.label[lp], SRC_TYPE(lp)?"SHM":"ECM", SRC_CHAN(lp), sType, CNT_bit(lp)?"Counter":"Guage", REG_bit(lp)?'Y':'N', EXT_DB_bit(lp)?'Y':'N', SIGNED(lp)?'Y':'N');
+        if (EtsdChan[lp].scaled && 15 != ETSD_TYPE(lp))
+            printf("       auto-scaled: slot %u\n", EtsdChan[lp].AS);
+        if (ZC_SDOOR == EtsdChan[lp].codec)
+            printf("       lossy compressed: Z%u, %u bytes per block, max error %u\n", EtsdChan[lp].zQS, EtsdChan[lp].zSize, EtsdChan[lp].zErr);
+        else if (EtsdChan[lp].codec)
+            printf("       compressed: Z%u, %u bytes per block\n", EtsdChan[lp].zQS, EtsdChan[lp].zSize);
         if (REG_bit(lp))
             reg++;
     }
-    printf("\nETSD has %u channels and is saving registers on %u of them.\n     Each block consists of %u intervals, each interval lasts %u seconds.\n\n", EtsdInfo.channels, reg, EtsdInfo.blockIntervals, EtsdInfo.intervalTime);
+    printf("\nETSD has %u channels and is saving registers on %u of them.\n     Each %u byte block consists of %u intervals, each interval lasts %u seconds.\n\n", EtsdInfo.channels, reg, EtsdInfo.blockSize, EtsdInfo.blockIntervals, EtsdInfo.intervalTime);
+    if (EtsdInfo.alignSpan)
+        printf("     Blocks are aligned, each one starts on a multiple of %u seconds.\n\n", EtsdInfo.alignSpan);
 }
 
 
+// rebuilds the timestamp index (.tsdx) used by etsdFindBlock() and the register index (.tsdc) used for counter totals
+int32_t indexETSD(int argc, char *argv[]){
+    int32_t cnt, reg;
+    if (etsdInit(argv[2], 0)){
+        fprintf(stderr, "Error: can't open %s \n", argv[2] );
+        exit(1);
+    }
+    if (EtsdInfo.alignSpan){
+        printf("%s has aligned blocks, it doesn't need an index\n", argv[2]);
+        return 0;
+    }
+    if (0 > (cnt = etsdIdxRebuild())){
+        ELog(__func__, 0);
+        exit(1);
+    }
+    printf("Indexed %d sectors of %s\n", cnt, argv[2]);
+    if (0 > (reg = etsdRegRebuild())){
+        ELog(__func__, 0);
+        exit(1);
+    }
+    if (reg)
+        printf("Indexed the registers of %d sectors\n", reg - 1);
+    etsdRegFree();
+    return 0;
+}
+
+// builds or rebuilds rollup tiers (.tsdr<seconds>) from the ETSD file, tiers are given as 60, 30m, 1d, etc.  No tiers = rebuild the
+// ones that already exist
+int32_t rollupETSD(int argc, char *argv[]){
+    uint32_t tiers[ROLL_TIERS];
+    int32_t cnt, lp, n = 0;
+    if (etsdInit(argv[2], 0)){
+        fprintf(stderr, "Error: can't open %s \n", argv[2] );
+        exit(1);
+    }
+    for (lp=3; lp<argc && n<ROLL_TIERS; lp++){
+        if (0 >= (int32_t)(tiers[n++] = parseT(argv[lp])) || tiers[n-1] % EtsdInfo.intervalTime){
+            fprintf(stderr, "Error: %s isn't a multiple of the %u second interval time\n", argv[lp], EtsdInfo.intervalTime);
+            exit(1);
+        }
+    }
+    if (!n){
+        etsdRollOpen(NULL, 0, 0);
+        if (!(n = etsdRollTiers(tiers))){
+            printf("%s has no rollup tiers, give the bucket length of each one to build i.e. etsdCmd rollup %s 30m 1d\n", argv[2], argv[2]);
+            return 0;
+        }
+        etsdRollClose();
+    }
+    for (lp=0; lp<n; lp++){
+        if (0 > (cnt = etsdRollBuild(tiers[lp]))){
+            ELog(__func__, 0);
+            exit(1);
+        }
+        printf("Built the %u second rollup tier of %s, %d buckets\n", tiers[lp], argv[2], cnt);
+    }
+    etsdRollClose();
+    return 0;
+}
 
-// main arguements Create Examin RecoverRRD
+// builds or rebuilds the zone map (.tsdz), each block's min/max/sum per channel, that lets threshold and min/max queries skip blocks
+int32_t zoneETSD(int argc, char *argv[]){
+    int32_t cnt;
+    if (etsdInit(argv[2], 0)){
+        fprintf(stderr, "Error: can't open %s \n", argv[2] );
+        exit(1);
+    }
+    if (0 > (cnt = etsdZoneBuild())){
+        ELog(__func__, 0);
+        exit(1);
+    }
+    printf("Zone mapped %d sectors of %s\n", cnt - 1, argv[2]);
+    etsdZoneClose();
+    return 0;
+}
+
+
+// expressions for the pieces of a stream, j = interval - 1.  See etsdDecodeBlock() for the layouts
+#define GEN_NIB(f, off) fprintf((f), "((uint32_t)(b[%u + j/2] >> (4 - 4*(j&1))) & 15)", (off))
+#define GEN_BYTE(f, off) fprintf((f), "(uint32_t)b[%u + j]", (off))
+#define GEN_WORD(f, off) fprintf((f), "(uint32_t)w[%u + j]", (off))
+
+// writes a C header holding a decoder specialized for the current ETSD's layout (see etsdInit()).  Every offset, width
+// and invalid limit is a constant, so each channel is one flat loop with no per interval branches.
+// The decoder falls back to etsdDecodeBlock() when it's used on a different layout (checked with etsdLayoutSig())
+// returns zero on success, or -1(DATA_INVALID)
+static int32_t genLayout(char *hName){
+    FILE *fd;
+    char name[32], NAME[32], *ptr = strrchr(hName, '/');
+    uint8_t lp, chan, type, bi = EtsdInfo.blockIntervals, words = (EtsdInfo.blockIntervals+31)/32;
+    uint16_t q, hs;
+    uint32_t maxV;
+
+    ptr = ptr ? ptr+1 : hName;
+    for (lp=0; lp<sizeof(name)-1 && ptr[lp] && '.' != ptr[lp]; lp++){
+        name[lp] = stralnum(ptr+lp, 1) ? '_' : ptr[lp];
+        NAME[lp] = 'a' <= name[lp] && 'z' >= name[lp] ? name[lp]-32 : name[lp];
+    }
+    name[lp] = NAME[lp] = 0;
+    if (!lp || ('0' <= name[0] && '9' >= name[0])){
+        fprintf(stderr,"Error: %s can't be used to name the layout, start the file name with a letter.\n", hName);
+        return DATA_INVALID;
+    }
+    if (!(fd = fopen(hName, "w"))){
+        fprintf(stderr,"Error: Can't open %s for writing.\n", hName);
+        return DATA_INVALID;
+    }
+
+    fprintf(fd, "// %s block decoder specialized for the layout of %s, generated by etsdCmd gen.  Don't edit, regenerate it.\n", name, EtsdInfo.fileName);
+    fprintf(fd, "// %sDecodeBlock() is a drop in replacement for etsdDecodeBlock(), build with -O3 so the channel loops are vectorized\n\n", name);
+    fprintf(fd, "#ifndef __etsd_%s_h__\n#define __etsd_%s_h__\n\n", name, name);
+    fprintf(fd, "#include <string.h>\n#include \"etsd.h\"\n#include \"etsdRead.h\"\n#include \"etsdCodec.h\"\n\n");
+    fprintf(fd, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+    fprintf(fd, "#define %s_SIG 0x%08Xu\n#define %s_INTERVALS %u\n#define %s_CHANNELS %u\n#define %s_WORDS %u\n\n", NAME, EtsdInfo.layoutSig, NAME, bi, NAME, EtsdInfo.channels, NAME, words);
+    for (chan=0; chan<EtsdInfo.channels; chan++)
+        fprintf(fd, "#define %s_%s %u\n", NAME, EtsdInfo.label[chan], chan);
+
+    fprintf(fd, "\n// decodes RBlock into db, same results as etsdDecodeBlock().  Uses etsdDecodeBlock() if the ETSD has a different layout\n");
+    fprintf(fd, "static inline int32_t %sDecodeBlock(ETSD_DBLOCK *db){\n", name);
+    fprintf(fd, "    const uint8_t *b = RBlock->byteD + 8, *e = RBlock->byteD + %u;\n    const uint16_t *w = RBlock->data + 4;\n", EtsdInfo.extStart);
+    fprintf(fd, "    uint32_t v, ok, m, bits, *col, *vb, keep[%s_WORDS];\n    uint32_t j, k, s, cnt = VALID_INTERVALS;\n\n", NAME);
+    fprintf(fd, "    if (%s_SIG != EtsdInfo.layoutSig || db->select || %s_INTERVALS != db->stride)\n        return etsdDecodeBlock(db);\n", NAME, NAME);
+    fprintf(fd, "    if (cnt > %s_INTERVALS)\n        cnt = %s_INTERVALS;\n", NAME, NAME);
+    fprintf(fd, "    db->timeStamp = RBlock->longD[0];\n    db->reset = BLOCK_RESET;\n    db->intervals = cnt;\n");
+    fprintf(fd, "    for (j=0; j<%s_WORDS; j++)\n        keep[j] = cnt >= 32*(j+1) ? 0xFFFFFFFF : cnt > 32*j ? (1u << (cnt - 32*j)) - 1 : 0;\n", NAME);
+    fprintf(fd, "    (void)v; (void)ok; (void)m; (void)s; (void)k; (void)bits; (void)b; (void)e; (void)w;\n");
+
+    for (chan=0; chan<EtsdInfo.channels; chan++){
+        type = ETSD_TYPE(chan);
+        q = EtsdChan[chan].QS;
+        hs = q/2 * bi;
+        fprintf(fd, "\n    // %u %s, type %u%s%s\n", chan, EtsdInfo.label[chan], type, SIGNED(chan) ? " signed" : "", EtsdChan[chan].scaled ? " auto-scaled" : "");
+        fprintf(fd, "    col = db->data + %u;\n    vb = db->valid + %u;\n", chan*bi, chan*words);
+        if (EtsdChan[chan].reg)
+            fprintf(fd, "    db->reg[%u] = readReg(%u);\n", chan, EtsdChan[chan].reg);
+        else
+            fprintf(fd, "    db->reg[%u] = DATA_INVALID;\n", chan);
+        if (!type){
+            fprintf(fd, "    memset(vb, 0, %s_WORDS*sizeof(uint32_t));\n", NAME);
+            continue;
+        }
+        if (EtsdChan[chan].codec){
+            fprintf(fd, "    if (cnt)\n        etsdZDecode(RBlock, %u, cnt, col, vb);\n    else\n        memset(vb, 0, %s_WORDS*sizeof(uint32_t));\n", chan, NAME);
+            continue;
+        }
+        if (EtsdChan[chan].scaled)
+            fprintf(fd, "    s = etsdScale(RBlock, %u);\n", EtsdChan[chan].AS);
+        fprintf(fd, "    for (k=0; k<%s_WORDS; k++){\n        bits = 0;\n", NAME);
+        fprintf(fd, "        for (j=32*k; j<32*k+32 && j<%s_INTERVALS; j++){\n            v = ", NAME);
+        maxV = 0;
+        switch(type){
+            case 1:
+                fprintf(fd, "0");
+                break;
+            case 2:
+            case 3:
+                GEN_NIB(fd, q*(bi/2));
+                break;
+            case 4:
+            case 5:
+                GEN_BYTE(fd, hs);
+                break;
+            case 6:
+            case 7:
+                GEN_BYTE(fd, 1&q ? (q+1)/2*bi : hs);
+                fprintf(fd, " | ");
+                GEN_NIB(fd, 1&q ? q*(bi/2) : (q+2)*(bi/2));
+                fprintf(fd, " << 8");
+                maxV = EtsdChan[chan].extS ? 16383 : 4095;
+                break;
+            case 8:
+            case 9:
+            case 15:
+                GEN_WORD(fd, q/4*bi);
+                maxV = 15 == type ? 65535 : EtsdChan[chan].extS ? 262143 : 65535;
+                break;
+            case 10:
+            case 11:
+                GEN_BYTE(fd, 1&q ? (q+1)/2*bi : hs);
+                fprintf(fd, " | ");
+                GEN_BYTE(fd, 1&q ? (q+3)/2*bi : (q+2)/2*bi);
+                fprintf(fd, " << 8 | ");
+                GEN_NIB(fd, 1&q ? q*(bi/2) : (q+4)*(bi/2));
+                fprintf(fd, " << 16");
+                maxV = EtsdChan[chan].extS ? 4194303 : 1048575;
+                break;
+            case 12:
+                GEN_BYTE(fd, hs);
+                fprintf(fd, " | ");
+                GEN_BYTE(fd, (q+2)/2*bi);
+                fprintf(fd, " << 8 | ");
+                GEN_BYTE(fd, (q+4)/2*bi);
+                fprintf(fd, " << 16");
+                maxV = 0x00FFFFFF;
+                break;
+            case 13:
+                GEN_WORD(fd, q/4*bi);
+                fprintf(fd, " | ");
+                GEN_WORD(fd, (q+4)/4*bi);
+                fprintf(fd, " << 16");
+                if (FLOAT_BIT(chan))
+                    maxV = DATA_INVALID;
+                break;
+            case 14:
+                fprintf(fd, "etsdHalfToFloat(w[%u + j])", q/4*bi);
+                maxV = HALF_INVALID_F;
+                break;
+        }
+        if (EtsdChan[chan].extS)    // ext bits are the top 2 bits of the value, type 1 is the ext stream alone
+            fprintf(fd, " | (uint32_t)((e[(%u + j)/4] >> 2*((%u + j)&3)) & 3) << %u", (EtsdChan[chan].extS-1)*bi, (EtsdChan[chan].extS-1)*bi, 2*(type-1));
+        fprintf(fd, ";\n");
+        if (EtsdChan[chan].scaled)
+            maxV = (1u << EtsdChan[chan].bits) - 1;
+
+        if (13 == type && SIGNED(chan) && !FLOAT_BIT(chan))
+            fprintf(fd, "            ok = v != INT32_INVALID;\n");
+        else if (maxV)
+            fprintf(fd, "            ok = v < 0x%Xu;\n", maxV);
+        else
+            fprintf(fd, "            ok = 1;\n");
+        fprintf(fd, "            v &= -ok;\n");
+        if (EtsdChan[chan].scaled)
+            fprintf(fd, "            v = ((v << s) + s) & -ok;\n");
+        if (SIGNED(chan) && 13 != type){    // etsdToSigned() without the branch
+            fprintf(fd, "            m = -((v >> %u) & 1);\n", 2*type-1);
+            fprintf(fd, "            v = (v ^ (m & 0x%Xu)) ^ m;\n", 1u << (2*type-1));
+        }
+        fprintf(fd, "            col[j] = v;\n            bits |= ok << (j&31);\n        }\n        vb[k] = bits & keep[k];\n    }\n");
+    }
+    fprintf(fd, "    return cnt;\n}\n\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+    fclose(fd);
+    printf("Wrote %s, layout signature 0x%08X\n", hName, EtsdInfo.layoutSig);
+    return 0;
+}
+
+// etsdCmd gen file.tsd [header.h] [g=<channel group>], writes a decoder specialized for file.tsd's layout.  Default header = file.h (file_g<group>.h)
+int32_t genETSD(int argc, char *argv[]){
+    char hName[256], *ptr;
+    if (etsdInit(argv[2], 1)){
+        fprintf(stderr, "Error: can't open %s \n", argv[2] );
+        exit(1);
+    }
+    cmdGroup(argc, argv);
+    if (3 < argc && !strchr(argv[3], '=')){
+        snprintf(hName, sizeof(hName), "%s", argv[3]);
+    } else {
+        snprintf(hName, sizeof(hName), "%s", argv[2]);
+        if ((ptr = strcasestr(hName, ".tsd")))
+            sprintf(ptr, 1 < EtsdInfo.groups ? "_g%u.h" : ".h", EtsdInfo.group);
+    }
+    if (genLayout(hName))
+        exit(1);
+    return 0;
+}
+
+// writes ETSD data to stdout as CSV, one row per interval.  Invalid readings are left blank
+// etsdCmd export file.tsd [s=<start time>] [e=<end time>] [g=<channel group>]
+int32_t exportETSD(int argc, char *argv[]){
+    uint8_t lp, chan;
+    uint32_t start=0, end=0xFFFFFFFF, sector=1, timeStamp, Time;
+    char *ptr;
+    ETSD_DBLOCK db;
+    float f;
+
+    if (etsdInit(argv[2], 1)){
+        fprintf(stderr, "Error: can't open %s \n", argv[2] );
+        exit(1);
+    }
+    etsdMap();
+    cmdGroup(argc, argv);
+    for(lp=3; lp< argc; lp++){
+        if((ptr=strchr(argv[lp],'='))){
+            ptr++;
+            switch(*argv[lp]) {
+                case 's':
+                case 'S':
+                    start = etsdParseTime(ptr);
+                    break;
+                case 'e':
+                case 'E':
+                    end = etsdParseTime(ptr);
+                    break;
+            }
+        }
+    }
+    if(etsdDecodeInit(&db)){
+        ELog(__func__, 0);
+        exit(1);
+    }
+    if(start && !(sector=etsdFindBlock(start)))
+        sector = 1;
+    ErrorCode = 0;
+
+    printf("time");
+    for(chan=0; chan<EtsdInfo.channels; chan++)
+        printf(",%s", EtsdInfo.label[chan]);
+    printf("\n");
+
+    while((timeStamp=etsdTimeS(sector++)) && timeStamp <= end){
+        etsdDecodeBlock(&db);
+        for(lp=1; lp<=db.intervals; lp++){
+            Time = timeStamp + lp*EtsdInfo.intervalTime;  // each reading covers the PREVIOUS interval
+            if(Time <= start || Time > end)
+                continue;
+            printf("%u", Time);
+            for(chan=0; chan<EtsdInfo.channels; chan++){
+                if(!DB_VALID(&db, chan, lp))
+                    printf(",");
+                else if(ETSD_FLOAT(chan)){   // float32 or half float, decoded to a float bit pattern
+                    memcpy(&f, &DB_VALUE(&db, chan, lp), sizeof(f));
+                    printf(",%g", f);
+                } else
+                    printf(SIGNED(chan)?",%d":",%u", DB_VALUE(&db, chan, lp));
+            }
+            printf("\n");
+        }
+    }
+    if(ErrorCode & ~E_EOF)
+        ELog(__func__, 1);
+    etsdDecodeFree(&db);
+    return 0;
+}
+
+// main arguements Create Examin eXport RecoverRRD Index ROLLup Zone
 int main(int argc, char *argv[]){
     char *rrd, *nada, *ptr, **argp;
     char inp[20];
@@ -643,10 +1436,25 @@ int main(int argc, char *argv[]){
                 break;
             case 'e':
             case 'E':
-                examinETSD(argc, argv);
+                if(!strncasecmp(argv[1], "exp", 3))
+                    exportETSD(argc, argv);
+                else
+                    examinETSD(argc, argv);
+                break;
+            case 'i':
+            case 'I':
+                indexETSD(argc, argv);
+                break;
+            case 'g':
+            case 'G':
+                genETSD(argc, argv);
                 break;
             case 'r':
             case 'R':
+                if(!strncasecmp(argv[1], "roll", 4)){
+                    rollupETSD(argc, argv);
+                    break;
+                }
                 if(etsdInit(argv[2],1)){
                     ELog(__func__, 0);
                     exit(1);
@@ -654,6 +1462,10 @@ int main(int argc, char *argv[]){
 // Pete need to make this work with other external databases, perhaps dynamically load a module depending on the file extention provided on command line
                 recoverRRD(argpc, argp);  
                 break;
+            case 'z':
+            case 'Z':
+                zoneETSD(argc, argv);
+                break;
         }
     
     } else {
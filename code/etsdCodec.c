@@ -0,0 +1,517 @@
+/*************************************************************************
+etsdCodec.c compressed (variable length) streams for an ETSD time series database
+ A compressed channel saves its readings to a bit stream that takes the place of its fixed width stream.
+ Each block's bit stream is self contained, the first valid reading in a block is always saved in full.
+
+ ZC_GORILLA codes, integers (delta of delta):
+    before first valid reading:  0 = invalid,  1 + <bits> = first reading
+    0 = same delta as last time,  10 + 7 bits,  110 + 9 bits,  1110 + 12 bits,  11110 + 32 bits = delta of delta
+    11111 = invalid
+ ZC_GORILLA codes, floats (XOR with previous reading, half floats use their 16 bit pattern):
+    before first valid reading:  0 = invalid,  1 + <bits> = first reading
+    0 = same as last reading,  10 + meaningful bits using the previous leading/trailing zero counts,
+    110 + 5 bits leading zeros + 5 bits (length-1) + meaningful bits,  111 = invalid
+ ZC_SDOOR codes (lossy, integers only), breakpoints of a piecewise linear fit:
+    1 + 7 bits intervals since the last code + value change = breakpoint, intervals in between are interpolated
+        value change: 0 + 7 bits,  10 + 12 bits,  110 + 20 bits,  111 + 32 bits
+    01 + 7 bits = that many invalid intervals, the next breakpoint starts a new line
+    00 = end of stream, remaining intervals are invalid
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "etsd.h"
+#include "etsdCodec.h"
+#include "errorlog.h"
+
+// encoder state, one per channel
+typedef struct {
+    uint16_t pos;       // next bit in the channel's bit stream
+    uint8_t interV;     // last interval saved
+    uint8_t started;    // first valid reading has been saved
+    uint32_t prev;      // previous valid reading
+    uint32_t prevDelta;
+    uint8_t lead;       // XOR leading/trailing zeros window, lead = 255 no window yet
+    uint8_t trail;
+    // ZC_SDOOR, prev = value of the last breakpoint
+    uint8_t aT;         // anchor (last breakpoint) interval, zero = no line started
+    uint8_t pT;         // pending reading, the line's end point if it isn't replaced, zero = none
+    uint8_t bad;        // invalid intervals not saved to the stream yet
+    uint8_t lastT;      // interval of the last code saved to the stream
+    uint32_t pV;
+} ZSTATE;
+
+static ZSTATE *ZState = NULL;
+static uint8_t ZStateCnt = 0;
+static uint32_t (*ZHist)[128] = NULL;  // ZC_SDOOR readings since the anchor, by interval
+
+void etsdPutBits(uint8_t *buf, uint16_t *pos, uint32_t val, uint8_t n){
+    uint16_t first = *pos >> 3, last;
+    uint64_t v;
+    uint8_t i;
+    if (!n)
+        return;
+    last = (*pos + n - 1) >> 3;
+    if (32 > n)
+        val &= (1u << n) - 1;
+    v = (uint64_t)val << (40 - n - (*pos & 7));    // line up with the top of a 5 byte window starting at byte <first>
+    for (i=0; first+i <= last; i++)
+        buf[first+i] |= v >> (32 - 8*i);
+    *pos += n;
+}
+
+uint32_t etsdGetBits(const uint8_t *buf, uint16_t *pos, uint8_t n){
+    uint16_t lp, last;
+    uint64_t v = 0;
+    if (!n)
+        return 0;
+    last = (*pos + n - 1) >> 3;
+    for (lp = *pos >> 3; lp <= last; lp++)
+        v = (v << 8) | buf[lp];
+    v >>= 7 - ((*pos + n - 1) & 7);
+    *pos += n;
+    return 32 == n ? (uint32_t)v : (uint32_t)v & ((1u << n) - 1);
+}
+
+static uint8_t clz32(uint32_t x){
+    return x ? __builtin_clz(x) : 32;
+}
+static uint8_t ctz32(uint32_t x){
+    return x ? __builtin_ctz(x) : 32;
+}
+
+// converts the value passed to saveChan() to the value saved, returns zero if it's invalid
+static uint8_t zValue(uint8_t chan, uint8_t dataInvalid, uint32_t *data){
+    uint8_t bits = EtsdChan[chan].bits;
+    int32_t maxV;
+    if (dataInvalid)
+        return 0;
+    if (14 == ETSD_TYPE(chan)){
+        if (DATA_INVALID == *data)
+            return 0;
+        *data = etsdFloatToHalf(*data);
+        return 1;
+    }
+    if (FLOAT_BIT(chan)){
+        if (DATA_INVALID == *data)
+            return 0;
+        if (0x7F800000 == (*data & 0x7F800000) && (*data & 0x007FFFFF))
+            *data = FLOAT_NAN;
+        return 1;
+    }
+    if (32 == bits)
+        return !(SIGNED(chan) && INT32_INVALID == *data);
+    if (SIGNED(chan)){  // same range as etsdFromSigned()
+        maxV = (1 << (bits-1)) - 1;
+        return (int32_t)*data >= -maxV && (int32_t)*data <= maxV;
+    }
+    return *data < (1u << bits) - 1;   // all ones = invalid, same as the fixed width streams
+}
+
+// writes one interval, returns zero or -1(DATA_INVALID) if it doesn't fit (nothing written)
+static int32_t zPut(ZSTATE *st, uint8_t chan, uint8_t *buf, uint16_t cap, uint8_t valid, uint32_t v){
+    uint8_t w = EtsdChan[chan].bits, lead, trail, len;
+    uint32_t delta, x;
+    int32_t dod;
+
+    if (!st->started){
+        if (st->pos + (valid ? 1+w : 1) > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, valid, 1);
+        if (valid){
+            etsdPutBits(buf, &st->pos, v, w);
+            st->started = 1;
+            st->prev = v;
+            st->prevDelta = 0;
+            st->lead = 255;
+        }
+        return 0;
+    }
+
+    if (ETSD_FLOAT(chan)){
+        if (!valid){
+            if (st->pos + 3 > cap)
+                return DATA_INVALID;
+            etsdPutBits(buf, &st->pos, 7, 3);
+            return 0;
+        }
+        x = v ^ st->prev;
+        if (!x){
+            if (st->pos + 1 > cap)
+                return DATA_INVALID;
+            etsdPutBits(buf, &st->pos, 0, 1);
+            return 0;
+        }
+        lead = clz32(x);
+        trail = ctz32(x);
+        if (255 != st->lead && lead >= st->lead && trail >= st->trail){
+            len = 32 - st->lead - st->trail;
+            if (st->pos + 2 + len > cap)
+                return DATA_INVALID;
+            etsdPutBits(buf, &st->pos, 2, 2);
+            etsdPutBits(buf, &st->pos, x >> st->trail, len);
+        } else {
+            len = 32 - lead - trail;
+            if (st->pos + 13 + len > cap)
+                return DATA_INVALID;
+            etsdPutBits(buf, &st->pos, 6, 3);
+            etsdPutBits(buf, &st->pos, lead, 5);
+            etsdPutBits(buf, &st->pos, len-1, 5);
+            etsdPutBits(buf, &st->pos, x >> trail, len);
+            st->lead = lead;
+            st->trail = trail;
+        }
+        st->prev = v;
+        return 0;
+    }
+
+    if (!valid){
+        if (st->pos + 5 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 31, 5);
+        return 0;
+    }
+    delta = v - st->prev;
+    dod = (int32_t)(delta - st->prevDelta);
+    if (!dod){
+        if (st->pos + 1 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 0, 1);
+    } else if (-63 <= dod && 64 >= dod){
+        if (st->pos + 9 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 2, 2);
+        etsdPutBits(buf, &st->pos, dod+63, 7);
+    } else if (-255 <= dod && 256 >= dod){
+        if (st->pos + 12 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 6, 3);
+        etsdPutBits(buf, &st->pos, dod+255, 9);
+    } else if (-2047 <= dod && 2048 >= dod){
+        if (st->pos + 16 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 14, 4);
+        etsdPutBits(buf, &st->pos, dod+2047, 12);
+    } else {
+        if (st->pos + 37 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 30, 5);
+        etsdPutBits(buf, &st->pos, dod, 32);
+    }
+    st->prevDelta = delta;
+    st->prev = v;
+    return 0;
+}
+
+// readings as signed or unsigned numbers, so lines can be fitted to them
+static int64_t zLogical(uint8_t chan, uint32_t v){
+    return SIGNED(chan) ? (int64_t)(int32_t)v : (int64_t)v;
+}
+
+// value at interval <t> on the line from (t0,v0) to (t1,v1), rounded half away from zero.  Used by both encoder and decoder
+static uint32_t sdLerp(uint8_t chan, uint8_t t0, uint32_t v0, uint8_t t1, uint32_t v1, uint8_t t){
+    int64_t a = zLogical(chan, v0), num = (zLogical(chan, v1) - a) * (t - t0), den = t1 - t0;
+    return a + (0 <= num ? num + den/2 : num - den/2) / den;
+}
+
+// saves breakpoint (t,v), it becomes the new anchor
+static int32_t sdPoint(ZSTATE *st, uint8_t chan, uint8_t *buf, uint16_t cap, uint8_t t, uint32_t v){
+    int32_t dv = v - st->prev;
+    uint8_t n = 7, code = 0, cLen = 1;
+
+    if (-2048 > dv || 2047 < dv){
+        n = (-524288 > dv || 524287 < dv) ? 32 : 20;
+        code = 32 == n ? 7 : 6;
+        cLen = 3;
+    } else if (-64 > dv || 63 < dv){
+        n = 12;
+        code = 2;
+        cLen = 2;
+    }
+    if (st->pos + 8 + cLen + n > cap)
+        return DATA_INVALID;
+    etsdPutBits(buf, &st->pos, 1, 1);
+    etsdPutBits(buf, &st->pos, t - st->lastT, 7);
+    etsdPutBits(buf, &st->pos, code, cLen);
+    etsdPutBits(buf, &st->pos, 32 == n ? (uint32_t)dv : (uint32_t)(dv + (1 << (n-1))), n);
+    st->lastT = t;
+    st->prev = v;
+    st->aT = t;
+    st->pT = 0;
+    return 0;
+}
+
+// swinging door, a reading either extends the current line (every reading since the anchor stays within zErr of it)
+// or the door closes and the pending reading becomes the next breakpoint
+static int32_t sdPut(ZSTATE *st, uint8_t chan, uint8_t *buf, uint16_t cap, uint8_t t, uint8_t valid, uint32_t v){
+    uint8_t lp;
+    int64_t err;
+
+    if (!valid){
+        if (st->pT && sdPoint(st, chan, buf, cap, st->pT, st->pV))
+            return DATA_INVALID;
+        st->aT = 0;
+        st->bad++;
+        return 0;
+    }
+    if (st->bad){
+        if (st->pos + 9 > cap)
+            return DATA_INVALID;
+        etsdPutBits(buf, &st->pos, 1, 2);
+        etsdPutBits(buf, &st->pos, st->bad, 7);
+        st->lastT += st->bad;
+        st->bad = 0;
+    }
+    if (!st->aT)    // start a new line
+        return sdPoint(st, chan, buf, cap, t, v);
+
+    ZHist[chan][t] = v;
+    for (lp = st->aT+1; st->pT && lp < t; lp++){
+        err = zLogical(chan, sdLerp(chan, st->aT, st->prev, t, v, lp)) - zLogical(chan, ZHist[chan][lp]);
+        if (EtsdChan[chan].zErr < (0 > err ? -err : err)){
+            if (sdPoint(st, chan, buf, cap, st->pT, st->pV))
+                return DATA_INVALID;
+            break;
+        }
+    }
+    st->pT = t;
+    st->pV = v;
+    return 0;
+}
+
+// bits that must be free after saving an interval, so the next interval is sure to fit
+static uint8_t zReserve(uint8_t chan){
+    return ZC_SDOOR == EtsdChan[chan].codec ? ZSD_RESERVE : ZMAX_BITS;
+}
+
+// call with interV = 0 (start of each block), clears the channel's bit stream in PBlock
+void etsdZStart(uint8_t chan){
+    if (ZStateCnt < EtsdInfo.channels){
+        free(ZHist);
+        ZHist = NULL;
+        free(ZState);
+        ZState = (ZSTATE*)malloc(EtsdInfo.channels * sizeof(ZSTATE));
+        ZStateCnt = ZState ? EtsdInfo.channels : 0;
+        if (!ZState){
+            ErrorCode |= E_MEM;
+            return;
+        }
+    }
+    if (ZC_SDOOR == EtsdChan[chan].codec && !ZHist){
+        ZHist = (uint32_t (*)[128])malloc(EtsdInfo.channels * sizeof(*ZHist));
+        if (!ZHist){
+            ErrorCode |= E_MEM;
+            return;
+        }
+    }
+    memset(&ZState[chan], 0, sizeof(ZSTATE));
+    memset(PBlock.byteD + EtsdChan[chan].zStart, 0, EtsdChan[chan].zSize);
+}
+
+// saves whatever a channel is still holding back, call before writing the block.  etsdCommit() does this
+void etsdZFlush(uint8_t chan){
+    ZSTATE *st = &ZState[chan];
+    if (chan >= ZStateCnt || ZC_SDOOR != EtsdChan[chan].codec || !st->pT)
+        return;
+    if (sdPoint(st, chan, PBlock.byteD + EtsdChan[chan].zStart, EtsdChan[chan].zSize * 8, st->pT, st->pV))
+        ErrorCode |= E_FULL;
+}
+
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdZSave(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data){
+    uint8_t *buf = PBlock.byteD + EtsdChan[chan].zStart;
+    uint16_t cap = EtsdChan[chan].zSize * 8;
+    uint8_t valid;
+    ZSTATE *st;
+
+    if (chan >= ZStateCnt){     // etsdZStart() never called
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    st = &ZState[chan];
+    if (interV <= st->interV){  // can't go back and change a variable length stream
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    valid = zValue(chan, dataInvalid, &data);
+    if (ZC_SDOOR == EtsdChan[chan].codec && !ZHist){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    while (st->interV+1 < interV){  // skipped intervals
+        if (ZC_SDOOR == EtsdChan[chan].codec ? sdPut(st, chan, buf, cap, st->interV+1, 0, 0) : zPut(st, chan, buf, cap, 0, 0))
+            goto full;
+        st->interV++;
+    }
+    if (ZC_SDOOR == EtsdChan[chan].codec ? sdPut(st, chan, buf, cap, interV, valid, data) : zPut(st, chan, buf, cap, valid, data))
+        goto full;
+    st->interV = interV;
+    if (cap - st->pos < zReserve(chan))
+        EtsdBlockFull = 1;
+    return 0;
+full:
+    EtsdBlockFull = 1;
+    ErrorCode |= E_FULL;
+    return DATA_INVALID;
+}
+
+// ZC_SDOOR version of etsdZDecode()
+static uint16_t sdDecode(const PBLOCK *blk, uint8_t chan, uint8_t n, uint32_t *out, uint32_t *valid){
+    const uint8_t *buf = blk->byteD + EtsdChan[chan].zStart;
+    uint16_t cap = EtsdChan[chan].zSize * 8, pos = 0, cnt = 0;
+    uint8_t t = 0, dt, lp, conn = 0, ones, bits;
+    uint32_t prev = 0, v;
+
+    memset(valid, 0, (n+31)/32*sizeof(uint32_t));
+    memset(out, 0, n*sizeof(uint32_t));
+    while (t < n && pos + 2 <= cap){
+        if (etsdGetBits(buf, &pos, 1)){     // breakpoint
+            if (pos + 8 > cap)
+                break;
+            dt = etsdGetBits(buf, &pos, 7);
+            for (ones=0; ones < 3 && etsdGetBits(buf, &pos, 1); ones++);
+            bits = ones < 2 ? (ones ? 12 : 7) : (3 == ones ? 32 : 20);
+            if (!dt || t + dt > n || pos + bits > cap)
+                break;
+            v = etsdGetBits(buf, &pos, bits);
+            v = prev + (32 == bits ? v : v - (1u << (bits-1)));
+            for (lp = t+1; conn && lp < t+dt; lp++){
+                out[lp-1] = sdLerp(chan, t, prev, t+dt, v, lp);
+                valid[(lp-1)/32] |= 1u << ((lp-1)&31);
+                cnt++;
+            }
+            t += dt;
+            out[t-1] = v;
+            valid[(t-1)/32] |= 1u << ((t-1)&31);
+            cnt++;
+            prev = v;
+            conn = 1;
+        } else if (etsdGetBits(buf, &pos, 1)){ // invalid run
+            if (pos + 7 > cap)
+                break;
+            t += etsdGetBits(buf, &pos, 7);
+            conn = 0;
+        } else
+            break;      // end of stream
+    }
+    return cnt;
+}
+
+// returns number of valid values
+uint16_t etsdZDecode(const PBLOCK *blk, uint8_t chan, uint8_t n, uint32_t *out, uint32_t *valid){
+    const uint8_t *buf = blk->byteD + EtsdChan[chan].zStart;
+    uint16_t cap = EtsdChan[chan].zSize * 8, pos = 0, cnt = 0;
+    uint8_t w = EtsdChan[chan].bits, isFloat = ETSD_FLOAT(chan), started = 0, lead = 255, trail = 0, len, ones, lp;
+    uint32_t prev = 0, prevDelta = 0, x;
+
+    if (ZC_SDOOR == EtsdChan[chan].codec)
+        return sdDecode(blk, chan, n, out, valid);
+    memset(valid, 0, (n+31)/32*sizeof(uint32_t));
+    for (lp=0; lp<n; lp++){
+        out[lp] = 0;
+        if (pos >= cap)
+            break;
+        if (!started){
+            if (!etsdGetBits(buf, &pos, 1))
+                continue;
+            if (pos + w > cap)
+                break;
+            prev = etsdGetBits(buf, &pos, w);
+            if (!isFloat && SIGNED(chan) && 32 > w && (prev >> (w-1)))
+                prev |= ~0u << w;       // sign extend
+            prevDelta = 0;
+            started = 1;
+        } else {
+            for (ones=0; ones < (isFloat ? 3 : 5) && pos < cap && etsdGetBits(buf, &pos, 1); ones++);
+            if (isFloat){
+                if (3 == ones)
+                    continue;   // invalid
+                if (1 == ones){
+                    if (255 == lead)
+                        break;  // corrupt
+                    len = 32 - lead - trail;
+                    if (pos + len > cap)
+                        break;
+                    prev ^= etsdGetBits(buf, &pos, len) << trail;
+                } else if (2 == ones){
+                    if (pos + 10 > cap)
+                        break;
+                    lead = etsdGetBits(buf, &pos, 5);
+                    len = etsdGetBits(buf, &pos, 5) + 1;
+                    if (32 < lead + len || pos + len > cap)
+                        break;
+                    trail = 32 - lead - len;
+                    x = etsdGetBits(buf, &pos, len);
+                    prev ^= (32 == len) ? x : x << trail;
+                }
+            } else {
+                switch(ones){
+                    case 0:
+                        x = 0;
+                        break;
+                    case 1:
+                        x = etsdGetBits(buf, &pos, 7) - 63;
+                        break;
+                    case 2:
+                        x = etsdGetBits(buf, &pos, 9) - 255;
+                        break;
+                    case 3:
+                        x = etsdGetBits(buf, &pos, 12) - 2047;
+                        break;
+                    case 4:
+                        x = etsdGetBits(buf, &pos, 32);
+                        break;
+                    default:
+                        continue;   // invalid
+                }
+                if (pos > cap)
+                    break;
+                prevDelta += x;
+                prev += prevDelta;
+            }
+        }
+        out[lp] = (14 == ETSD_TYPE(chan)) ? etsdHalfToFloat(prev) : prev;
+        valid[lp/32] |= 1u << (lp&31);
+        cnt++;
+    }
+    return cnt;
+}
+
+// If data is invalid, returns zero plus ErrorCode = E_DATA
+uint32_t etsdZRead(uint8_t interV, uint8_t chan){
+    static uint32_t col[128], vBits[4], cTime = 0;
+    static int32_t cSector = -1;
+    static int16_t cChan = -1;
+    uint8_t n = VALID_INTERVALS < EtsdInfo.blockIntervals ? VALID_INTERVALS : EtsdInfo.blockIntervals;
+
+    if (!interV || interV > n){
+        ErrorCode |= E_DATA;
+        return 0;
+    }
+    if (cSector != EtsdInfo.sector || cTime != RBlock->longD[0] || cChan != chan){
+        etsdZDecode(RBlock, chan, n, col, vBits);
+        cSector = EtsdInfo.sector;
+        cTime = RBlock->longD[0];
+        cChan = chan;
+    }
+    if (!((vBits[(interV-1)/32] >> ((interV-1)&31)) & 1)){
+        ErrorCode |= E_DATA;
+        return 0;
+    }
+    return col[interV-1];
+}
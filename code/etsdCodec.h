@@ -0,0 +1,59 @@
+/*************************************************************************
+etsdCodec.h compressed (variable length) streams for an ETSD time series database
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdcodec_h__
+#define __etsdcodec_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// longest code a compressed stream can write for one interval, in bits.  See etsdCodec.c for the code tables
+#define ZMAX_BITS 45
+// ZC_SDOOR, bits kept free after each interval: an invalid run, a breakpoint, plus the breakpoint etsdZFlush() may save
+#define ZSD_RESERVE 96
+
+// Bit I/O, most significant bit first.  pos = bit position in buf, advanced by n.  n = 0-32
+// etsdPutBits() ORs the bits in, so buf must start out zeroed
+void etsdPutBits(uint8_t *buf, uint16_t *pos, uint32_t val, uint8_t n);
+uint32_t etsdGetBits(const uint8_t *buf, uint16_t *pos, uint8_t n);
+
+// call with interV = 0 (start of each block), clears the channel's bit stream in PBlock
+void etsdZStart(uint8_t chan);
+
+// saves <data> to compressed channel <chan> in PBlock.  Intervals must be saved in order, skipped intervals are saved as invalid.
+// data is the same value passed to saveChan(), dataInvalid non zero = save invalid
+// Sets EtsdBlockFull when the next interval might not fit.
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode (E_FULL if it didn't fit, E_ARG if interV is out of order)
+int32_t etsdZSave(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data);
+
+// saves whatever channel <chan> is still holding back (ZC_SDOOR's last reading), call before writing the block
+void etsdZFlush(uint8_t chan);
+
+// decodes <n> intervals of compressed channel <chan> from block <blk> into out[0 - n-1], and sets valid[] bits (bit set = valid)
+// values are the same as readChan() returns.  valid[] must hold (n+31)/32 words.  returns number of valid values
+uint16_t etsdZDecode(const PBLOCK *blk, uint8_t chan, uint8_t n, uint32_t *out, uint32_t *valid);
+
+// readChan() for compressed channels, decodes the whole stream of RBlock once and keeps it until a different block or channel is read
+// If data is invalid, returns zero plus ErrorCode = E_DATA
+uint32_t etsdZRead(uint8_t interV, uint8_t chan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
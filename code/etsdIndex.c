@@ -0,0 +1,249 @@
+/*************************************************************************
+etsdIndex.c timestamp index (.tsdx) for an ETSD time series database 
+ Lets etsdFindBlock() binary search an in-memory array instead of walking the ETSD file a block at a time.
+ Channel groups are written in step, so a grouped file has one index, built from group 0's sectors.
+
+Copyright 2018 Peter VanDerWal 
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "etsd.h"
+#include "etsdIndex.h"
+#include "errorlog.h"
+
+#define IDX_SCAN 64     // 512 byte sectors read per pread() when scanning the ETSD file, fewer with larger blocks
+
+static ETSD_IDX *Idx = NULL;
+static int32_t IdxCnt = 0, IdxAlloc = 0;
+static int IdxFd = -1;
+
+static int32_t idxGrow(int32_t cnt){
+    ETSD_IDX *tmp;
+    if (cnt <= IdxAlloc)
+        return 0;
+    cnt += 1024;
+    if (NULL == (tmp = (ETSD_IDX*)realloc(Idx, cnt * sizeof(ETSD_IDX)))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    Idx = tmp;
+    IdxAlloc = cnt;
+    return 0;
+}
+
+static void idxFill(ETSD_IDX *entry, PBLOCK *blk, int32_t sector){
+    entry->timeStamp = blk->longD[0];
+    entry->valid = sector ? blk->data[2] & 127 : 0;
+    entry->reset = sector ? (blk->data[3] >> 14) & 3 : 0;
+    entry->spare = 0;
+}
+
+// indexes sectors 'from' up to (not including) 'to' by reading them straight from the ETSD file
+// doesn't touch PBlock or RBlock
+static int32_t idxScan(int32_t from, int32_t to){
+    static uint32_t buf[IDX_SCAN*BLOCKSIZE/4];
+    int32_t lp, cnt, bs = ETSD_BSIZE;
+    ssize_t got;
+
+    if (!EtsdInfo.fdMode && etsdOpen('r'))
+        return DATA_INVALID;
+    if (idxGrow(to))
+        return DATA_INVALID;
+    while (from < to){
+        cnt = 1 < EtsdInfo.groups ? 1 : sizeof(buf) / bs;     // sectors per read, group 0's sectors aren't contiguous in a grouped file
+        if (to - from < cnt)
+            cnt = to - from;
+        got = pread(EtsdInfo.fd, buf, cnt * bs, ETSD_OFFSET(from, 0));
+        if (got < bs){
+            ErrorCode |= E_EOF;
+            return DATA_INVALID;
+        }
+        cnt = got / bs;
+        for (lp=0; lp<cnt; lp++)
+            idxFill(&Idx[from+lp], (PBLOCK*)((uint8_t*)buf + lp*bs), from+lp);
+        from += cnt;
+    }
+    IdxCnt = to;
+    return 0;
+}
+
+static int32_t idxOpenW(){
+    char *name;
+    if (0 > IdxFd){
+        if (NULL == (name = etsdSidecarName(EtsdInfo.fileName, "x")))
+            return DATA_INVALID;
+        IdxFd = open(name, O_RDWR|O_CREAT, 0644);
+        free(name);
+        if (0 > IdxFd){
+            ErrorCode |= E_CANT_WRITE;
+            return DATA_INVALID;
+        }
+    }
+    return 0;
+}
+
+// writes in-memory entries 'from' thru IdxCnt-1 to the index file, silently gives up if the file isn't writable (read only user)
+static void idxSave(int32_t from){
+    if (from >= IdxCnt || idxOpenW()){
+        ErrorCode &= ~E_CANT_WRITE;
+        return;
+    }
+    if (!from && ftruncate(IdxFd, 0))  // rewriting the whole index, drop any stale entries
+        ErrorCode |= E_CANT_WRITE;
+    if ((ssize_t)((IdxCnt-from) * sizeof(ETSD_IDX)) != pwrite(IdxFd, Idx+from, (IdxCnt-from) * sizeof(ETSD_IDX), (off_t)from * sizeof(ETSD_IDX)))
+        ErrorCode |= E_CANT_WRITE;
+}
+
+// returns number of entries or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdIdxLoad(){
+    struct stat st;
+    int32_t sectors = etsdGroupSectors(0), cnt, fd;
+    uint32_t timeStamp;
+    char *name;
+
+    if (0 > sectors)
+        return DATA_INVALID;
+    if (!Idx){      // first call, read the index file if there is one
+        name = etsdSidecarName(EtsdInfo.fileName, "x");
+        fd = name ? open(name, O_RDONLY) : -1;      // no name, the index is rebuilt from the blocks below
+        free(name);
+        if (0 <= fd && !fstat(fd, &st)){
+            cnt = st.st_size / sizeof(ETSD_IDX);
+            if (cnt > sectors)
+                cnt = sectors;
+            if (cnt && !idxGrow(cnt) && (ssize_t)(cnt * sizeof(ETSD_IDX)) == pread(fd, Idx, cnt * sizeof(ETSD_IDX), 0)){
+                // make sure index still matches the ETSD file (i.e. not left over from before a rotate)
+                if (ETSD_HEADER == Idx[0].timeStamp && sizeof(timeStamp) == pread(EtsdInfo.fd, &timeStamp, sizeof(timeStamp), ETSD_OFFSET(cnt-1, 0)) 
+                        && timeStamp == Idx[cnt-1].timeStamp)
+                    IdxCnt = cnt;
+            }
+        }
+        if (0 <= fd)
+            close(fd);
+    }
+    if (IdxCnt < sectors){  // index missing or behind, catch up
+        cnt = IdxCnt;
+        if (idxScan(cnt, sectors))
+            return DATA_INVALID;
+        idxSave(cnt);
+    }
+    return IdxCnt;
+}
+
+// returns number of entries or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdIdxRebuild(){
+    int32_t sectors = etsdGroupSectors(0);
+    if (0 > sectors)
+        return DATA_INVALID;
+    IdxCnt = 0;
+    if (idxScan(0, sectors) || idxOpenW())
+        return DATA_INVALID;
+    idxSave(0);
+    return ErrorCode & E_CANT_WRITE ? DATA_INVALID : IdxCnt;
+}
+
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdIdxAppend(PBLOCK *blk, int32_t sector){
+    ETSD_IDX entry;
+    struct stat st;
+
+    if (idxOpenW() || fstat(IdxFd, &st))
+        return DATA_INVALID;
+    if (!sector){       // new ETSD file
+        if (ftruncate(IdxFd, 0)){
+            ErrorCode |= E_CANT_WRITE;
+            return DATA_INVALID;
+        }
+        IdxCnt = 0;
+    } else if (st.st_size != (off_t)sector * sizeof(ETSD_IDX)){ // index is out of sync with ETSD file, rebuild it
+        return 0 > etsdIdxRebuild() ? DATA_INVALID : 0;
+    }
+    idxFill(&entry, blk, sector);
+    if (sizeof(entry) != pwrite(IdxFd, &entry, sizeof(entry), (off_t)sector * sizeof(entry))){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    if (sector == IdxCnt && !idxGrow(sector+1)){
+        Idx[IdxCnt++] = entry;
+    }
+    return 0;
+}
+
+// returns sector, zero if tTime isn't in the ETSD (sets ErrorCode) or -1(DATA_INVALID) if there is no usable index
+int32_t etsdIdxFind(uint32_t tTime){
+    int32_t lo=1, hi, mid;
+
+    if (2 > etsdIdxLoad()){   // need at least one data block
+        ErrorCode &= ~(E_EOF|E_CANT_READ);
+        return DATA_INVALID;
+    }
+    hi = IdxCnt-1;
+    if (tTime < Idx[1].timeStamp){
+        ErrorCode |= E_BEFORE;
+        return 0;
+    }
+    while (lo < hi){    // find last sector with timeStamp <= tTime
+        mid = (lo + hi + 1) / 2;
+        if (Idx[mid].timeStamp <= tTime)
+            lo = mid;
+        else 
+            hi = mid - 1;
+    }
+    if (lo == IdxCnt-1 && tTime > Idx[lo].timeStamp + Idx[lo].valid * EtsdInfo.intervalTime){
+        ErrorCode |= E_AFTER;
+        return 0;
+    }
+    if (tTime > Idx[lo].timeStamp + EtsdInfo.blockIntervals * EtsdInfo.intervalTime){  // falls in a gap between blocks
+        ErrorCode |= E_NOT_FOUND;
+        return 0;
+    }
+    if (etsdRW("r", lo))   // load the block, callers expect it
+        return 0;
+    return lo;
+}
+
+ETSD_IDX *etsdIdxEntry(int32_t sector){
+    if (0 > sector || sector >= IdxCnt)
+        return NULL;
+    return &Idx[sector];
+}
+
+// moves the index file to match an ETSD file that has been renamed to newName
+void etsdIdxRename(char *newName){
+    char *name = etsdSidecarName(EtsdInfo.fileName, "x"), *newIdx = etsdSidecarName(newName, "x");
+    etsdIdxFree();
+    if (name && newIdx)
+        rename(name, newIdx);
+    free(name);
+    free(newIdx);
+}
+
+void etsdIdxFree(){
+    free(Idx);
+    Idx = NULL;
+    IdxCnt = IdxAlloc = 0;
+    if (0 <= IdxFd)
+        close(IdxFd);
+    IdxFd = -1;
+}
@@ -0,0 +1,65 @@
+/*************************************************************************
+etsdIndex.h timestamp index (.tsdx) for an ETSD time series database 
+
+Copyright 2018 Peter VanDerWal 
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdindex_h__
+#define __etsdindex_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The index file is named after the ETSD file with an 'x' added i.e. garage.tsd -> garage.tsdx
+// It holds one 8 byte entry per sector, entry #n describes sector #n.  Entry 0 describes the header sector.
+// Only ever appended to, once a block is written (see etsdBlockWritten()).  If it is missing or out of sync it is rebuilt by scanning the ETSD file.
+typedef struct {
+    uint32_t timeStamp;     // block timestamp, ETSD_HEADER for sector zero
+    uint8_t valid;          // valid intervals in block
+    uint8_t reset;          // source reset bits, same as BLOCK_RESET
+    uint16_t spare;
+} ETSD_IDX;
+
+// loads the index into memory, scanning any sectors that aren't indexed yet
+// returns number of entries or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdIdxLoad();
+
+// discards the current index and rebuilds it from the ETSD file
+// returns number of entries or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdIdxRebuild();
+
+// adds block <blk> to the index as entry #sector, once the block is written (see etsdBlockWritten())
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdIdxAppend(PBLOCK *blk, int32_t sector);
+
+// binary search of the index for the sector that contains tTime
+// returns sector, zero if tTime isn't in the ETSD (ErrorCode = E_BEFORE, E_AFTER or E_NOT_FOUND)
+// or -1(DATA_INVALID) if there is no usable index
+int32_t etsdIdxFind(uint32_t tTime);
+
+// returns pointer to entry #sector, or NULL if it isn't indexed
+ETSD_IDX *etsdIdxEntry(int32_t sector);
+
+// moves the index file to match an ETSD file that has been renamed to newName (see etsdRotate)
+void etsdIdxRename(char *newName);
+
+// frees the in-memory index and closes the index file
+void etsdIdxFree();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,343 @@
+/*************************************************************************
+etsdJournal.c write ahead journal (.tsdj) for the block an ETSD writer is building
+ The block being built only lives in PBlock until etsdCommit() writes it, so a power cut used to lose up to a block of intervals.
+ Each interval's raw channel values are now also written to a small fixed size journal, one pwrite() per group per interval into
+ the page cache, a synced write every interval would cost more than the buffered sector write it protects.  JnlSync decides how
+ often the journal is synced.  etsdJnlReplay() rebuilds the block through the normal save path when the writer starts again.
+ A packed block is kept too (a sealed record), until JNL_SLOTS later blocks have been sealed.  It is synced as it's
+ journaled, and by then the ETSD file has been synced too, see JNL_SYNC.
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "etsd.h"
+#include "etsdSave.h"
+#include "etsdJournal.h"
+#include "errorlog.h"
+
+// follows the ETSD_JNL of a sealed record, then the block
+typedef struct {
+    int64_t offset;         // where the block goes in the ETSD file
+    uint64_t ino;           // the ETSD file's inode, a rotated file's blocks aren't written to the new one
+    int32_t sector;
+    uint32_t bs;            // block size
+} JNL_SEAL;
+
+// slots are sized for the largest group so every group's records stay put, only the used part of a slot is written
+#define JNL_START_SIZE    (sizeof(ETSD_JNL) + ETSD_BSIZE + 5*MAX_CHANNELS)
+#define JNL_INTERVAL_SIZE (sizeof(ETSD_JNL) + 4*MAX_CHANNELS + (MAX_CHANNELS+3)/4)
+#define JNL_SEALED_SIZE   (sizeof(ETSD_JNL) + sizeof(JNL_SEAL) + ETSD_MAX_BLOCK)
+
+uint16_t JnlSync;
+
+static int JnlFd = -1;
+static uint16_t JnlPending;             // intervals journaled since the journal was last synced
+static uint32_t JnlSig[MAX_GROUPS];     // layout signature of each group's journaled block, zero = no block in progress
+static uint32_t JnlSeq[MAX_GROUPS];     // blocks sealed, the next sealed record goes in slot JnlSeq % JNL_SLOTS
+static uint8_t JnlBuf[sizeof(ETSD_JNL) + ETSD_MAX_BLOCK + 5*MAX_CHANNELS + sizeof(JNL_SEAL)];
+
+// file offset of interval <interV> of group <group>, interval zero is the start record
+static off_t jnlOffset(uint8_t group, uint8_t interV){
+    off_t offset = (off_t)group * (JNL_START_SIZE + EtsdInfo.blockIntervals * JNL_INTERVAL_SIZE);
+    return interV ? offset + JNL_START_SIZE + (off_t)(interV-1) * JNL_INTERVAL_SIZE : offset;
+}
+
+// file offset of sealed record <slot> of group <group>, after every group's start and interval records (up to 255 intervals)
+static off_t jnlSealOffset(uint8_t group, uint16_t slot){
+    return (off_t)EtsdInfo.groups * (JNL_START_SIZE + 255 * JNL_INTERVAL_SIZE) + ((off_t)group * JNL_SLOTS + slot) * JNL_SEALED_SIZE;
+}
+
+// size of a record of the current group
+static size_t jnlSize(uint8_t interV){
+    uint16_t ch = EtsdInfo.channels;
+    return interV ? sizeof(ETSD_JNL) + 4*ch + (ch+3)/4 : sizeof(ETSD_JNL) + ETSD_BSIZE + 5*ch;
+}
+
+// FNV-1a of the record with the sum field taken as zero
+static uint32_t jnlSum(uint8_t *rec, size_t len){
+    uint32_t sum = 2166136261u, save = ((ETSD_JNL*)rec)->sum;
+    size_t lp;
+    ((ETSD_JNL*)rec)->sum = 0;
+    for (lp=0; lp<len; lp++)
+        sum = (sum ^ rec[lp]) * 16777619u;
+    ((ETSD_JNL*)rec)->sum = save;
+    return sum;
+}
+
+static void jnlWrite(uint8_t interV, size_t len){
+    ETSD_JNL *rec = (ETSD_JNL*)JnlBuf;
+    rec->magic = interV ? JNL_INTERVAL : JNL_START;
+    rec->group = EtsdInfo.group;
+    rec->interval = interV;
+    rec->timeStamp = PBlock.longD[0];
+    rec->sig = JnlSig[EtsdInfo.group];
+    rec->sum = jnlSum(JnlBuf, len);
+    if ((ssize_t)len != pwrite(JnlFd, JnlBuf, len, jnlOffset(EtsdInfo.group, interV))){
+        ErrorCode |= E_CANT_WRITE;
+        return;
+    }
+    // an interval is synced once its last group is journaled, one fdatasync() covers every group's record
+    if (interV && JnlSync && EtsdInfo.group+1 == EtsdInfo.groups && ++JnlPending >= JnlSync){
+        JnlPending = 0;
+        if (fdatasync(JnlFd))
+            ErrorCode |= E_CANT_WRITE;
+    }
+}
+
+// reads record <interV> of the current group into JnlBuf and checks it belongs to block <timeStamp> (any block for a start record)
+// returns zero if the record can be replayed
+static int32_t jnlRead(uint8_t interV, uint32_t timeStamp, uint32_t sig){
+    ETSD_JNL *rec = (ETSD_JNL*)JnlBuf;
+    size_t len = jnlSize(interV);
+
+    if ((ssize_t)len != pread(JnlFd, JnlBuf, len, jnlOffset(EtsdInfo.group, interV)))
+        return DATA_INVALID;
+    if ((interV ? JNL_INTERVAL : JNL_START) != rec->magic || EtsdInfo.group != rec->group || interV != rec->interval
+            || sig != rec->sig || (interV && timeStamp != rec->timeStamp) || rec->sum != jnlSum(JnlBuf, len))
+        return DATA_INVALID;
+    return 0;
+}
+
+// reads sealed record <slot> of the current group into JnlBuf, returns zero if it is one of this layout's blocks
+static int32_t jnlReadSeal(uint16_t slot, uint32_t sig){
+    ETSD_JNL *rec = (ETSD_JNL*)JnlBuf;
+    JNL_SEAL *seal = (JNL_SEAL*)(JnlBuf + sizeof(ETSD_JNL));
+    size_t len = sizeof(ETSD_JNL) + sizeof(JNL_SEAL) + ETSD_BSIZE;
+
+    if ((ssize_t)len != pread(JnlFd, JnlBuf, len, jnlSealOffset(EtsdInfo.group, slot)))
+        return DATA_INVALID;
+    if (JNL_SEALED != rec->magic || EtsdInfo.group != rec->group || sig != rec->sig || ETSD_BSIZE != seal->bs
+            || rec->sum != jnlSum(JnlBuf, len))
+        return DATA_INVALID;
+    return 0;
+}
+
+// writes the sealed blocks of every group that aren't in the ETSD file, oldest first, then syncs it so every slot can be reused
+static void jnlSealed(){
+    JNL_SEAL *seal = (JNL_SEAL*)(JnlBuf + sizeof(ETSD_JNL));
+    PBLOCK *blk = (PBLOCK*)(JnlBuf + sizeof(ETSD_JNL) + sizeof(JNL_SEAL));
+    struct stat st;
+    uint32_t sig, last;
+    int32_t sector[JNL_SLOTS];
+    uint16_t slot[JNL_SLOTS], cnt, lp, idx, found = 0, written = 0;
+    uint8_t grp;
+    int fd;
+
+    if (0 > (fd = open(EtsdInfo.fileName, O_RDWR)))
+        return;
+    if (fstat(fd, &st)){
+        close(fd);
+        return;
+    }
+    for (grp=0; grp<EtsdInfo.groups && !etsdSaveGroup(grp); grp++){
+        sig = etsdLayoutSig();
+        for (cnt=lp=0; lp<JNL_SLOTS; lp++){     // sort this group's blocks by sector
+            if (jnlReadSeal(lp, sig) || (uint64_t)st.st_ino != seal->ino)
+                continue;
+            for (idx=cnt++; idx && sector[idx-1] > seal->sector; idx--){
+                sector[idx] = sector[idx-1];
+                slot[idx] = slot[idx-1];
+            }
+            sector[idx] = seal->sector;
+            slot[idx] = lp;
+        }
+        found += cnt;
+        for (idx=0; idx<cnt; idx++){
+            jnlReadSeal(slot[idx], sig);
+            if (sizeof(last) == pread(fd, &last, sizeof(last), seal->offset) && last == blk->longD[0])
+                continue;   // made it to the file
+            if (etsdWriteBlock(fd, blk, ETSD_BSIZE, seal->offset)){
+                ErrorCode |= E_CANT_WRITE;
+                break;
+            }
+            etsdBlockWritten(blk, seal->sector);
+            written++;
+        }
+    }
+    if (found && fdatasync(fd))
+        ErrorCode |= E_CANT_WRITE;
+    close(fd);
+    etsdSaveGroup(0);
+    if (written)
+        Log("<5> Wrote %u blocks from the journal that weren't in %s\n", written, EtsdInfo.fileName);
+}
+
+int32_t etsdJnlOpen(){
+    char *name;
+    if (0 <= JnlFd)
+        return 0;
+    if (NULL == (name = etsdSidecarName(EtsdInfo.fileName, "j")))
+        return DATA_INVALID;
+    JnlFd = open(name, O_RDWR|O_CREAT, 0644);   // buffered, see JnlSync
+    free(name);
+    if (0 > JnlFd){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    memset(JnlSig, 0, sizeof(JnlSig));
+    memset(JnlSeq, 0, sizeof(JnlSeq));     // etsdJnlReplay() syncs every sealed block, all the slots are free
+    JnlPending = 0;
+    return 0;
+}
+
+void etsdJnlStart(){
+    uint16_t ch = EtsdInfo.channels, bs = ETSD_BSIZE;
+    uint8_t *data = JnlBuf + sizeof(ETSD_JNL);
+
+    if (0 > JnlFd)
+        return;
+    JnlSig[EtsdInfo.group] = etsdLayoutSig();
+    memcpy(data, &PBlock, bs);
+    memcpy(data + bs, LastReading, 4*ch);
+    memcpy(data + bs + 4*ch, MissedUpdate, ch);
+    jnlWrite(0, jnlSize(0));
+}
+
+void etsdJnlInterval(uint8_t interV, const uint32_t *values, const uint8_t *status){
+    uint16_t ch = EtsdInfo.channels, lp;
+    uint8_t *stat = JnlBuf + sizeof(ETSD_JNL) + 4*ch;
+
+    if (0 > JnlFd || !JnlSig[EtsdInfo.group] || !interV || interV > EtsdInfo.blockIntervals)
+        return;
+    memcpy(JnlBuf + sizeof(ETSD_JNL), values, 4*ch);
+    memset(stat, 0, (ch+3)/4);
+    for (lp=0; lp<ch; lp++)     // 2 bits per channel, bit 1 = source reset and bit 0 = any other invalid status
+        stat[lp/4] |= ((status[lp] & 2) | (0 != status[lp])) << (2*(lp&3));
+    jnlWrite(interV, jnlSize(interV));
+}
+
+void etsdJnlDone(){
+    uint16_t magic = 0;
+    if (0 > JnlFd || !JnlSig[EtsdInfo.group])
+        return;
+    JnlSig[EtsdInfo.group] = 0;
+    if (sizeof(magic) != pwrite(JnlFd, &magic, sizeof(magic), jnlOffset(EtsdInfo.group, 0)))
+        ErrorCode |= E_CANT_WRITE;
+}
+
+void etsdJnlSeal(int64_t offset, int32_t sector){
+    ETSD_JNL *rec = (ETSD_JNL*)JnlBuf;
+    JNL_SEAL *seal = (JNL_SEAL*)(JnlBuf + sizeof(ETSD_JNL));
+    uint16_t bs = ETSD_BSIZE;
+    size_t len = sizeof(ETSD_JNL) + sizeof(JNL_SEAL) + bs;
+    struct stat st;
+
+    if (0 > JnlFd)
+        return;
+    if (fstat(EtsdInfo.fd, &st)){
+        ErrorCode |= E_CANT_READ;
+        return;
+    }
+    seal->offset = offset;
+    seal->ino = st.st_ino;
+    seal->sector = sector;
+    seal->bs = bs;
+    memcpy(JnlBuf + sizeof(ETSD_JNL) + sizeof(JNL_SEAL), &PBlock, bs);
+    rec->magic = JNL_SEALED;
+    rec->group = EtsdInfo.group;
+    rec->interval = 0;
+    rec->timeStamp = PBlock.longD[0];
+    rec->sig = etsdLayoutSig();
+    rec->sum = jnlSum(JnlBuf, len);
+    if ((ssize_t)len != pwrite(JnlFd, JnlBuf, len, jnlSealOffset(EtsdInfo.group, JnlSeq[EtsdInfo.group]++ % JNL_SLOTS))){
+        ErrorCode |= E_CANT_WRITE;
+        return;     // keep the start record then
+    }
+    if (fdatasync(JnlFd)){     // once per block, the sealed record has to be on the disk before the start record goes
+        ErrorCode |= E_CANT_WRITE;
+        return;
+    }
+    etsdJnlDone();
+}
+
+uint8_t etsdJnlReplay(){
+    uint32_t timeStamp = 0, last, values[MAX_CHANNELS], sig[MAX_GROUPS], now = ETSD_NOW(), gone;
+    uint8_t status[MAX_CHANNELS], grp, lp, cnt = 0xFF, resume;
+    uint16_t ch, chan, bs = ETSD_BSIZE;
+    int32_t sectors;
+    uint8_t *data = JnlBuf + sizeof(ETSD_JNL);
+
+    if (0 > JnlFd)
+        return 0;
+    jnlSealed();
+    // every group needs the start record of the same block, and that block can't be in the ETSD file already
+    for (grp=0; grp<EtsdInfo.groups; grp++){
+        if (etsdSaveGroup(grp) || jnlRead(0, 0, sig[grp] = etsdLayoutSig()) || (grp && timeStamp != ((ETSD_JNL*)JnlBuf)->timeStamp))
+            break;
+        timeStamp = ((ETSD_JNL*)JnlBuf)->timeStamp;
+        sectors = etsdSectors();
+        if (0 > sectors || (1 < sectors && (sizeof(last) != pread(EtsdInfo.fd, &last, sizeof(last), ETSD_OFFSET(sectors-1, grp)) || last >= timeStamp)))
+            break;
+        for (lp=0; lp<cnt && lp<EtsdInfo.blockIntervals && !jnlRead(lp+1, timeStamp, sig[grp]); lp++);
+        cnt = lp;   // groups are saved in step, only replay the intervals every group has
+    }
+    if (grp < EtsdInfo.groups || !cnt){
+        if (grp && grp < EtsdInfo.groups)
+            Log("<5> Journal of %s doesn't match the ETSD file, starting a new block\n", EtsdInfo.fileName);
+        ErrorCode &= ~(E_CANT_READ|E_SEEK);
+        etsdSaveGroup(0);
+        return 0;
+    }
+
+    gone = now > timeStamp ? (now - timeStamp) / EtsdInfo.intervalTime : 0;    // intervals since the block started
+    resume = gone < EtsdInfo.blockIntervals ? gone : EtsdInfo.blockIntervals;
+    if (resume < cnt)
+        resume = cnt;
+    for (grp=0; grp<EtsdInfo.groups; grp++){
+        etsdSaveGroup(grp);
+        ch = EtsdInfo.channels;
+        jnlRead(0, 0, sig[grp]);
+        memcpy(&PBlock, data, bs);
+        memcpy(LastReading, data + bs, 4*ch);
+        memcpy(MissedUpdate, data + bs + 4*ch, ch);
+        EtsdBlockFull = 0;
+        JnlSig[grp] = sig[grp];
+        for (chan=0; chan<ch; chan++)
+            if (EtsdChan[chan].codec)
+                saveChan(0, chan, 1, 0);    // just starts the compressed stream, see etsdZStart()
+
+        for (lp=1; lp<=cnt; lp++){
+            jnlRead(lp, timeStamp, sig[grp]);
+            memcpy(values, data, 4*ch);
+            for (chan=0; chan<ch; chan++)
+                status[chan] = (data[4*ch + chan/4] >> (2*(chan&3))) & 3;
+            etsdSaveInterval(lp, values, status);
+        }
+        memset(values, 0xFF, sizeof(values));
+        memset(status, 1, sizeof(status));
+        for ( ; lp<=resume && !EtsdBlockFull; lp++)    // the writer was stopped, these intervals were missed
+            etsdSaveInterval(lp, values, status);
+    }
+    etsdSaveGroup(0);
+    Log("<5> Resumed the block started at %u from the journal, %u intervals saved and %u missed\n", timeStamp, cnt, resume - cnt);
+    return resume;
+}
+
+void etsdJnlClose(){
+    if (0 <= JnlFd)
+        close(JnlFd);
+    JnlFd = -1;
+}
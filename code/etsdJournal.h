@@ -0,0 +1,86 @@
+/*************************************************************************
+etsdJournal.h write ahead journal (.tsdj) for the block an ETSD writer is building
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdjournal_h__
+#define __etsdjournal_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The journal file is named after the ETSD file with a 'j' added i.e. garage.tsd -> garage.tsdj
+// Every channel group has a fixed slot for a start record (the block as etsdBlockStart() and the interval 0 saves left it, plus
+// each channel's last counter reading) followed by one slot per interval holding the raw values passed to etsdSaveInterval().
+// Records are checksummed and tagged with the block's timestamp, so a torn write or a record left over from an earlier block is
+// simply not replayed.  Records are written through the page cache, so by default they survive the writer crashing but not a power
+// cut, see JnlSync.  Sealed records are always synced.
+// Once a block is packed its start record is replaced by a sealed record holding the whole block and where it goes in the ETSD file.
+// Each group has JNL_SLOTS of them, used in turn, so a block that was queued for a writer thread (etsdSeal()) or written but not
+// synced yet is still journaled.  etsdJnlReplay() writes any sealed block that isn't in the ETSD file, otherwise the ETSD file itself
+// is never touched.  A slot is only safe to reuse once its block is on the disk, so writers sync the ETSD file at least every
+// JNL_SYNC blocks whatever the sync policy (EtsdWrite) is, and a writer thread can't have more than JNL_SLOTS - JNL_SYNC blocks queued.
+// Only intervals saved with etsdSaveInterval() are journaled.  Writers that call saveChan() directly (a channel at a time) aren't
+// protected, their block is lost until etsdCommit() writes it, same as without a journal.
+#define JNL_START    0x534A     // "JS"
+#define JNL_INTERVAL 0x494A     // "JI"
+#define JNL_SEALED   0x424A     // "JB"
+#define JNL_SLOTS    128        // sealed records per group
+#define JNL_SYNC     32         // blocks written between syncs at most
+typedef struct {
+    uint16_t magic;         // JNL_START, JNL_INTERVAL or JNL_SEALED, zero once the block is committed
+    uint8_t group;
+    uint8_t interval;       // zero for the start record
+    uint32_t timeStamp;     // the block's timestamp
+    uint32_t sig;           // etsdLayoutSig(), a journal left by another layout is ignored
+    uint32_t sum;           // FNV-1a of the rest of the record
+} ETSD_JNL;
+
+// fdatasync() the journal after every JnlSync interval records, 1 = each one is on the disk when etsdSaveInterval() returns (a flash
+// write every interval).  Zero (the default) leaves them to the kernel's writeback, typically within 30 seconds
+extern uint16_t JnlSync;
+
+// opens (creates) the journal of the current ETSD file.  Until it is opened the other journal functions do nothing
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdJnlOpen();
+
+// journals the block of the current group, call after etsdBlockStart() and the interval 0 saveChan()s
+void etsdJnlStart();
+
+// journals one interval of the current group, called by etsdSaveInterval().  Arguments are the same
+void etsdJnlInterval(uint8_t interV, const uint32_t *values, const uint8_t *status);
+
+// marks the current group's block as committed, called by etsdJnlSeal()
+void etsdJnlDone();
+
+// journals the current group's block, packed and written (or about to be) at <offset>, sector #sector of the ETSD file, and marks
+// the block as committed.  Called by etsdCommit() and etsdSeal()
+void etsdJnlSeal(int64_t offset, int32_t sector);
+
+// writes the sealed blocks that aren't in the ETSD file and syncs it, then rebuilds the blocks that were in progress when the writer
+// stopped, every group is left as it was after its last journaled interval.  Intervals that went by while the writer was stopped are saved as invalid, up to the end of the block.
+// Leaves group 0 selected.  Returns the last interval now in the blocks (the writer's next interval is one more), or zero
+// if there was nothing to resume and the writer should start a new block
+uint8_t etsdJnlReplay();
+
+// closes the journal file
+void etsdJnlClose();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,14 +20,18 @@ Copyright 2018 Peter VanDerWal
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <stddef.h>     // offsetof()
 #include <string.h>
 #include <time.h>
+#include <math.h>       // INFINITY
 //#include <ctype.h>      // for isalnum()
 
 #include "errorlog.h"
 #include "etsd.h"
 #include "etsdRead.h"
 #include "etsdQuery.h"
+#include "etsdRegIndex.h"
+#include "etsdZone.h"
 
 #ifndef EARLIEST_TIME
 #define EARLIEST_TIME 1000187190    // An abitrary value, it's unlikely that ETSD will be used prior to this date/time.
@@ -214,26 +218,169 @@ uint32_t etsdVAT(uint8_t chan, uint32_t tTime){
     return data;
 }
     
-// note: returning int64_t because unit32_t maxes out Total at 1,193 kWh
-int64_t etsdAMT(char *cmd, uint8_t chan, uint32_t start, uint32_t end){
-    int32_t data, Max=0, Min = 2147483647;
+// running state of one channel during etsdScan()
+typedef struct {
+    int64_t Tot;            // register at the start for counters, running total for gauges
+    int64_t regStart, regEnd;   // counter totals at the first and last readings, from the register index
+    double fTot, fMin, fMax;
+    int32_t Max, Min;
+    uint32_t before, after, prevReading, bump, intvCnt;
+} SCAN_CHAN;
+
+// running totals of the selected counters at reading <upto> of the block in RBlock (sector #sector), the register index's total at the
+// start of the block plus the block's own intervals.  *intervals = the index's count of intervals before reading <upto>+1
+// returns zero or -1(DATA_INVALID) if the block isn't indexed
+static int32_t scanReg(ETSD_DBLOCK *db, SCAN_CHAN *sc, int32_t sector, uint8_t upto, uint8_t end, uint32_t *intervals){
+    int64_t total;
+    uint32_t data;
+    uint8_t chan, lp;
+
+    etsdDecodeBlock(db);
+    for(chan=0; chan<EtsdInfo.channels; chan++){
+        if(!db->select[chan])
+            continue;
+        if(TIME_STAMP != etsdRegTotal(sector, chan, &total, intervals))
+            return DATA_INVALID;
+        for(lp=1; lp<=upto; lp++){
+            if(DB_VALID(db, chan, lp)){
+                data = DB_VALUE(db, chan, lp);
+                total += SIGNED(chan) ? (int64_t)(int32_t)data : (int64_t)data;
+            }
+        }
+        if(end)
+            sc[chan].regEnd = total;
+        else
+            sc[chan].regStart = total;
+    }
+    *intervals += upto;
+    return 0;
+}
+
+// adds a block to the selected channels from its zone map record instead of decoding it, a middle block (every interval counted)
+static void scanZone(SCAN_CHAN *sc, uint8_t *select, ETSD_ZREC *z){
+    ETSD_ZONE *zn;
+    SCAN_CHAN *st;
+    uint8_t chan, *valid = ZONE_CNT(z);
+
+    for(chan=0; chan<EtsdInfo.channels; chan++){
+        if(!select[chan])
+            continue;
+        st = sc+chan;
+        zn = ZONE_OF(z, chan);
+        st->intvCnt += CNT_BIT(chan) ? z->intervals : valid[chan];   // only valid intervals count on gauges
+        if(!valid[chan])
+            continue;
+        if(ETSD_FLOAT(chan)){
+            st->fTot += zn->sum;
+            if(etsdValue(chan, zn->min) < st->fMin)
+                st->fMin = etsdValue(chan, zn->min);
+            if(etsdValue(chan, zn->max) > st->fMax)
+                st->fMax = etsdValue(chan, zn->max);
+            continue;
+        }
+        if((int32_t)zn->min < st->Min)
+            st->Min = zn->min;
+        if((int32_t)zn->max > st->Max)
+            st->Max = zn->max;
+        if(!CNT_BIT(chan))
+            st->Tot += (int64_t)zn->sum;
+    }
+}
+
+// the next block etsdScan() decodes after sector *sector, read into RBlock.  With zones != 0 the blocks before the last one
+// (endTime) are added from their zone map records instead, unless an unsigned channel has readings etsdScan() sees as negative
+// returns the block's timestamp, zero at the end of the file
+static uint32_t scanNext(SCAN_CHAN *sc, uint8_t *select, uint32_t *sector, uint32_t endTime, uint8_t zones){
+    ETSD_ZREC *z;
+    uint8_t chan;
+
+    while(zones && (z = etsdZone(*sector+1)) && z->timeStamp && z->timeStamp < endTime){
+        for(chan=0; chan<EtsdInfo.channels; chan++)
+            if(select[chan] && ZONE_CNT(z)[chan] && !ETSD_FLOAT(chan) && !SIGNED(chan) && 0 > (int32_t)ZONE_OF(z, chan)->max)
+                break;
+        if(chan < EtsdInfo.channels)
+            break;
+        scanZone(sc, select, z);
+        ++*sector;
+    }
+    return etsdTimeS(++*sector);
+}
+
+// cmd = tot/ave/min/max, anything else is a total
+uint8_t etsdScanAgg(char *cmd){
+    if (strcasestr(cmd, "min"))
+        return SCAN_MIN;
+    if (strcasestr(cmd, "max"))
+        return SCAN_MAX;
+    if (strcasestr(cmd, "ave"))
+        return SCAN_AVE;
+    return SCAN_TOT;
+}
+
+// note: using int64_t results because unit32_t maxes out Total at 1,193 kWh
+// float channels (see ETSD_FLOAT()) are totaled as doubles, see ETSD_SCAN
+int32_t etsdScan(ETSD_SCAN *items, uint16_t cnt, uint32_t start, uint32_t end){
+    int32_t data;
+    float f;
     // head & tail are seconds before/after first/last readings.  before & after are interpolated data from before/after first/last readings
-    int64_t Tot; 
-    uint32_t before=0,  after=0, head=0, tail=0, prevReading = 0, timeStamp, lastTime=EARLIEST_TIME, endTime, bump=0, intvCnt=0, sector;
-    uint8_t last=0, first=0, shortBlock=0, lastLoop, lp;
+    uint32_t head=0, tail=0, timeStamp, lastTime=EARLIEST_TIME, endTime, sector, span, cover, startInt=0, endInt=0;
+    uint8_t last=0, first=0, shortBlock=0, lastLoop, lp, dataValid, chan, fast, zones;
+    uint16_t it;
+    int64_t Tot;
+    double fTot;
+    SCAN_CHAN *sc, *st;
+    ETSD_DBLOCK db;
     
     if(!(EtsdInfo.channels)){
         ErrorCode = E_NO_ETSD;
         ELog(__func__, 1);
         exit(1);
     }
-    
+    for(it=0; it<cnt; it++){
+        if(items[it].chan >= EtsdInfo.channels){
+            ErrorCode |= E_ARG;
+            ELog(__func__, 0);
+            return DATA_INVALID;
+        }
+    }
+    if(etsdDecodeInit(&db) || !(db.select = calloc(EtsdInfo.channels, 1)) || !(sc = calloc(EtsdInfo.channels, sizeof(SCAN_CHAN)))){
+        ErrorCode |= E_MEM;
+        ELog(__func__, 1);
+        exit(1);
+    }
+    for(it=0; it<cnt; it++)
+        db.select[items[it].chan] = 1;  // only decode the channels we need, each one once no matter how many aggregates use it
+    for(chan=0; chan<EtsdInfo.channels; chan++){
+        st = sc+chan;
+        st->Min = 2147483647;
+        st->Max = SIGNED(chan) ? -2147483647-1 : 0;
+        st->fMin = INFINITY;
+        st->fMax = -INFINITY;
+    }
+    // counter totals and averages are a difference of two register index totals, only the blocks at the ends are decoded
+    fast = !EtsdInfo.group && !EtsdInfo.alignSpan;
+    for(it=0; it<cnt && fast; it++){
+        chan = items[it].chan;
+        fast = (SCAN_TOT == items[it].agg || SCAN_AVE == items[it].agg) && CNT_BIT(chan) && REG_BIT(chan);
+    }
+    if(fast && 1 > etsdRegLoad()){
+        fast = 0;   // no index, scan the blocks
+        ELog("etsdScan register index", 1);
+    }
+    // gauges and counter min/max come straight from the zone map for every block but the first and last, counter totals need every reading
+    zones = !fast && !EtsdInfo.group;
+    for(it=0; it<cnt && zones; it++)
+        zones = !CNT_BIT(items[it].chan) || SCAN_MIN == items[it].agg || SCAN_MAX == items[it].agg;
+    if(zones && 1 > etsdZoneOpen(0))
+        zones = 0;
     
     if( !(sector=etsdFindBlock(end)) ){
         etsdRW("r", -1);        // Pete check for errors
         last = VALID_INTERVALS-1;
         endTime = TIME_STAMP;
         end=endTime+(VALID_INTERVALS)*EtsdInfo.intervalTime;  // end = end of ETSD data
+        if(fast && scanReg(&db, sc, EtsdInfo.sector, last, 1, &endInt))
+            fast = 0;
     } else {
         endTime = TIME_STAMP;
         last = (end-endTime)/EtsdInfo.intervalTime;
@@ -243,15 +390,23 @@ int64_t etsdAMT(char *cmd, uint8_t chan, uint32_t start, uint32_t end){
                 last = VALID_INTERVALS-1;
                 endTime = TIME_STAMP;
                 end=endTime+(VALID_INTERVALS)*EtsdInfo.intervalTime;  // end = end of ETSD data
+                if(fast && scanReg(&db, sc, EtsdInfo.sector, last, 1, &endInt))
+                    fast = 0;
             } else {
-                data = readChan(1, chan);
+                fast = 0;
                 tail = TIME_STAMP+EtsdInfo.intervalTime - end;
+                for(chan=0; chan<EtsdInfo.channels; chan++)
+                    if(db.select[chan])
+                        sc[chan].after = (readChan(1, chan)*tail + EtsdInfo.intervalTime/2)/EtsdInfo.intervalTime;
             }
         } else {
             tail = end - (endTime+last * EtsdInfo.intervalTime);
-            data = readChan(last+1, chan);
+            if(fast && scanReg(&db, sc, sector, last, 1, &endInt))
+                fast = 0;
+            for(chan=0; chan<EtsdInfo.channels; chan++)
+                if(db.select[chan])
+                    sc[chan].after = (readChan(last+1, chan)*tail + EtsdInfo.intervalTime/2)/EtsdInfo.intervalTime;
         }
-        after = (data*tail + EtsdInfo.intervalTime/2)/EtsdInfo.intervalTime;
     }
 
     
@@ -275,91 +430,120 @@ int64_t etsdAMT(char *cmd, uint8_t chan, uint32_t start, uint32_t end){
         } else {
             head -= (first-1)*EtsdInfo.intervalTime;
         }
-        data = readChan(first, chan);
-        before =( (data*head + EtsdInfo.intervalTime/2) / EtsdInfo.intervalTime );
-        for(lp=0;lp<first;lp++){
-            data=readChan(lp, chan); // populate LastReading[chan] 
-        }
-        Tot = LastReading[chan];        // what if not saving registers?
-            
-    } else {    // head=0
-        Tot=readChan(0, chan);  // before=0;
     }
-    
-    if(DATA_INVALID==Tot){
-        // Pete need to figure a fix for no valid last reading
-    }
-    
-    if(! CNT_BIT(chan)){    // gauge channel   
-        Tot=0;  
+    if(fast && scanReg(&db, sc, sector, first ? first-1 : 0, 0, &startInt))
+        fast = 0;
+    for(chan=0; chan<EtsdInfo.channels; chan++){
+        if(!db.select[chan])
+            continue;
+        st = sc+chan;
+        if(first){  // start isn't on a block boundary
+            data = readChan(first, chan);
+            st->before =( (data*head + EtsdInfo.intervalTime/2) / EtsdInfo.intervalTime );
+            for(lp=0;lp<first;lp++){
+                data=readChan(lp, chan); // populate LastReading[chan] 
+            }
+            st->Tot = LastReading[chan];        // what if not saving registers?
+        } else {    // head=0
+            st->Tot=readChan(0, chan);  // before=0;
+        }
+        if(DATA_INVALID==st->Tot){
+            // Pete need to figure a fix for no valid last reading
+        }
+        if(! CNT_BIT(chan)){    // gauge channel   
+            st->Tot=0;  
+        }
+        st->prevReading = st->Tot;
     }
-    prevReading = Tot;
     
-//fprintf(stderr,"Timestamp: %u Start: %u First: %u Total: %" PRId64 " Data: %d Head: %u Before: %u Tail: %u After: %u\n", timeStamp, start, first, Tot, data, head, before, tail, after); 
-
     ErrorCode &= ~E_DATA;  // Pete do I need to handle error before clearing??
+    if(fast){
+        for(chan=0; chan<EtsdInfo.channels; chan++)
+            sc[chan].intvCnt = endInt - startInt;   // the same intervals the loop below would count
+    }
 
     // Pete  Need to Check for ErrorCode==E_DATA, DATA_INVALID, source reset, VALID_INTERVALS < EtsdInfo.blockIntervals, and missing data
-    //
-    while(timeStamp <= endTime){
+    // every block is read and decoded once, then each selected channel's column is walked in turn
+    while(!fast && timeStamp <= endTime){
         if(timeStamp == endTime){
             lastLoop = last;
         } else {
             lastLoop = VALID_INTERVALS;
         }
-//printf("\nTimestamp: %d :",timeStamp);
         if( lastTime > timeStamp ){  
             Log("Error!! Bad timestamp: %u previous timeStamp was %u\n", timeStamp, lastTime);
             exit(1);
         }
 
-        for(lp=first;lp <= lastLoop; lp++){
-            data=readChan(lp, chan);
-            if(lp){
-                intvCnt++;
-                if( ErrorCode & E_DATA ){
-                    ErrorCode &= ~E_DATA;  // Pete handle effect on Tot
-                    if(!CNT_BIT(chan))
-                        intvCnt--;          //only count valid intervals on non-counter streams
-                } else {
-//printf("%d :", data);
-                    if(data<Min){
-                        Min=data;
-                    }
-                    if(data>Max){
-                        Max=data;
-                    }
-                    if(CNT_BIT(chan)){
-                        if (LastReading[chan] < prevReading){  
-                            prevReading = LastReading[chan]; 
-                            bump++;
+        etsdDecodeBlock(&db);   // unpack the whole block once instead of calling readChan() per interval
+        for(chan=0; chan<EtsdInfo.channels; chan++){
+            if(!db.select[chan])
+                continue;
+            st = sc+chan;
+            for(lp=first;lp <= lastLoop; lp++){
+                if(lp){
+                    data = DB_VALUE(&db, chan, lp);
+                    if((dataValid = DB_VALID(&db, chan, lp)))
+                        LastReading[chan] += data;
+                    st->intvCnt++;
+                    if(dataValid && ETSD_FLOAT(chan)){
+                        memcpy(&f, &data, sizeof(f));
+                        if(f != f)              // NaN, nothing to add
+                            dataValid = 0;
+                        else {
+                            st->fTot += f;
+                            if(f<st->fMin)
+                                st->fMin=f;
+                            if(f>st->fMax)
+                                st->fMax=f;
                         }
+                    }
+                    if( !dataValid ){  // Pete handle effect on Tot
+                        if(!CNT_BIT(chan))
+                            st->intvCnt--;          //only count valid intervals on non-counter streams
                     } else {
-                        Tot += data;
+                        if(data<st->Min){
+                            st->Min=data;
+                        }
+                        if(data>st->Max){
+                            st->Max=data;
+                        }
+                        if(CNT_BIT(chan)){
+                            if (LastReading[chan] < st->prevReading){  
+                                st->prevReading = LastReading[chan]; 
+                                st->bump++;
+                            }
+                        } else {
+                            st->Tot += data;
+                        }
+                    } 
+                } else {    // same as readChan(0, chan)
+                    // Pete  Need to Check for source reset, VALID_INTERVALS < EtsdInfo.blockIntervals, and missing data
+                    data = REG_BIT(chan) ? db.reg[chan] : 0;
+                    if(DATA_INVALID == data)
+                        data = 0;
+                    else if(REG_BIT(chan))
+                        LastReading[chan] = data;
+                    if(CNT_BIT(chan)){              // counter stream
+                        if (data < st->prevReading){  //lp==0 then data==read registers
+                            st->prevReading = data; 
+                            st->bump++;
+                        }
                     }
-                } 
-            } else {  // Pete  Need to Check for source reset, VALID_INTERVALS < EtsdInfo.blockIntervals, and missing data
-                uint32_t timeDiff = lastTime + (EtsdInfo.blockIntervals-shortBlock)*EtsdInfo.intervalTime;
-                
-                if (shortBlock){ // did the last block end early?
-                   // timeDiff //
-                }
-                if (BLOCK_RESET){
-                    
                 }
+            }
+        }
+        if(!first){
+            if (shortBlock){ // did the last block end early?
+               // timeDiff = lastTime + (EtsdInfo.blockIntervals-shortBlock)*EtsdInfo.intervalTime
+            }
+            if (BLOCK_RESET){
                 
-                if(CNT_BIT(chan)){              // counter stream
-                    if (data < prevReading){  //lp==0 then data==read registers
-                        prevReading = data; 
-                        bump++;
-                    }
-                }
-                shortBlock = EtsdInfo.blockIntervals-VALID_INTERVALS;
-   
             }
+            shortBlock = EtsdInfo.blockIntervals-VALID_INTERVALS;
         }
         lastTime = timeStamp;
-        if(!(timeStamp=etsdTimeS(++sector))){
+        if(!(timeStamp=scanNext(sc, db.select, &sector, endTime, zones))){
             if(ErrorCode & E_EOF){
                 ErrorCode = 0;
                 break;
@@ -369,46 +553,300 @@ int64_t etsdAMT(char *cmd, uint8_t chan, uint32_t start, uint32_t end){
         }
         first=0;
     }
-printf("Lastreading: %u before: %u after: %u intvCnt: %u \n", LastReading[chan], before, after, intvCnt);
 
-    if (strcasestr(cmd, "min")) {
-        Tot = Min;
-    } else if (strcasestr(cmd, "max")) {
-        Tot = Max;
-    } else {
-        if(CNT_BIT(chan)){
-            if(LastReading[chan]<prevReading)
-                bump--;
-            
-            Tot=(LastReading[chan]-Tot)+bump*4294967296 - before + after;
-
-            before = end - start;
-            after = intvCnt*EtsdInfo.intervalTime + tail - head;
-            Tot = (Tot*before+1) / after;
-            if (strcasestr(cmd, "ave")) {
-                Tot = (Tot + before/2) / before;
-            }
+    // defaults to returning Total
+    span = end - start;
+    for(it=0; it<cnt; it++){
+        chan = items[it].chan;
+        st = sc+chan;
+        if (SCAN_MIN == items[it].agg) {
+            Tot = st->Min;
+        } else if (SCAN_MAX == items[it].agg) {
+            Tot = st->Max;
         } else {
-            if (strcasestr(cmd, "ave")) {
-                Tot /= intvCnt;
+            if(CNT_BIT(chan)){
+                if(fast)
+                    Tot = st->regEnd - st->regStart - st->before + st->after;
+                else
+                    Tot=(LastReading[chan]-st->Tot)+(st->bump - (LastReading[chan]<st->prevReading))*4294967296 - st->before + st->after;
+                cover = st->intvCnt*EtsdInfo.intervalTime + tail - head;
+                Tot = (Tot*span+1) / cover;
+                if (SCAN_AVE == items[it].agg) {
+                    Tot = (Tot + span/2) / span;
+                }
+            } else {
+                Tot = st->Tot;
+                if (SCAN_AVE == items[it].agg) {
+                    Tot = st->intvCnt ? Tot/st->intvCnt : 0;
+                }
             }
         }
+
+        if(ETSD_FLOAT(chan)){  // floats are always gauges
+            if (SCAN_MIN == items[it].agg) {
+                fTot = st->fMin;
+            } else if (SCAN_MAX == items[it].agg) {
+                fTot = st->fMax;
+            } else if (SCAN_AVE == items[it].agg) {
+                fTot = st->intvCnt ? st->fTot/st->intvCnt : 0;
+            } else {
+                fTot = st->fTot;
+            }
+            items[it].fResult = fTot;
+            Tot = !isfinite(fTot) ? 0 : fTot<0 ? fTot-0.5 : fTot+0.5;   // rounded for etsdAMT()
+        } else
+            items[it].fResult = Tot;
+        items[it].result = Tot;
     }
-  // defaults to returning Total
 
-    return Tot;
+    free(sc);
+    free(db.select);
+    etsdDecodeFree(&db);
+    return 0;
         
+} // end etsdScan
+
+int64_t etsdAMT(char *cmd, uint8_t chan, uint32_t start, uint32_t end){
+    ETSD_SCAN item = {chan, etsdScanAgg(cmd)};
+    if(etsdScan(&item, 1, start, end))
+        return DATA_INVALID;
+    return item.result;
+}
+
+double etsdAMTf(char *cmd, uint8_t chan, uint32_t start, uint32_t end){
+    ETSD_SCAN item = {chan, etsdScanAgg(cmd)};
+    if(etsdScan(&item, 1, start, end))
+        return NAN;
+    return item.fResult;
 } // end etsdAMT
 
-/*
-uint32_t etsdKS(char *fName, uint32_t start, uint32_t end, ETSD_KS *ks){
-    //nada
-    
+// value of a reading (or threshold) of channel <chan>, signed and float channels hold int32/float bits
+double etsdKSDouble(uint8_t chan, uint32_t val){
+    return etsdValue(chan, val);
 }
- */ 
-//  Cmd, ChanName, Start, Stop, val, val}  Cmd, ChanName and Start are used by all commands. Minimum 2 arguments, maximum 6
-uint32_t etsdQ(int argc, char *argv){
-   /* nada */ 
-    
+
+// the reverse of etsdKSDouble(), integers are rounded to the nearest and limited to the channel's range
+uint32_t etsdKSValue(uint8_t chan, double val){
+    float f = val;
+    uint32_t data;
+    if(ETSD_FLOAT(chan)){
+        memcpy(&data, &f, sizeof(data));
+        return data;
+    }
+    val = val<0 ? val-0.5 : val+0.5;
+    if(SIGNED(chan))
+        return val <= -2147483648.0 ? 0x80000000 : val >= 2147483647.0 ? 0x7FFFFFFF : (uint32_t)(int32_t)val;
+    return val <= 0 ? 0 : val >= 4294967295.0 ? 0xFFFFFFFF : (uint32_t)val;
+}
+
+// running state of one ETSD_KS during etsdKS()
+typedef struct {
+    double iMin, iMax, over, under, equal, sum, sumOver, sumUnder;
+    int64_t RTot;
+    uint32_t tFirst, tLast;
+} KS_RUN;
+
+// how much of the block of zone map record <z> ks counts, 0 = none of it, 1 = all of it, 2 = part
+static uint8_t ksSpan(ETSD_KS *ks, ETSD_ZREC *z){
+    uint32_t it = EtsdInfo.intervalTime;
+    if(!z->intervals || z->timeStamp + z->intervals*it < ks->start + it || z->timeStamp + it > ks->end)
+        return 0;
+    return z->timeStamp >= ks->start && z->timeStamp + z->intervals*it <= ks->end ? 1 : 2;
 }
 
+// the block of zone map record <z> can't change ks's min/max or add a reading over, under or equal to its thresholds, so the record
+// gives the same results as decoding it
+static uint8_t ksZoneOk(ETSD_KS *ks, KS_RUN *run, ETSD_ZREC *z){
+    uint8_t span = ksSpan(ks, z), chan = ks->chan;
+    double mn, mx;
+    if(!span)
+        return 1;
+    if(2 == span)
+        return 0;
+    if(!ZONE_CNT(z)[chan])
+        return 1;
+    mn = etsdValue(chan, ZONE_OF(z, chan)->min);
+    mx = etsdValue(chan, ZONE_OF(z, chan)->max);
+    return mn >= run->iMin && mx <= run->iMax && !(mx > run->over) && !(mn < run->under) && !(run->equal >= mn && run->equal <= mx);
+}
+
+// adds the block of zone map record <z> to ks, see ksZoneOk()
+static void ksZone(ETSD_KS *ks, KS_RUN *run, ETSD_ZREC *z){
+    uint8_t valid = ZONE_CNT(z)[ks->chan];
+    if(!ksSpan(ks, z))
+        return;
+    if(!ks->intvCnt)
+        run->tFirst = z->timeStamp;
+    ks->intvCnt += z->intervals;
+    ks->errCnt += z->intervals - valid;
+    run->tLast = z->timeStamp + z->intervals*EtsdInfo.intervalTime;
+    if(!valid)
+        return;
+    run->sum += ZONE_OF(z, ks->chan)->sum;
+    if(!ETSD_FLOAT(ks->chan))
+        run->RTot += (int64_t)ZONE_OF(z, ks->chan)->sum;
+}
+
+// the next block etsdKS() decodes after sector *sector, read into RBlock.  Blocks whose zone map record answers every item are
+// added from the record instead
+// returns the block's timestamp, zero at the end of the file
+static uint32_t ksNext(ETSD_KS *ks, KS_RUN *kr, uint16_t cnt, uint32_t *sector, uint32_t hi, uint8_t zones){
+    ETSD_ZREC *z;
+    uint16_t it;
+
+    while(zones && (z = etsdZone(*sector+1)) && z->timeStamp && z->timeStamp < hi){
+        for(it=0; it<cnt && ksZoneOk(ks+it, kr+it, z); it++);
+        if(it < cnt)
+            break;
+        for(it=0; it<cnt; it++)
+            ksZone(ks+it, kr+it, z);
+        ++*sector;
+    }
+    return etsdTimeS(++*sector);
+}
+
+// see etsdQuery.h, every block from the earliest start to the latest end is read and decoded once.  With a zone map the blocks
+// that can't change a min/max or cross a threshold are added up from their records instead
+int32_t etsdKS(ETSD_KS *ks, uint16_t cnt){
+    uint32_t lo=0xFFFFFFFF, hi=0, sector, timeStamp, lastTime=0, t, data, valid;
+    uint16_t it;
+    uint8_t lp, chan, zones;
+    double v, secs, nominal;
+    KS_RUN *kr, *run;
+    ETSD_DBLOCK db;
+
+    if(!(EtsdInfo.channels)){
+        ErrorCode = E_NO_ETSD;
+        ELog(__func__, 1);
+        return DATA_INVALID;
+    }
+    for(it=0; it<cnt; it++){
+        if(ks[it].chan >= EtsdInfo.channels || ks[it].start >= ks[it].end){
+            ErrorCode |= E_ARG;
+            ELog(__func__, 0);
+            return DATA_INVALID;
+        }
+    }
+    if(etsdDecodeInit(&db) || !(db.select = calloc(EtsdInfo.channels, 1)) || !(kr = calloc(cnt, sizeof(KS_RUN)))){
+        ErrorCode |= E_MEM;
+        ELog(__func__, 1);
+        exit(1);
+    }
+    for(it=0; it<cnt; it++){
+        chan = ks[it].chan;
+        db.select[chan] = 1;
+        if(lo > ks[it].start)
+            lo = ks[it].start;
+        if(hi < ks[it].end)
+            hi = ks[it].end;
+        run = kr+it;
+        run->iMin = INFINITY;
+        run->iMax = -INFINITY;
+        run->over = etsdKSDouble(chan, ks[it].over);
+        run->under = etsdKSDouble(chan, ks[it].under);
+        run->equal = etsdKSDouble(chan, ks[it].equal);
+        memset(&ks[it].intvCnt, 0, sizeof(ETSD_KS) - offsetof(ETSD_KS, intvCnt));
+    }
+
+    // Note: each stored reading covers the PREVIOUS interval.  I.e inv#1 is value from zero to 1
+    if(!(sector=etsdFindBlock(lo)) && (ErrorCode & E_BEFORE))
+        sector=1;
+    ErrorCode = 0;
+    zones = !EtsdInfo.group && 0 < etsdZoneOpen(0);
+    timeStamp = sector ? etsdTimeS(sector) : 0;
+    while(timeStamp && timeStamp < hi){
+        if( lastTime > timeStamp ){
+            Log("Error!! Bad timestamp: %u previous timeStamp was %u\n", timeStamp, lastTime);
+            break;
+        }
+        etsdDecodeBlock(&db);
+        for(it=0; it<cnt; it++){
+            chan = ks[it].chan;
+            run = kr+it;
+            for(lp=1; lp<=VALID_INTERVALS; lp++){
+                t = timeStamp + lp*EtsdInfo.intervalTime;  // time of the reading, the interval started intervalTime before
+                if(t - EtsdInfo.intervalTime < ks[it].start || t > ks[it].end)
+                    continue;   // only whole intervals are counted
+                if(!ks[it].intvCnt++)
+                    run->tFirst = t - EtsdInfo.intervalTime;
+                run->tLast = t;
+                data = DB_VALUE(&db, chan, lp);
+                v = etsdKSDouble(chan, data);
+                if(!DB_VALID(&db, chan, lp) || v != v){    // NaN floats are invalid too
+                    ks[it].errCnt++;
+                    continue;
+                }
+                if(v < run->iMin){
+                    run->iMin = v;
+                    ks[it].tMin = t;
+                }
+                if(v > run->iMax){
+                    run->iMax = v;
+                    ks[it].tMax = t;
+                }
+                run->sum += v;
+                if(!ETSD_FLOAT(chan))
+                    run->RTot += SIGNED(chan) ? (int64_t)(int32_t)data : (int64_t)data;
+                if(v > run->over){
+                    if(!ks[it].nOver++)
+                        ks[it].fOver = t;
+                    run->sumOver += v;
+                }
+                if(v < run->under){
+                    if(!ks[it].nUnder++)
+                        ks[it].fUnder = t;
+                    run->sumUnder += v;
+                }
+                if(v == run->equal && !ks[it].nEqual++)
+                    ks[it].fEqual = t;
+            }
+        }
+        lastTime = timeStamp;
+        if(!(timeStamp=ksNext(ks, kr, cnt, &sector, hi, zones))){
+            if(ErrorCode & E_EOF)
+                ErrorCode = 0;
+            else
+                ELog(__func__, 1);
+        }
+    }
+
+    for(it=0; it<cnt; it++){
+        chan = ks[it].chan;
+        run = kr+it;
+        valid = ks[it].intvCnt - ks[it].errCnt;
+        if(ETSD_FLOAT(chan))
+            run->RTot = run->sum<0 ? run->sum-0.5 : run->sum+0.5;
+        if(valid){
+            ks[it].iMin = etsdKSValue(chan, run->iMin);
+            ks[it].iMax = etsdKSValue(chan, run->iMax);
+            ks[it].iAve = etsdKSValue(chan, run->sum/valid);
+        }
+        if(ks[it].nOver)
+            ks[it].AWO = etsdKSValue(chan, run->sumOver/ks[it].nOver);
+        if(ks[it].nUnder)
+            ks[it].AWU = etsdKSValue(chan, run->sumUnder/ks[it].nUnder);
+        ks[it].RTot = run->RTot;
+        ks[it].Tot = run->RTot;
+        secs = run->tLast - run->tFirst;            // real time covered, gaps and clock skew included
+        nominal = (double)ks[it].intvCnt * EtsdInfo.intervalTime;
+        if(ks[it].rate && nominal)
+            ks[it].Tot = llround(run->RTot * secs / nominal);
+        if(CNT_BIT(chan)){      // counters are rates, widgets per second
+            if(valid){
+                ks[it].min = etsdKSValue(chan, run->iMin / EtsdInfo.intervalTime);
+                ks[it].max = etsdKSValue(chan, run->iMax / EtsdInfo.intervalTime);
+            }
+            if(secs)
+                ks[it].ave = etsdKSValue(chan, ks[it].Tot / secs);
+        } else {                // gauges are levels, the same as the interval values
+            ks[it].min = ks[it].iMin;
+            ks[it].max = ks[it].iMax;
+            ks[it].ave = ks[it].iAve;
+        }
+    }
+
+    free(kr);
+    free(db.select);
+    etsdDecodeFree(&db);
+    return 0;
+} // end etsdKS
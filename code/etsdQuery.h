@@ -63,9 +63,47 @@ uint32_t etsdParseTime(char *dt);
 // returns the channel number of chanName, or 255 if not found
 uint8_t etsdChanNum(char *chanName);
 
+// aggregates for ETSD_SCAN.agg
+#define SCAN_TOT    0
+#define SCAN_AVE    1
+#define SCAN_MIN    2
+#define SCAN_MAX    3
+
+// one (channel, aggregate) pair of an etsdScan()
+typedef struct {
+//inputs
+    uint8_t  chan;
+    uint8_t  agg;       // SCAN_TOT/AVE/MIN/MAX
+//results
+    int64_t  result;    // float channels (see ETSD_FLOAT()) are rounded to the nearest integer
+    double   fResult;   // use for float channels
+} ETSD_SCAN;
+
+// returns the SCAN_xxx aggregate named by cmd (tot/ave/min/max), anything else is SCAN_TOT
+uint8_t etsdScanAgg(char *cmd);
+
+// fills in the results of all <cnt> items from one pass over the blocks from start to end, every block is read and decoded once
+// however many channels and aggregates are asked for.  All channels must be in the current channel group
+// returns zero or -1(DATA_INVALID) and sets ErrorCode if an item's channel doesn't exist
+int32_t etsdScan(ETSD_SCAN *items, uint16_t cnt, uint32_t start, uint32_t end);
+
+// cmd = tot/ave/min/max of channel <chan> from start to stop.  Float channels (see ETSD_FLOAT()) are rounded to the nearest integer
 int64_t etsdAMT(char *cmd, uint8_t chan, uint32_t start, uint32_t stop);
 
-uint32_t etsdQ(int argc, char *argv);
+// same as etsdAMT() but returns a double, use for float channels
+double etsdAMTf(char *cmd, uint8_t chan, uint32_t start, uint32_t stop);
+
+// fills in the results of <cnt> ETSD_KS from one pass over the blocks of the current channel group, each with its own chan, start
+// and end (only whole intervals from start to end are counted).  Readings are compared with over/under/equal as they are saved,
+// i.e. per interval on counters, and signed and float channels' values and thresholds hold int32/float bits, see etsdKSValue().
+// With rate set Tot is RTot scaled by the real time the intervals span (block timestamps, so clock skew and gaps) over their nominal
+// length.  Gauges' min/max/ave are the same as iMin/iMax/iAve.  Times (tMin, fOver, etc.) are the time of the reading, the end of its interval
+// returns zero or -1(DATA_INVALID) and sets ErrorCode if a channel doesn't exist or start isn't before end
+int32_t etsdKS(ETSD_KS *ks, uint16_t cnt);
+
+// value of a reading or threshold of channel <chan>, and back again (rounded and limited to the channel's range)
+double etsdKSDouble(uint8_t chan, uint32_t val);
+uint32_t etsdKSValue(uint8_t chan, double val);
 
 #ifdef __cplusplus
 }
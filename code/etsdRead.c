@@ -23,6 +23,9 @@ Copyright 2018 Peter VanDerWal
 
 #include "etsd.h"
 #include "etsdRead.h"
+#include "etsdIndex.h"
+#include "etsdUnpack.h"
+#include "etsdCodec.h"
 #include "errorlog.h"
 
 // Convert <bits> size etsd format to signed value
@@ -35,44 +38,27 @@ int32_t etsdToSigned(uint8_t bits, uint32_t data) {
 
 // extS values 0 to (number of extended channels)
 // pete test this
+// extended streams are packed back to back, 4 intervals per byte starting at EtsdInfo.extStart
 uint8_t readExtS(uint8_t interV, uint8_t extS){
-    uint16_t startP = EtsdInfo.extStart + (extS*EtsdInfo.blockIntervals/4);
-    float fAddr =  (EtsdInfo.blockIntervals * (extS) + interV-1)/ 4.0;
-    uint8_t bPos = (fAddr - (uint8_t)fAddr) * 8;
-    uint16_t bAddr = fAddr;   // pete check rules on converting floats to uints
-/*    uint8_t bAddr, startP, bPos;
-    bAddr =  (EtsdInfo.blockIntervals * (extS) + interV-1)/ 4;
-    bPos = ((EtsdInfo.blockIntervals*(extS) + interV - 1)/4.0 - bAddr)*8;
-    startP = EtsdInfo.extStart + extS*EtsdInfo.blockIntervals/4;
-*/
-    return ( (PBlock.byteD[bAddr+startP] >> bPos) & 3 );
-}
+    uint16_t pos = EtsdInfo.blockIntervals * extS + interV-1;   // 2 bit field, counted from extStart
 
-// If data is invalid, returns zero plus ErrorCode = E_DATA
-uint32_t readAutoS(uint8_t interV, uint8_t ASC, QS_SIZE){
-    uint8_t currentScaling = (SCALING >> (2*ASC)) & 3;
-    uint32_t data=PBlock.data[3 + QS/4 * EtsdInfo.blockIntervals + interV];
-    data = data<65535?((data << currentScaling) + currentScaling ):DATA_INVALID;
-    if (DATA_INVALID == data){
-        data=0;
-        ErrorCode |= E_DATA;
-    }
-    return data; 
+    return ( (RBlock->byteD[EtsdInfo.extStart + pos/4] >> (pos&3)*2) & 3 );
 }
 
+
 uint8_t read4(uint8_t  interV, QS_SIZE){
-    return (PBlock.byteD[ 7 + QS*(EtsdInfo.blockIntervals/2) + (interV+1)/2 ]>>((interV&01)*4)) & 15;
+    return (RBlock->byteD[ 7 + QS*(EtsdInfo.blockIntervals/2) + (interV+1)/2 ]>>((interV&01)*4)) & 15;
 }
 uint8_t read8(uint8_t  interV, QS_SIZE){
-    return PBlock.byteD[7 + QS/2 * EtsdInfo.blockIntervals + interV];
+    return RBlock->byteD[7 + QS/2 * EtsdInfo.blockIntervals + interV];
 }
 
 uint32_t read12(uint8_t interV, uint8_t extS, QS_SIZE){
     uint32_t data;
-    if(1&QS){
-        data = read8(interV, QS) + read4(interV, QS+2)<<8;
+    if(!(1&QS)){    // even QS: half streams first, the quarter stream goes last
+        data = read8(interV, QS) + (read4(interV, QS+2)<<8);
     } else {
-        data = read8(interV, QS+1) + read4(interV, QS)<<8;
+        data = read8(interV, QS+1) + (read4(interV, QS)<<8);
     }
     if (extS--) {
         data += ( readExtS(interV, extS) << 12 ) ;
@@ -89,14 +75,14 @@ uint32_t read12(uint8_t interV, uint8_t extS, QS_SIZE){
 }
 
 uint16_t read16(uint8_t  interV, QS_SIZE){
-    return PBlock.data[3 + QS/4 * EtsdInfo.blockIntervals + interV];
+    return RBlock->data[3 + QS/4 * EtsdInfo.blockIntervals + interV];
 }
 uint32_t read20(uint8_t interV, uint8_t extS, QS_SIZE){
     uint32_t data;
-    if(1&QS){
-        data = read8(interV, QS) + read8(interV, QS+2)<<8 + read4(interV, QS+4)<<16;
+    if(!(1&QS)){    // even QS: half streams first, the quarter stream goes last
+        data = read8(interV, QS) + (read8(interV, QS+2)<<8) + (read4(interV, QS+4)<<16);
     } else {
-        data = read8(interV, QS+1) + read8(interV, QS+3)<<8 + read4(interV, QS)<<16;
+        data = read8(interV, QS+1) + (read8(interV, QS+3)<<8) + (read4(interV, QS)<<16);
     }
     if (extS--) {
         data += ( readExtS(interV, extS) << 20 ) ;
@@ -113,7 +99,7 @@ uint32_t read20(uint8_t interV, uint8_t extS, QS_SIZE){
 }
 
 uint32_t read24(uint8_t interV, uint8_t extS, QS_SIZE){
-    uint32_t data = read8(interV, QS+4)<<16 + read16(interV, QS);
+    uint32_t data = read8(interV, QS) + (read8(interV, QS+2)<<8) + (read8(interV, QS+4)<<16);   // same layout as save24()
     if (0x00FFFFFF==data){
         data = 0;
         ErrorCode |= E_DATA;
@@ -121,9 +107,67 @@ uint32_t read24(uint8_t interV, uint8_t extS, QS_SIZE){
     return data;
 }
 
+// If data is invalid, returns zero plus ErrorCode = E_DATA
+uint32_t readAutoS(uint8_t interV, uint8_t chan){
+    ETSD_CHAN *ch = &EtsdChan[chan];
+    uint8_t currentScaling = etsdScale(RBlock, ch->AS);
+    uint32_t data;
+    switch(ETSD_TYPE(chan)){
+        case 4:
+            data = read8(interV, ch->QS);
+            break;
+        case 6:
+            data = read12(interV, 0, ch->QS);
+            break;
+        case 10:
+            data = read20(interV, 0, ch->QS);
+            break;
+        default:
+            data = read16(interV, ch->QS);
+    }
+    if ((ErrorCode & E_DATA) || (1u << ch->bits) - 1 == data){
+        ErrorCode |= E_DATA;
+        return 0;
+    }
+    return (data << currentScaling) + currentScaling; 
+}
+
+// returns single precision float bit pattern
+// If data is invalid, returns zero plus ErrorCode = E_DATA
+uint32_t readHalf(uint8_t interV, uint8_t extS, QS_SIZE){
+    uint16_t half = read16(interV, QS);
+    if (HALF_INVALID == half){
+        ErrorCode |= E_DATA;
+        return 0;
+    }
+    return etsdHalfToFloat(half);
+}
+
 // 32 bit streams can't be invalid (not possible to save more than 32 bits) so no error checking
 uint32_t read32(uint8_t interV, uint8_t extS, QS_SIZE){
-    uint32_t data = read16(interV, QS+4)<<16 + read16(interV, QS);
+    uint32_t data = ((uint32_t)read16(interV, QS+4)<<16) + read16(interV, QS);
+    return data;
+}
+
+// float32 stream, returns float bit pattern
+// If data is invalid (all ones), returns zero plus ErrorCode = E_DATA
+uint32_t readFloat(uint8_t interV, uint8_t extS, QS_SIZE){
+    uint32_t data = read32(interV, extS, QS);
+    if (DATA_INVALID == data){
+        ErrorCode |= E_DATA;
+        data = 0;
+    }
+    return data;
+}
+
+// int32 stream, no etsdToSigned() conversion needed
+// If data is invalid (INT32_INVALID), returns zero plus ErrorCode = E_DATA
+uint32_t readInt32(uint8_t interV, uint8_t extS, QS_SIZE){
+    uint32_t data = read32(interV, extS, QS);
+    if (INT32_INVALID == data){
+        ErrorCode |= E_DATA;
+        data = 0;
+    }
     return data;
 }
 
@@ -176,11 +220,25 @@ uint32_t readQS(uint8_t  interV, uint8_t extS, QS_SIZE){
 //    return PBlock.byteD[EtsdInfo.xDataStart + addr];
 //}
 
+// stream read functions by ETSD stream type, types 0, 1 and 15 are handled in readChan()
+static uint32_t (*const readFunct[16])(uint8_t interV, uint8_t extS, QS_SIZE) = {
+    NULL, NULL,
+    readQS, readQS,     //  2, 3 = Quarter Streams
+    readHS, readHS,     //  4, 5 = Half Streams
+    read12, read12,     //  6, 7 = Short Streams
+    readFS, readFS,     //  8, 9 = Full Streams
+    read20, read20,     // 10, 11 = 20bit Streams
+    read24,             // 12 = Large Stream
+    read32,             // 13 = Double Stream
+    readHalf,           // 14 = Half Precision Float, returns float bit pattern
+    NULL
+};
+
 // Returns value saved to stream, unless stream value == Error Value.
 // If data is invalid, returns zero plus ErrorCode = E_DATA
 int32_t readChan(uint8_t interV, uint8_t chan){
     int32_t data=0;
-    uint8_t lp, AS=0, relCh=0, QS=0, extS=1, reg=1;
+    ETSD_CHAN *ch = &EtsdChan[chan];
 
     if(!(EtsdInfo.channels)){   // indicates no ETSD initialized
         ErrorCode = E_NO_ETSD;
@@ -188,94 +246,44 @@ int32_t readChan(uint8_t interV, uint8_t chan){
         exit(1);
     }
     
-    for(lp=0; lp<chan; lp++) {  //determin counters up to this channel
-        if(EXTS_BIT(lp))    // Count extended streams
-            extS++;
-        if(AUTOSC(lp))  // Count AutoScale streams
-            AS++;
-        if(CNT_BIT(lp))    // Count Counter/Relative streams
-            relCh++;
-        if(REG_BIT(lp))     // Count saved registers 
-            reg++;
-        switch(ETSD_TYPE(lp)){     
-            case 14:    // reserved for single precision floating point
-            case 13:
-                QS +=2;
-            case 12:
-                QS ++;
-            case 11:
-            case 10:
-                QS ++;
-            case 15:
-            case 9:
-            case 8:
-                QS++;
-            case 7:
-            case 6:
-                QS++;
-            case 5:
-            case 4:
-                QS++;
-            case 3:
-            case 2:
-                QS++;
-        }
-    }
-    
     ErrorCode &= ~E_DATA; // clear error
 
-    if (interV) {       
-        if(!EXTS_BIT(chan)) { // channel doesn't use an extended Stream
-            extS = 0;       
-        }
- 
-        switch(ETSD_TYPE(chan)){
-            case 15:             // AutoScaling
-                data = readAutoS(interV, AS, QS);   
-                break;
-            case 14:    // not implementing floating point yet
-            case 13:    
-                data = read32(interV, extS, QS);   
-                break;
-            case 12:    
-                data = read24(interV, extS, QS);   
-                break;
-            case 11:    
-            case 10:
-                data = read20(interV, extS, QS);   
-                break;
-            case 9:     // Extended Full Stream
-            case 8:     // Full Stream
-                data = readFS(interV, extS, QS);   
-                break;
-            case 7:     // Extended Half Stream
-            case 6:     // Half Stream
-                data = read12(interV, extS, QS);
+    if (interV && ch->codec) {  // compressed gauge, values are saved as is
+        data = etsdZRead(interV, chan);
+        if( !(ErrorCode&E_DATA) )
+            LastReading[chan] += data;
+    } else if (interV) {       
+        switch(ch->scaled ? 15 : ETSD_TYPE(chan)){
+            case 15:             // AutoScaling, type 15 or flagged in the header
+                data = readAutoS(interV, chan);   
                 break;
-            case 5:     // Extended Half Stream
-            case 4:     // Half Stream
-                data = readHS(interV, extS, QS);
+            case 1:     //  Two bit Stream
+                data = readExtS(interV, ch->extS-1);
                 break;
-            case 3:     // Extended Quarter Stream
-            case 2:     //  Quarter Stream
-                data = readQS(interV, extS, QS);
+            case 0:
+                ErrorCode |= (E_ARG | E_DATA);
                 break;
-            case 1:     //  Two bit Stream
-                data = readExtS(interV, --extS);
+            case 13:    // Double Stream, float32 or int32
+                if (FLOAT_BIT(chan))
+                    data = readFloat(interV, ch->extS, ch->QS);
+                else if (SIGNED(chan))
+                    data = readInt32(interV, ch->extS, ch->QS);
+                else
+                    data = read32(interV, ch->extS, ch->QS);
                 break;
             default:
-                ErrorCode |= (E_ARG | E_DATA);
+                data = readFunct[ETSD_TYPE(chan)](interV, ch->extS, ch->QS);
         }
 
         if( !(ErrorCode&E_DATA) ){
-            if(SIGNED(chan)){
+            if(SIGNED(chan) && 13 != ETSD_TYPE(chan)){
                 data = etsdToSigned(2*ETSD_TYPE(chan), data);
             }
             LastReading[chan] += data;
         }    
     } else {  // interV = 0, read registers
         if (REG_BIT(chan)) {
-            data = readReg(reg);  // Pete fix lastreading if E_DATA=ErrorCode
+            data = readReg(ch->reg);  // Pete fix lastreading if E_DATA=ErrorCode
             if (DATA_INVALID == data){
                 ErrorCode |= E_DATA;
                 data=0;
@@ -297,17 +305,44 @@ int32_t readChan(uint8_t interV, uint8_t chan){
 // call with desired target epoch Time,
 // returns Positive value that equals the desired sector(Block) that contains data stored during target Time 
 // or zero to indicate error, see errorlog.h for list of error codes
+// Aligned files (see HX_ALIGN) work the sector out from the time, otherwise uses the .tsdx index (binary search, one block read)
+// when available, or walks the ETSD file
 uint32_t etsdFindBlock(uint32_t tTime){
     uint32_t sector, timeStamp, blockTime = EtsdInfo.intervalTime * EtsdInfo.blockIntervals;
     uint16_t validIntervals;
     uint8_t back=0, forward=0;
+    int32_t found;
     
     ELog("etsdFindBlock previous errors", 1);  //log any existing errors and zero ErrorCode
     
+    if (EtsdInfo.alignSpan){
+        if (!(timeStamp = etsdAlignBase()) || tTime < timeStamp){
+            ErrorCode |= timeStamp ? E_BEFORE : E_EOF;
+        } else {
+            sector = (tTime - timeStamp) / blockTime + 1;
+            found = etsdSectors();
+            if ((int32_t)sector >= found || etsdRW("r", sector))
+                ErrorCode |= E_AFTER;
+            else if (sector == found-1 && tTime > TIME_STAMP + VALID_INTERVALS*EtsdInfo.intervalTime)
+                ErrorCode |= E_AFTER;   // after the last reading saved
+            else
+                return sector;  // may be a gap block, no valid intervals
+        }
+        ELog(__func__, 1);
+        return 0;
+    }
+
+    if (DATA_INVALID != (found = etsdIdxFind(tTime))){
+        if (found)
+            return found;
+        ELog(__func__, 1);
+        return 0;
+    }
+
     if (etsdRW("r",-1))
         return 0; // returns zero to indicate error reading last block of ETSD
 
-    timeStamp = PBlock.longD[0];    // this will be the timestamp of the last block of data saved to ETSD
+    timeStamp = TIME_STAMP;    // this will be the timestamp of the last block of data saved to ETSD
     if(tTime > timeStamp+(VALID_INTERVALS*EtsdInfo.intervalTime)) {
         ErrorCode |= E_AFTER; // error target time is after ETSD ends
     }
@@ -352,3 +387,163 @@ uint32_t etsdFindBlock(uint32_t tTime){
     return 0;  // return zero to indicate error
 }
 
+
+// value of a reading of channel <chan> as readChan() or etsdDecodeBlock() return it, signed and float channels hold int32/float bits
+double etsdValue(uint8_t chan, uint32_t data){
+    float f;
+    if (ETSD_FLOAT(chan)){
+        memcpy(&f, &data, sizeof(f));
+        return f;
+    }
+    return SIGNED(chan) ? (double)(int32_t)data : (double)data;
+}
+
+// allocates the column arrays for the current ETSD, call after etsdInit()
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdDecodeInit(ETSD_DBLOCK *db){
+    uint16_t chans = EtsdInfo.channels ? EtsdInfo.channels : 1;
+    db->stride = EtsdInfo.blockIntervals ? EtsdInfo.blockIntervals : 1;
+    db->words = (db->stride + 31) / 32;
+    db->select = NULL;
+    if (UNPACK_BEST == EtsdUnpackLevel)
+        etsdUnpackInit(UNPACK_BEST);
+    db->data = (uint32_t*)calloc(chans * db->stride, sizeof(uint32_t));
+    db->valid = (uint32_t*)calloc(chans * db->words, sizeof(uint32_t));
+    db->reg = (uint32_t*)calloc(chans, sizeof(uint32_t));
+    if (NULL == db->data || NULL == db->valid || NULL == db->reg){
+        etsdDecodeFree(db);
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    return 0;
+}
+
+void etsdDecodeFree(ETSD_DBLOCK *db){
+    free(db->data);
+    free(db->valid);
+    free(db->reg);
+    db->data = db->valid = db->reg = NULL;
+}
+
+// decodes the block most recently read by etsdRW() (RBlock) into db
+// Each piece of a channel's stream is expanded for all intervals at once by the etsdUnpack.c kernels,
+// the inverse of the save functions in etsdSave.c
+// Like readChan(), only 12 bit and larger streams are checked for invalid (all ones) data
+// returns number of valid intervals
+int32_t etsdDecodeBlock(ETSD_DBLOCK *db){
+    const uint8_t *b = RBlock->byteD + 8;      // first interval of stream 0, see read8()
+    const uint16_t *w = RBlock->data + 4;      // see read16()
+    uint8_t bi = EtsdInfo.blockIntervals, cnt = VALID_INTERVALS, chan, lp, type, scale;
+    uint16_t q, hs;
+    uint32_t *col, *vbits, maxV;
+
+    db->timeStamp = RBlock->longD[0];
+    db->reset = BLOCK_RESET;
+    if (cnt > bi)
+        cnt = bi;
+    db->intervals = cnt;
+
+    for (chan=0; chan<EtsdInfo.channels; chan++){
+        if (db->select && !db->select[chan])
+            continue;
+        col = db->data + chan*db->stride;
+        vbits = db->valid + chan*db->words;
+        db->reg[chan] = EtsdChan[chan].reg ? readReg(EtsdChan[chan].reg) : DATA_INVALID;
+        type = ETSD_TYPE(chan);
+        if (!type || !cnt){
+            memset(vbits, 0, db->words*sizeof(uint32_t));
+            continue;
+        }
+        if (EtsdChan[chan].codec){  // compressed gauge, bit stream decoded one code at a time
+            etsdZDecode(RBlock, chan, cnt, col, vbits);
+            continue;
+        }
+        q = EtsdChan[chan].QS;
+        hs = q/2 * bi;
+        maxV = 0;   // data >= maxV is invalid, zero = no check
+
+        switch(type){
+            case 2:     // Quarter Streams
+            case 3:
+                EtsdUnpack.u4(b + q*(bi/2), col, cnt, 0);
+                break;
+            case 4:     // Half Streams
+            case 5:
+                EtsdUnpack.u8(b + hs, col, cnt, 0);
+                break;
+            case 6:     // Short Streams
+            case 7:
+                if (!(1&q)){
+                    EtsdUnpack.u8(b + hs, col, cnt, 0);
+                    EtsdUnpack.u4(b + (q+2)*(bi/2), col, cnt, 8);
+                } else {
+                    EtsdUnpack.u8(b + (q+1)/2*bi, col, cnt, 0);
+                    EtsdUnpack.u4(b + q*(bi/2), col, cnt, 8);
+                }
+                maxV = EtsdChan[chan].extS ? 16383 : 4095;
+                break;
+            case 8:     // Full Streams
+            case 9:
+                EtsdUnpack.u16(w + q/4*bi, col, cnt, 0);
+                maxV = EtsdChan[chan].extS ? 262143 : 65535;
+                break;
+            case 10:    // 20bit Streams
+            case 11:
+                if (!(1&q)){
+                    EtsdUnpack.u8(b + hs, col, cnt, 0);
+                    EtsdUnpack.u8(b + (q+2)/2*bi, col, cnt, 8);
+                    EtsdUnpack.u4(b + (q+4)*(bi/2), col, cnt, 16);
+                } else {
+                    EtsdUnpack.u8(b + (q+1)/2*bi, col, cnt, 0);
+                    EtsdUnpack.u8(b + (q+3)/2*bi, col, cnt, 8);
+                    EtsdUnpack.u4(b + q*(bi/2), col, cnt, 16);
+                }
+                maxV = EtsdChan[chan].extS ? 4194303 : 1048575;
+                break;
+            case 12:    // Large Stream
+                EtsdUnpack.u8(b + hs, col, cnt, 0);
+                EtsdUnpack.u8(b + (q+2)/2*bi, col, cnt, 8);
+                EtsdUnpack.u8(b + (q+4)/2*bi, col, cnt, 16);
+                maxV = 0x00FFFFFF;
+                break;
+            case 13:    // Double Stream, float32 invalid = all ones, int32 is checked below
+                EtsdUnpack.u16(w + q/4*bi, col, cnt, 0);
+                EtsdUnpack.u16(w + (q+4)/4*bi, col, cnt, 16);
+                if (FLOAT_BIT(chan))
+                    maxV = DATA_INVALID;
+                break;
+            case 14:    // Half Float, converted straight to float bit patterns
+                EtsdUnpack.f16(w + q/4*bi, col, cnt);
+                maxV = HALF_INVALID_F;
+                break;
+            case 15:    // AutoScaling
+                EtsdUnpack.u16(w + q/4*bi, col, cnt, 0);
+                maxV = 65535;
+                break;
+        }
+        if (EtsdChan[chan].scaled)
+            maxV = (1u << EtsdChan[chan].bits) - 1;
+        // ext bits are the top 2 bits of the value, type 1 is the ext stream alone
+        if (EtsdChan[chan].extS)
+            EtsdUnpack.u2(RBlock->byteD + EtsdInfo.extStart, (EtsdChan[chan].extS-1)*bi, col, cnt, 2*(type-1));
+        EtsdUnpack.mask(col, cnt, maxV, vbits);
+        
+        if (EtsdChan[chan].scaled && (scale = etsdScale(RBlock, EtsdChan[chan].AS))){
+            for (lp=0; lp<cnt; lp++)
+                if ((vbits[lp/32] >> (lp&31)) & 1)
+                    col[lp] = (col[lp] << scale) + scale;
+        }
+        if (13 == type && SIGNED(chan) && !FLOAT_BIT(chan)){
+            for (lp=0; lp<cnt; lp++)
+                if (INT32_INVALID == col[lp]){
+                    col[lp] = 0;
+                    vbits[lp/32] &= ~(1u << (lp&31));
+                }
+        } else if (SIGNED(chan)){
+            for (lp=0; lp<cnt; lp++)
+                if ((vbits[lp/32] >> (lp&31)) & 1)
+                    col[lp] = etsdToSigned(2*type, col[lp]);
+        }
+    }
+    return cnt;
+}
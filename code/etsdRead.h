@@ -24,9 +24,9 @@ extern "C" {
 
 #include "etsdSave.h"
 
-#define etsdTimeS(seek) (etsdRW("r", (seek))?0:PBlock.longD[0])
-#define readReg(reg) (PBlock.longD[BLOCKSIZE/4-(reg)])
-#define readXData(addr) (PBlock.byteD[EtsdInfo.xDataStart+(addr)])
+#define etsdTimeS(seek) (etsdRW("r", (seek))?0:RBlock->longD[0])
+#define readReg(reg) (RBlock->longD[ETSD_BSIZE/4-(reg)])
+#define readXData(addr) (RBlock->byteD[EtsdInfo.xDataStart+(addr)])
 //reg = 1-??,  registers are saved starting at end of Block, working back
 //uint32_t readReg(uint8_t reg);
 
@@ -48,6 +48,37 @@ int32_t etsdToSigned(uint8_t bits, uint32_t data);
 // Note:  Potential problems with this code on 32bit OS starting in the year 2038 (epoch date bug)
 uint32_t etsdFindBlock(uint32_t tTime);
 
+// Whole block, columnar version of readChan().  Decodes every interval of every channel in one pass.
+// Values are the same as readChan() returns, invalid intervals are zero with their valid bit clear.
+// Type 14 (half float) and float32 values are single precision float bit patterns, see ETSD_FLOAT()
+typedef struct {
+    uint32_t timeStamp;
+    uint8_t intervals;      // valid intervals in this block
+    uint8_t reset;          // source reset bits, same as BLOCK_RESET
+    uint8_t stride;         // entries per column, = EtsdInfo.blockIntervals
+    uint8_t words;          // uint32_t words per channel in valid bitmap
+    uint8_t *select;        // optional, only decode channels where select[chan] is non zero.  NULL = decode all channels
+    uint32_t *data;         // columns, use DB_VALUE()
+    uint32_t *valid;        // bitmap, bit set = valid data, use DB_VALID()
+    uint32_t *reg;          // saved register per channel, DATA_INVALID if channel doesn't save one (or it's invalid)
+} ETSD_DBLOCK;
+
+// interV = 1 - intervals
+#define DB_VALUE(db, chan, interV) ((db)->data[(chan)*(db)->stride + (interV)-1])
+#define DB_VALID(db, chan, interV) (((db)->valid[(chan)*(db)->words + ((interV)-1)/32] >> (((interV)-1)&31)) & 1)
+
+// value of a reading of channel <chan>, signed channels are int32 and float channels (see ETSD_FLOAT()) are float bit patterns
+double etsdValue(uint8_t chan, uint32_t data);
+
+// allocates the column arrays for the current ETSD, call after etsdInit()
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdDecodeInit(ETSD_DBLOCK *db);
+void etsdDecodeFree(ETSD_DBLOCK *db);
+
+// decodes the block most recently read by etsdRW() (RBlock) into db
+// returns number of valid intervals
+int32_t etsdDecodeBlock(ETSD_DBLOCK *db);
+
 #ifdef ALL_SYMBOLS
 
 // normally used to extended (add 2 bits to) a data stream, but can be used alone to store 2 bit data streams.  Only LSbx2 of data is saved
@@ -56,9 +87,9 @@ uint32_t etsdFindBlock(uint32_t tTime);
 uint8_t readExtS(uint8_t interV, uint8_t extS);
 
 
-// Auto-Scaling (currently) works on full streams only. Can handle any value up to 524272, any larger values is saved as invalid (all 1's)
-// ASC = Auto-Scaling channel 0-7
-uint32_t readAutoS(uint8_t interV, uint8_t ASC, uint8_t FS);
+// Auto-Scaling works on 8, 12, 16 and 20 bit streams, type 15 or flagged in the header (see HX_ASCALE)
+// chan = an auto-scaled channel.  If data is invalid, returns zero plus ErrorCode = E_DATA
+uint32_t readAutoS(uint8_t interV, uint8_t chan);
 
 uint8_t read4(uint8_t interV, QS_SIZE);
 uint8_t read8(uint8_t interV, QS_SIZE);
@@ -69,6 +100,13 @@ uint32_t read20(uint8_t interV, uint8_t extS, QS_SIZE);
 uint32_t read24(uint8_t interV, uint8_t extS, QS_SIZE);
 uint32_t read32(uint8_t interV, uint8_t extS, QS_SIZE);
 
+// float32 / int32 versions of read32(), return zero plus ErrorCode = E_DATA if invalid
+uint32_t readFloat(uint8_t interV, uint8_t extS, QS_SIZE);
+uint32_t readInt32(uint8_t interV, uint8_t extS, QS_SIZE);
+
+// returns single precision float bit pattern, or zero plus ErrorCode = E_DATA if invalid
+uint32_t readHalf(uint8_t interV, uint8_t extS, QS_SIZE);
+
 
 // For FS/HS/QS extS: 0=don't save extended data, otherwise indicates which extS stream to use
 // do NOT call saveFS/saveHS/saveQS when interV = 0, valid intervals are 1 to (BlockIntervals-1)
@@ -0,0 +1,370 @@
+/*************************************************************************
+etsdRegIndex.c counter register index (.tsdc) for an ETSD time series database
+ Counter channels that save their source register already have an absolute reading at the start of every block, so a total over any
+ time range is the difference of two registers plus the partial blocks at the ends.  The index keeps each register with its rollovers
+ counted, so etsdScan() can total years of a counter from two records and two block decodes.  See etsdRegIndex.h for the file layout.
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "etsd.h"
+#include "etsdRead.h"
+#include "etsdRegIndex.h"
+#include "errorlog.h"
+
+static int RegFd = -1;
+static uint8_t RegWrite = 0;            // RegFd is writable, otherwise the catch up is kept in RegTail
+static char *RegFile = NULL;            // ETSD file the index was opened for, NULL = not open
+static ETSD_REGHDR RegHdr;
+static uint8_t RegChan[MAX_CHANNELS];   // channel of each counter
+static uint8_t RegSlot[MAX_CHANNELS];   // counter of each channel, 0xFF = not indexed
+static int32_t RegCnt = 0;              // next sector to index, sectors 1 to RegCnt-1 are.  Zero = no index
+static int32_t RegDisk = 0;             // sectors from this one on are only in RegTail
+static uint8_t *RegTail = NULL;
+static int32_t RegTailAlloc = 0;        // records
+static uint8_t *RegLast = NULL;         // record of sector RegCnt-1
+static uint8_t *RegRec = NULL;          // record being built or read
+static int64_t RegSum[MAX_CHANNELS];    // each counter's valid intervals added up over block RegCnt-1
+static uint8_t RegValid = 0, RegReset = 0;  // valid intervals and source reset bits of block RegCnt-1
+static ETSD_DBLOCK RegDb = {0};         // counters only
+
+#define REG_REC (sizeof(ETSD_REGREC) + RegHdr.counters * (sizeof(int64_t) + sizeof(uint32_t)))    // bytes per record
+#define REG_TOT(rec) ((int64_t*)((rec) + sizeof(ETSD_REGREC)))
+#define REG_REG(rec) ((uint32_t*)((rec) + sizeof(ETSD_REGREC) + RegHdr.counters * sizeof(int64_t)))
+
+static off_t regOffset(int32_t sector){
+    return sizeof(ETSD_REGHDR) + (off_t)(sector-1) * REG_REC;
+}
+
+// counter value of an interval or register, signed channels count down as well as up
+static int64_t regValue(uint8_t chan, uint32_t data){
+    return SIGNED(chan) ? (int64_t)(int32_t)data : (int64_t)data;
+}
+
+// decodes <blk> into RegDb, RBlock is left as it was
+static void regDecode(PBLOCK *blk){
+    PBLOCK *save = RBlock;
+    RBlock = blk;
+    etsdDecodeBlock(&RegDb);
+    RBlock = save;
+}
+
+// keeps what the next block's record needs from the block decoded into RegDb
+static void regKeep(){
+    uint16_t c;
+    uint8_t chan, lp;
+    for (c=0; c<RegHdr.counters; c++){
+        chan = RegChan[c];
+        RegSum[c] = 0;
+        for (lp=1; lp<=RegDb.intervals; lp++)
+            if (DB_VALID(&RegDb, chan, lp))
+                RegSum[c] += regValue(chan, DB_VALUE(&RegDb, chan, lp));
+    }
+    RegValid = RegDb.intervals;
+    RegReset = RegDb.reset;
+}
+
+// builds the record of <blk>, as sector RegCnt, into RegRec
+static void regNext(PBLOCK *blk){
+    ETSD_REGREC *rec = (ETSD_REGREC*)RegRec;
+    int64_t *tot = REG_TOT(RegRec), *pTot = REG_TOT(RegLast);
+    uint32_t *reg = REG_REG(RegRec), *pReg = REG_REG(RegLast), now;
+    uint16_t c;
+    uint8_t chan, src;
+
+    regDecode(blk);
+    rec->timeStamp = RegDb.timeStamp;
+    rec->intervals = 1 < RegCnt ? ((ETSD_REGREC*)RegLast)->intervals + RegValid : 0;
+    for (c=0; c<RegHdr.counters; c++){
+        chan = RegChan[c];
+        src = SRC_TYPE(chan);
+        reg[c] = now = RegDb.reg[chan];
+        if (1 == RegCnt)    // first block, the total starts at the register
+            tot[c] = DATA_INVALID == now ? 0 : regValue(chan, now);
+        else if (DATA_INVALID == now || DATA_INVALID == pReg[c] || (2 > src && (RegReset >> (1-src)) & 1))
+            tot[c] = pTot[c] + RegSum[c];   // the source was reset (or a register is missing), only the last block's intervals are known
+        else    // modulo 2^32, so a register that rolled over still counts up
+            tot[c] = pTot[c] + (SIGNED(chan) ? (int64_t)(int32_t)(now - pReg[c]) : (int64_t)(uint32_t)(now - pReg[c]));
+    }
+    regKeep();
+}
+
+// saves RegRec as sector RegCnt
+static int32_t regPut(){
+    uint8_t *tmp;
+    if (RegWrite){
+        if ((ssize_t)REG_REC != pwrite(RegFd, RegRec, REG_REC, regOffset(RegCnt))){
+            ErrorCode |= E_CANT_WRITE;
+            return DATA_INVALID;
+        }
+        RegDisk = RegCnt + 1;
+    } else {
+        if (RegCnt - RegDisk >= RegTailAlloc){
+            if (NULL == (tmp = (uint8_t*)realloc(RegTail, (RegTailAlloc + 1024) * REG_REC))){
+                ErrorCode |= E_MEM;
+                return DATA_INVALID;
+            }
+            RegTail = tmp;
+            RegTailAlloc += 1024;
+        }
+        memcpy(RegTail + (size_t)(RegCnt - RegDisk) * REG_REC, RegRec, REG_REC);
+    }
+    memcpy(RegLast, RegRec, REG_REC);
+    RegCnt++;
+    return 0;
+}
+
+// indexes sectors RegCnt up to (not including) <to> by reading them straight from the ETSD file, doesn't touch PBlock or RBlock
+static int32_t regScan(int32_t to){
+    PBLOCK *blk;
+
+    if (!EtsdInfo.fdMode && etsdOpen('r'))
+        return DATA_INVALID;
+    if (NULL == (blk = (PBLOCK*)malloc(ETSD_MAX_BLOCK))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    while (RegCnt < to){
+        if ((ssize_t)ETSD_BSIZE != pread(EtsdInfo.fd, blk, ETSD_BSIZE, ETSD_OFFSET(RegCnt, 0))){
+            ErrorCode |= E_CANT_READ;
+            break;
+        }
+        regNext(blk);
+        if (regPut())
+            break;
+    }
+    free(blk);
+    return RegCnt < to ? DATA_INVALID : 0;
+}
+
+// starts the index file over, empty
+static int32_t regReset(){
+    RegCnt = RegDisk = 1;
+    if (ftruncate(RegFd, 0) || sizeof(ETSD_REGHDR) != pwrite(RegFd, &RegHdr, sizeof(ETSD_REGHDR), 0)){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    return 0;
+}
+
+// opens the index of the current ETSD file (<sectors> long), an index that is missing or doesn't match is started over if it's writable
+// returns zero (RegCnt = 0 if the file can't have an index) or -1(DATA_INVALID) and sets ErrorCode
+static int32_t regOpen(int32_t sectors){
+    ETSD_REGHDR hdr;
+    struct stat st;
+    uint32_t timeStamp;
+    int32_t cnt = 0;
+    uint16_t chan;
+    char *name;
+    PBLOCK *blk;
+
+    etsdRegFree();
+    if (!EtsdInfo.fdMode && etsdOpen('r'))
+        return DATA_INVALID;
+    RegFile = strdup(EtsdInfo.fileName);
+    memset(&RegHdr, 0, sizeof(RegHdr));
+    RegHdr.magic = REG_MAGIC;
+    RegHdr.sig = etsdLayoutSig();
+    memset(RegSlot, 0xFF, sizeof(RegSlot));
+    for (chan=0; chan<EtsdInfo.channels; chan++){
+        if (CNT_BIT(chan) && REG_BIT(chan) && EtsdChan[chan].reg){
+            RegSlot[chan] = RegHdr.counters;
+            RegChan[RegHdr.counters++] = chan;
+        }
+    }
+    if (!RegHdr.counters)
+        return 0;   // nothing to index
+    if (etsdDecodeInit(&RegDb) || NULL == (RegDb.select = (uint8_t*)calloc(EtsdInfo.channels, 1))
+            || NULL == (RegLast = (uint8_t*)calloc(1, REG_REC)) || NULL == (RegRec = (uint8_t*)calloc(1, REG_REC))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    for (chan=0; chan<RegHdr.counters; chan++)
+        RegDb.select[RegChan[chan]] = 1;
+
+    if (NULL == (name = etsdSidecarName(EtsdInfo.fileName, "c")))
+        return DATA_INVALID;
+    RegWrite = 0 <= (RegFd = open(name, O_RDWR|O_CREAT, 0644));
+    if (!RegWrite)
+        RegFd = open(name, O_RDONLY);
+    free(name);
+    if (0 > RegFd)
+        return 0;   // read only user and no index yet, queries just scan the blocks
+
+    st.st_size = 0;
+    if (!fstat(RegFd, &st) && sizeof(hdr) == pread(RegFd, &hdr, sizeof(hdr), 0) && !memcmp(&hdr, &RegHdr, sizeof(hdr))){
+        cnt = (st.st_size - sizeof(hdr)) / REG_REC + 1;
+        if (cnt > sectors)
+            cnt = sectors;  // records of blocks that are sealed but not written yet, they're written over as the file catches up
+        if (1 < cnt && ((ssize_t)REG_REC != pread(RegFd, RegLast, REG_REC, regOffset(cnt-1))
+                || sizeof(timeStamp) != pread(EtsdInfo.fd, &timeStamp, sizeof(timeStamp), ETSD_OFFSET(cnt-1, 0))
+                || timeStamp != ((ETSD_REGREC*)RegLast)->timeStamp))
+            cnt = 0;        // left over from before a rotate
+    }
+    if (!cnt){
+        if (!RegWrite){
+            close(RegFd);
+            RegFd = -1;
+            return 0;
+        }
+        if (st.st_size)
+            Log("<5> Register index of %s doesn't match the ETSD file, rebuilding it\n", EtsdInfo.fileName);
+        return regReset();
+    }
+    RegCnt = RegDisk = cnt;
+    if (1 < cnt){   // the next record needs the last block's intervals
+        if (NULL == (blk = (PBLOCK*)malloc(ETSD_MAX_BLOCK))){
+            ErrorCode |= E_MEM;
+            return DATA_INVALID;
+        }
+        if ((ssize_t)ETSD_BSIZE != pread(EtsdInfo.fd, blk, ETSD_BSIZE, ETSD_OFFSET(cnt-1, 0))){
+            ErrorCode |= E_CANT_READ;
+            free(blk);
+            return DATA_INVALID;
+        }
+        regDecode(blk);
+        regKeep();
+        free(blk);
+    }
+    return 0;
+}
+
+// the index that's open is for the current ETSD file and layout
+static uint8_t regCurrent(){
+    return RegFile && !strcmp(RegFile, EtsdInfo.fileName) && RegHdr.sig == etsdLayoutSig();
+}
+
+int32_t etsdRegLoad(){
+    int32_t sectors;
+
+    if (EtsdInfo.alignSpan)
+        return 0;
+    if (EtsdInfo.group){
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    if (0 > (sectors = etsdGroupSectors(0)))
+        return DATA_INVALID;
+    if (!regCurrent() && regOpen(sectors))
+        return DATA_INVALID;
+    if (RegCnt && RegCnt < sectors && regScan(sectors))
+        return DATA_INVALID;
+    return RegCnt;
+}
+
+int32_t etsdRegRebuild(){
+    int32_t sectors;
+
+    if (EtsdInfo.group || EtsdInfo.alignSpan){
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    if (0 > (sectors = etsdGroupSectors(0)) || regOpen(sectors))
+        return DATA_INVALID;
+    if (!RegHdr.counters)
+        return 0;
+    if (!RegWrite){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    if (regReset() || regScan(sectors))
+        return DATA_INVALID;
+    return RegCnt;
+}
+
+int32_t etsdRegAppend(PBLOCK *blk, int32_t sector){
+    int32_t sectors;
+
+    if (EtsdInfo.group || EtsdInfo.alignSpan)
+        return 0;
+    if (!sector){   // new ETSD file
+        etsdRegFree();
+        return 0;
+    }
+    if (!regCurrent() && 0 > etsdRegLoad())
+        return DATA_INVALID;
+    if (!RegCnt || sector < RegCnt)
+        return 0;   // no index, or the catch up already read this block from the file
+    if (sector > RegCnt){
+        if (0 > (sectors = etsdGroupSectors(0)))
+            return DATA_INVALID;
+        if (RegCnt < sectors && regScan(sectors < sector ? sectors : sector))
+            return DATA_INVALID;
+        if (sector != RegCnt)
+            return 0;   // the blocks between aren't in the file yet, a later append catches up
+    }
+    regNext(blk);
+    return regPut();
+}
+
+uint32_t etsdRegTotal(int32_t sector, uint8_t chan, int64_t *total, uint32_t *intervals){
+    uint8_t *rec;
+
+    if (!RegFile || sector < 1 || sector >= RegCnt || chan >= MAX_CHANNELS || 0xFF == RegSlot[chan])
+        return 0;
+    if (sector == RegCnt-1)
+        rec = RegLast;
+    else if (sector >= RegDisk)
+        rec = RegTail + (size_t)(sector - RegDisk) * REG_REC;
+    else if ((ssize_t)REG_REC == pread(RegFd, RegRec, REG_REC, regOffset(sector)))
+        rec = RegRec;
+    else {
+        ErrorCode |= E_CANT_READ;
+        return 0;
+    }
+    *total = REG_TOT(rec)[RegSlot[chan]];
+    *intervals = ((ETSD_REGREC*)rec)->intervals;
+    return ((ETSD_REGREC*)rec)->timeStamp;
+}
+
+void etsdRegRename(char *newName){
+    char *from, *to;
+    if (!RegFile)
+        return;
+    from = etsdSidecarName(RegFile, "c");
+    to = etsdSidecarName(newName, "c");
+    etsdRegFree();      // the next append opens a new index for the new file
+    if (from && to)
+        rename(from, to);
+    free(from);
+    free(to);
+}
+
+void etsdRegFree(){
+    if (0 <= RegFd)
+        close(RegFd);
+    RegFd = -1;
+    free(RegFile);
+    free(RegTail);
+    free(RegLast);
+    free(RegRec);
+    free(RegDb.select);
+    etsdDecodeFree(&RegDb);
+    RegFile = NULL;
+    RegTail = RegLast = RegRec = NULL;
+    RegDb.select = NULL;
+    RegCnt = RegDisk = RegTailAlloc = 0;
+    RegHdr.counters = 0;
+}
@@ -0,0 +1,73 @@
+/*************************************************************************
+etsdRegIndex.h counter register index (.tsdc) for an ETSD time series database
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdregindex_h__
+#define __etsdregindex_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The register index is named after the ETSD file with a 'c' added i.e. garage.tsd -> garage.tsdc
+// It covers the counter channels of group 0 that save their source register (REG_BIT), and holds each one's running total at the
+// start of every block: the block's register with every rollover counted, so the total between two blocks is one subtraction.
+// A source reset (or an invalid register) adds the previous block's own intervals instead of the register difference.
+// An ETSD_REGHDR is followed by one record per sector from sector 1 on, an ETSD_REGREC then <counters> int64_t totals and <counters>
+// uint32_t registers.  Like the .tsdx index it's only kept for files that aren't aligned, it's appended to once each block is written
+// and rebuilt by scanning the ETSD file if it's missing or out of sync.
+#define REG_MAGIC   0x43535445  // "ETSC"
+typedef struct {
+    uint32_t magic;
+    uint32_t sig;           // etsdLayoutSig() of group 0
+    uint16_t counters;      // channels indexed, in channel order
+    uint16_t spare;
+    uint32_t spare2;
+} ETSD_REGHDR;
+
+typedef struct {
+    uint32_t timeStamp;     // of the block, to check the record still matches the ETSD file
+    uint32_t intervals;     // valid intervals in all the blocks before this one
+} ETSD_REGREC;
+
+// opens the index of the current ETSD file (group 0) and indexes any sectors it doesn't have yet, the catch up is saved if the
+// index file is writable and kept in memory if it isn't.  Called by the other functions, so there's usually no need to
+// returns number of sectors indexed + 1, zero if the file has no register counters, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRegLoad();
+
+// discards the index and rebuilds it from the whole ETSD file
+// returns number of sectors indexed + 1 or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRegRebuild();
+
+// adds block <blk> to the index as sector #sector once it's written, see etsdBlockWritten()
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRegAppend(PBLOCK *blk, int32_t sector);
+
+// running total of channel <chan> at the start of sector #sector and the valid intervals before it
+// returns the timestamp of the sector, or zero if the channel or sector isn't indexed
+uint32_t etsdRegTotal(int32_t sector, uint8_t chan, int64_t *total, uint32_t *intervals);
+
+// moves the index file to match an ETSD file that has been renamed to newName (see etsdRotate), the new file starts a new index
+void etsdRegRename(char *newName);
+
+// closes the index file and frees the in-memory part
+void etsdRegFree();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,431 @@
+/*************************************************************************
+etsdRollup.c pre-aggregated rollup tiers (.tsdr<seconds>) for an ETSD time series database
+ Every tier holds each channel's count/sum/min/max per bucket (i.e. per minute, half hour or day), so a query for a long time range
+ at a coarse resolution reads a few records per step instead of decoding every interval.  See etsdRollup.h for the file layout.
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/types.h>
+
+#include "etsd.h"
+#include "etsdRead.h"
+#include "etsdRollup.h"
+#include "errorlog.h"
+
+typedef struct {
+    int fd;
+    char *name;
+    uint8_t write;          // rolled forward by this program
+    ETSD_RHDR hdr;
+    ETSD_ROLL *cur;         // record of the bucket being added to, one per channel
+    uint32_t bucket;        // bucket number in cur, zero = none
+} ROLL_TIER;
+
+static ROLL_TIER Tier[ROLL_TIERS];
+static uint8_t TierCnt = 0;
+static ETSD_DBLOCK RollDb = {0};   // every channel, for rolling blocks in
+
+#define ROLL_REC (EtsdInfo.channels * sizeof(ETSD_ROLL))    // bytes per bucket record
+
+// name of tier <tier> of the ETSD file <fName>, suffix 'r' + seconds
+static char *rollName(char *fName, uint32_t tier){
+    char suffix[12];
+    sprintf(suffix, "r%u", tier);
+    return etsdSidecarName(fName, suffix);
+}
+
+static off_t rollOffset(ROLL_TIER *t, uint32_t bucket){
+    return sizeof(ETSD_RHDR) + (off_t)(bucket - t->hdr.first) * ROLL_REC;
+}
+
+static void rollMerge(ETSD_ROLL *dst, const ETSD_ROLL *src){
+    if (!src->cnt)
+        return;
+    if (!dst->cnt || src->min < dst->min)
+        dst->min = src->min;
+    if (!dst->cnt || src->max > dst->max)
+        dst->max = src->max;
+    dst->cnt += src->cnt;
+    dst->sum += src->sum;
+}
+
+static void rollAdd(ETSD_ROLL *r, double v){
+    if (!r->cnt || v < r->min)
+        r->min = v;
+    if (!r->cnt || v > r->max)
+        r->max = v;
+    r->cnt++;
+    r->sum += v;
+}
+
+// reads <cnt> records from bucket <bucket> on into buf, buckets before the tier's first one or past the end of the file are empty
+static void rollRead(ROLL_TIER *t, uint32_t bucket, uint32_t cnt, ETSD_ROLL *buf){
+    ssize_t got = 0;
+    memset(buf, 0, cnt * ROLL_REC);
+    if (bucket < t->hdr.first){
+        if (bucket + cnt <= t->hdr.first)
+            return;
+        buf += (t->hdr.first - bucket) * EtsdInfo.channels;
+        cnt -= t->hdr.first - bucket;
+        bucket = t->hdr.first;
+    }
+    got = pread(t->fd, buf, cnt * ROLL_REC, rollOffset(t, bucket));
+    if (0 < got && (size_t)got < cnt * ROLL_REC)
+        memset((uint8_t*)buf + got, 0, cnt * ROLL_REC - got);
+}
+
+static int32_t rollWrite(ROLL_TIER *t){
+    if (t->bucket && (ssize_t)ROLL_REC != pwrite(t->fd, t->cur, ROLL_REC, rollOffset(t, t->bucket))){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    if (sizeof(ETSD_RHDR) != pwrite(t->fd, &t->hdr, sizeof(ETSD_RHDR), 0)){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    return 0;
+}
+
+// starts tier <t> over, empty
+static int32_t rollReset(ROLL_TIER *t, uint32_t tier){
+    memset(&t->hdr, 0, sizeof(ETSD_RHDR));
+    t->hdr.magic = ROLL_MAGIC;
+    t->hdr.tier = tier;
+    t->hdr.sig = etsdLayoutSig();
+    t->hdr.channels = EtsdInfo.channels;
+    t->bucket = 0;
+    if (ftruncate(t->fd, 0)){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    return rollWrite(t);
+}
+
+// adds the block decoded into RollDb to tier <t>, blocks it already has are skipped
+static int32_t rollBlock(ROLL_TIER *t){
+    uint32_t bucket, start;
+    uint16_t chan;
+    uint8_t lp;
+    double v;
+
+    if (RollDb.timeStamp <= t->hdr.last)
+        return 0;
+    for (lp=1; lp<=RollDb.intervals; lp++){
+        start = RollDb.timeStamp + (lp-1) * EtsdInfo.intervalTime;   // each interval goes in the bucket it starts in
+        bucket = start / t->hdr.tier;
+        if (bucket != t->bucket){
+            if (!t->hdr.first && !t->hdr.last)
+                t->hdr.first = bucket;              // the tier's first block
+            if (t->bucket && rollWrite(t))
+                return DATA_INVALID;
+            t->bucket = bucket;
+            rollRead(t, bucket, 1, t->cur);         // a bucket can span blocks, or the last block before a restart
+        }
+        for (chan=0; chan<EtsdInfo.channels; chan++){
+            if (!DB_VALID(&RollDb, chan, lp))
+                continue;
+            v = etsdValue(chan, DB_VALUE(&RollDb, chan, lp));
+            if (v == v)     // not NaN
+                rollAdd(&t->cur[chan], v);
+        }
+    }
+    t->hdr.last = RollDb.timeStamp;
+    t->hdr.end = RollDb.timeStamp + RollDb.intervals * EtsdInfo.intervalTime;
+    return rollWrite(t);
+}
+
+// decodes <blk> into RollDb, RBlock is left as it was
+static void rollDecode(PBLOCK *blk){
+    PBLOCK *save = RBlock;
+    RBlock = blk;
+    etsdDecodeBlock(&RollDb);
+    RBlock = save;
+}
+
+// rolls in every block of the ETSD file the writable tiers don't have yet.  Reads the file directly, doesn't touch PBlock or RBlock
+static int32_t rollCatchUp(){
+    int32_t sectors = etsdGroupSectors(0), sector;
+    uint32_t last = 0xFFFFFFFF, timeStamp;
+    PBLOCK *blk;
+    uint8_t lp;
+
+    if (0 > sectors || (!EtsdInfo.fdMode && etsdOpen('r')))
+        return DATA_INVALID;
+    for (lp=0; lp<TierCnt; lp++)
+        if (Tier[lp].write && Tier[lp].hdr.last < last)
+            last = Tier[lp].hdr.last;
+    if (0xFFFFFFFF == last)
+        return 0;
+    for (sector=sectors-1; 1 <= sector; sector--){     // usually only the last few blocks
+        if (sizeof(timeStamp) != pread(EtsdInfo.fd, &timeStamp, sizeof(timeStamp), ETSD_OFFSET(sector, 0))){
+            ErrorCode |= E_CANT_READ;
+            return DATA_INVALID;
+        }
+        if (timeStamp && timeStamp <= last)
+            break;      // holes in an aligned file read as zero
+    }
+    if (NULL == (blk = (PBLOCK*)malloc(ETSD_MAX_BLOCK))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    for (sector++; sector<sectors; sector++){
+        if ((ssize_t)ETSD_BSIZE != pread(EtsdInfo.fd, blk, ETSD_BSIZE, ETSD_OFFSET(sector, 0))){
+            ErrorCode |= E_CANT_READ;
+            break;
+        }
+        if (!blk->longD[0])
+            continue;
+        rollDecode(blk);
+        for (lp=0; lp<TierCnt; lp++)
+            if (Tier[lp].write && rollBlock(&Tier[lp]))
+                break;
+    }
+    free(blk);
+    return ErrorCode & (E_CANT_READ|E_CANT_WRITE) ? DATA_INVALID : 0;
+}
+
+// opens tier <tier> of the current ETSD file, returns the tier or NULL
+static ROLL_TIER *rollAttach(uint32_t tier, uint8_t write, uint8_t create){
+    ROLL_TIER *t;
+    uint8_t lp;
+
+    if (!tier || tier % EtsdInfo.intervalTime)
+        return NULL;
+    for (lp=0; lp<TierCnt; lp++)
+        if (Tier[lp].hdr.tier == tier)
+            return &Tier[lp];
+    if (ROLL_TIERS <= TierCnt)
+        return NULL;
+    t = &Tier[TierCnt];
+    memset(t, 0, sizeof(ROLL_TIER));
+    if (NULL == (t->name = rollName(EtsdInfo.fileName, tier)))
+        return NULL;
+    t->fd = open(t->name, write ? O_RDWR|(create ? O_CREAT : 0) : O_RDONLY, 0644);
+    if (0 > t->fd || NULL == (t->cur = (ETSD_ROLL*)calloc(EtsdInfo.channels, sizeof(ETSD_ROLL)))){
+        if (0 <= t->fd)
+            close(t->fd);
+        free(t->name);
+        return NULL;
+    }
+    t->write = write;
+    if (sizeof(ETSD_RHDR) != pread(t->fd, &t->hdr, sizeof(ETSD_RHDR), 0) || ROLL_MAGIC != t->hdr.magic || tier != t->hdr.tier
+            || etsdLayoutSig() != t->hdr.sig || EtsdInfo.channels != t->hdr.channels){
+        if (!write){    // readers just don't use it
+            close(t->fd);
+            free(t->cur);
+            free(t->name);
+            return NULL;
+        }
+        if (t->hdr.magic)
+            Log("<5> Rollup tier %s doesn't match %s, rebuilding it\n", t->name, EtsdInfo.fileName);
+        rollReset(t, tier);
+    }
+    TierCnt++;
+    return t;
+}
+
+int32_t etsdRollOpen(uint32_t *tiers, uint8_t cnt, uint8_t write){
+    glob_t found;
+    char *pattern, *end;
+    size_t lp, len;
+    uint32_t tier;
+
+    etsdRollClose();
+    if (!EtsdInfo.channels || EtsdInfo.group){
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    if (etsdDecodeInit(&RollDb))
+        return DATA_INVALID;
+    len = strlen(EtsdInfo.fileName) + 1;
+    pattern = (char*)malloc(len+2);
+    sprintf(pattern, "%sr*", EtsdInfo.fileName);
+    if (!glob(pattern, 0, NULL, &found)){
+        for (lp=0; lp<found.gl_pathc; lp++){    // every tier that already exists
+            tier = strtoul(found.gl_pathv[lp] + len, &end, 10);
+            if (!*end && !rollAttach(tier, write, 0) && write)
+                Log("<5> Can't use rollup tier %s\n", found.gl_pathv[lp]);
+        }
+        globfree(&found);
+    }
+    free(pattern);
+    for (lp=0; lp<cnt; lp++){
+        if (!rollAttach(tiers[lp], write, 1)){
+            ErrorCode |= E_ARG;
+            Log("<4> Can't create a %u second rollup tier for %s, tiers must be a multiple of the %u second interval\n",
+                    tiers[lp], EtsdInfo.fileName, EtsdInfo.intervalTime);
+        }
+    }
+    if (write && rollCatchUp())
+        return DATA_INVALID;
+    return TierCnt;
+}
+
+int32_t etsdRollBlock(PBLOCK *blk){
+    uint8_t lp;
+    int32_t rval = 0;
+
+    if (!TierCnt || EtsdInfo.group)
+        return 0;
+    rollDecode(blk);
+    for (lp=0; lp<TierCnt; lp++)
+        if (Tier[lp].write && rollBlock(&Tier[lp]))
+            rval = DATA_INVALID;
+    return rval;
+}
+
+int32_t etsdRollBuild(uint32_t tier){
+    ROLL_TIER *t;
+    uint8_t lp;
+
+    if (!RollDb.data && etsdDecodeInit(&RollDb))
+        return DATA_INVALID;
+    if (NULL == (t = rollAttach(tier, 1, 1))){
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    for (lp=0; lp<TierCnt; lp++)
+        Tier[lp].write = &Tier[lp] == t;    // only this tier is behind
+    if (rollReset(t, tier) || rollCatchUp())
+        return DATA_INVALID;
+    return t->hdr.end ? (t->hdr.end - 1) / tier - t->hdr.first + 1 : 0;
+}
+
+// decodes steps <step> to <n>-1 of etsdRollSeries() from the blocks
+static int32_t rollRaw(uint8_t *chans, uint8_t nChan, uint32_t start, uint32_t res, uint32_t step, uint32_t n, ETSD_ROLL *out){
+    uint32_t from = start + step * res, end = start + n * res, sector, timeStamp, begin;
+    uint8_t lp, c;
+    double v;
+    ETSD_DBLOCK db;
+
+    if (etsdDecodeInit(&db) || NULL == (db.select = (uint8_t*)calloc(EtsdInfo.channels, 1)))
+        return DATA_INVALID;
+    for (c=0; c<nChan; c++)
+        db.select[chans[c]] = 1;
+    if (!(sector = etsdFindBlock(from)) && !(ErrorCode & E_AFTER))
+        sector = 1;
+    ErrorCode = 0;
+    timeStamp = sector ? etsdTimeS(sector) : 0;
+    while (timeStamp && timeStamp < end){
+        etsdDecodeBlock(&db);
+        for (lp=1; lp<=db.intervals; lp++){
+            begin = timeStamp + (lp-1) * EtsdInfo.intervalTime;
+            if (begin < from)
+                continue;
+            if (begin >= end)
+                break;
+            for (c=0; c<nChan; c++){
+                if (!DB_VALID(&db, chans[c], lp))
+                    continue;
+                v = etsdValue(chans[c], DB_VALUE(&db, chans[c], lp));
+                if (v == v)
+                    rollAdd(&out[(begin - start) / res * nChan + c], v);
+            }
+        }
+        if (!(timeStamp = etsdTimeS(++sector)) && (ErrorCode & E_EOF))
+            ErrorCode = 0;
+    }
+    free(db.select);
+    etsdDecodeFree(&db);
+    return 0;
+}
+
+int32_t etsdRollSeries(uint8_t *chans, uint8_t nChan, uint32_t start, uint32_t res, uint32_t n, ETSD_ROLL *out){
+    ROLL_TIER *t = NULL;
+    ETSD_ROLL *buf;
+    uint32_t step = 0, per, lp;
+    uint8_t c;
+
+    if (!EtsdInfo.channels || EtsdInfo.group || !nChan || !res){
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    for (c=0; c<nChan; c++){
+        if (chans[c] >= EtsdInfo.channels){
+            ErrorCode |= E_ARG;
+            return DATA_INVALID;
+        }
+    }
+    memset(out, 0, (size_t)n * nChan * sizeof(ETSD_ROLL));
+    for (c=0; c<TierCnt; c++)       // coarsest tier that fits
+        if (!(res % Tier[c].hdr.tier) && !(start % Tier[c].hdr.tier) && (!t || Tier[c].hdr.tier > t->hdr.tier))
+            t = &Tier[c];
+    if (t){
+        per = res / t->hdr.tier;
+        if (NULL == (buf = (ETSD_ROLL*)malloc(per * ROLL_REC))){
+            ErrorCode |= E_MEM;
+            return DATA_INVALID;
+        }
+        for ( ; step<n && start + (step+1) * res <= t->hdr.end; step++){
+            rollRead(t, (start + step * res) / t->hdr.tier, per, buf);
+            for (lp=0; lp<per; lp++)
+                for (c=0; c<nChan; c++)
+                    rollMerge(&out[step * nChan + c], &buf[lp * EtsdInfo.channels + chans[c]]);
+        }
+        free(buf);
+    }
+    if (step < n && rollRaw(chans, nChan, start, res, step, n, out))
+        return DATA_INVALID;
+    return step ? t->hdr.tier : EtsdInfo.intervalTime;
+}
+
+uint8_t etsdRollTiers(uint32_t *tiers){
+    uint8_t lp;
+    for (lp=0; lp<TierCnt; lp++)
+        tiers[lp] = Tier[lp].hdr.tier;
+    return TierCnt;
+}
+
+void etsdRollRename(char *newName){
+    char *name;
+    uint8_t lp;
+    for (lp=0; lp<TierCnt; lp++){
+        if (NULL == (name = rollName(newName, Tier[lp].hdr.tier))){
+            Tier[lp].write = 0;     // stays with the old file
+            continue;
+        }
+        close(Tier[lp].fd);
+        rename(Tier[lp].name, name);
+        free(name);
+        Tier[lp].fd = open(Tier[lp].name, O_RDWR|O_CREAT, 0644);    // the new ETSD file gets new tiers
+        if (0 > Tier[lp].fd){
+            ErrorCode |= E_CANT_WRITE;
+            Tier[lp].write = 0;
+            continue;
+        }
+        rollReset(&Tier[lp], Tier[lp].hdr.tier);
+    }
+}
+
+void etsdRollClose(){
+    uint8_t lp;
+    for (lp=0; lp<TierCnt; lp++){
+        if (0 <= Tier[lp].fd)
+            close(Tier[lp].fd);
+        free(Tier[lp].cur);
+        free(Tier[lp].name);
+    }
+    TierCnt = 0;
+    etsdDecodeFree(&RollDb);
+}
@@ -0,0 +1,87 @@
+/*************************************************************************
+etsdRollup.h pre-aggregated rollup tiers (.tsdr<seconds>) for an ETSD time series database
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdrollup_h__
+#define __etsdrollup_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Each tier is a file named after the ETSD file with 'r' and the tier's bucket length in seconds added i.e. garage.tsd -> garage.tsdr1800
+// A tier is an ETSD_RHDR followed by one record per bucket, each record is an ETSD_ROLL per channel.  Bucket n covers the
+// intervals that start from n x tier to (n+1) x tier seconds (ETSD time, so day buckets start at midnight UTC), record #0 is bucket
+// ETSD_RHDR.first and a bucket is found by arithmetic.  Buckets with no blocks are holes in the file and read back as empty.
+// Tiers are only kept for channel group 0 (like the index), they are rolled forward as each block is written and can be rebuilt
+// from the ETSD file at any time, see etsdRollBuild()
+#define ROLL_MAGIC  0x52535445  // "ETSR"
+#define ROLL_TIERS  8           // most tiers one ETSD file can have
+typedef struct {
+    uint32_t magic;
+    uint32_t tier;          // seconds per bucket, a multiple of the interval time
+    uint32_t sig;           // etsdLayoutSig() of group 0, a tier left by another layout is rebuilt (or ignored by readers)
+    uint16_t channels;
+    uint16_t spare;
+    uint32_t first;         // bucket number of record #0
+    uint32_t end;           // every interval before this time has been rolled in
+    uint32_t last;          // timestamp of the last block rolled in
+    uint32_t spare2;
+} ETSD_RHDR;
+
+// one channel over one bucket (or one query resolution step, see etsdRollSeries()).  Values are as the intervals are saved,
+// i.e. counters are per interval, see etsdValue()
+typedef struct {
+    uint32_t cnt;           // valid intervals
+    uint32_t spare;
+    double sum;
+    double min;             // only meaningful if cnt isn't zero
+    double max;
+} ETSD_ROLL;
+
+// opens every tier file of the current ETSD file, and creates the <cnt> tiers in tiers[] (seconds) if they don't exist yet.
+// write != 0 also rolls in any blocks the tiers are behind on (a writer), otherwise tiers are only read.  Call with group 0 selected
+// returns number of tiers open or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRollOpen(uint32_t *tiers, uint8_t cnt, uint8_t write);
+
+// rolls block <blk> into every open tier once it's written, see etsdBlockWritten().  Group 0 only
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRollBlock(PBLOCK *blk);
+
+// discards tier <tier> (seconds) and rebuilds it from the whole ETSD file, the tier doesn't have to exist yet
+// returns the number of buckets or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRollBuild(uint32_t tier);
+
+// fills out[] with the <n> steps of <res> seconds from <start> for the <nChan> channels in chans[] (group 0).  out[step * nChan + c]
+// covers chans[c] from start + step x res to start + (step+1) x res.  Steps are taken from the coarsest tier whose bucket length
+// divides both res and start, steps the tiers don't cover yet (or all of them if no tier fits) are decoded from the blocks in one pass
+// returns the bucket length used (the interval time if only blocks were used) or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdRollSeries(uint8_t *chans, uint8_t nChan, uint32_t start, uint32_t res, uint32_t n, ETSD_ROLL *out);
+
+// copies the bucket lengths of the open tiers to tiers[] (ROLL_TIERS entries), returns how many there are
+uint8_t etsdRollTiers(uint32_t *tiers);
+
+// moves the tier files to match an ETSD file that has been renamed to newName (see etsdRotate), new empty tiers are started
+void etsdRollRename(char *newName);
+
+// closes every tier
+void etsdRollClose();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,15 +14,25 @@ Copyright 2018 Peter VanDerWal
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 *********************************************************************************/
-    
+
+#define _FILE_OFFSET_BITS 64
+
 // #include <time.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "etsd.h"
 #include "etsdSave.h"
+#include "etsdIndex.h"
+#include "etsdRegIndex.h"
+#include "etsdZone.h"
+#include "etsdRollup.h"
+#include "etsdJournal.h"
+#include "etsdCodec.h"
 #include "errorlog.h"
 
 //PBLOCK PBlock;
@@ -30,10 +40,31 @@ Copyright 2018 Peter VanDerWal
 //uint32_t *LastReading;  // already defined in etsd.c
 //uint8_t *MissedUpdate;
 
+// Columnar staging, saveChan() keeps each interval's value here and etsdCommit() packs the whole block into PBlock.  [chan][interV]
+// Values are what the stream's save function would be passed, already range checked.  Auto-scaled channels are kept at full resolution.
+// Unsaved intervals are all ones, which packs as invalid.  32 bit and half float streams are saved straight to PBlock.
+static uint32_t (*Stage)[128] = NULL;
+static uint8_t StageCnt = 0;
+static void etsdPack();
+
+static int32_t stageAlloc(){
+    if (Stage && StageCnt >= EtsdInfo.channels)
+        return 0;
+    free(Stage);
+    Stage = (uint32_t (*)[128])malloc(EtsdInfo.channels * sizeof(*Stage));
+    StageCnt = Stage ? EtsdInfo.channels : 0;
+    if (!Stage){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    memset(Stage, 0xFF, StageCnt * sizeof(*Stage));
+    return 0;
+}
+
 
 void etsdBlockClear(uint16_t val){
-	uint_fast8_t lp, cnt=0;
-    for (lp=4; lp>0; lp++){
+	uint16_t lp, cnt=0;
+    for (lp=4; lp<ETSD_BSIZE/2; lp++){
 	    PBlock.data[lp] = val;
 	}
     PBlock.data[3] = 0;  // clear autoscalling to zero
@@ -49,21 +80,59 @@ void etsdBlockClear(uint16_t val){
 }
 
 void etsdBlockStart(){
-    PBlock.longD[0] = ETSD_NOW();  
+    uint32_t t = ETSD_NOW(), base;
+    int32_t next;
+    if (EtsdInfo.alignSpan){    // start of the current slot, or the first slot that hasn't been written if the clock is behind
+        t -= t % EtsdInfo.alignSpan;
+        if ((base = etsdAlignBase()) && 0 < (next = etsdSectors()) && t < base + (next-1) * EtsdInfo.alignSpan)
+            t = base + (next-1) * EtsdInfo.alignSpan;
+    }
+    PBlock.longD[0] = t;  
 	PBlock.data[2] = EtsdInfo.header;
+    if (1 < EtsdInfo.groups)
+        PBlock.byteD[EtsdInfo.groupPos] = EtsdInfo.group;
+}
+
+uint8_t etsdAlignInterval(){
+    uint32_t now = ETSD_NOW(), cnt;
+    if (!EtsdInfo.alignSpan || now <= PBlock.longD[0])
+        return 0;
+    cnt = (now - PBlock.longD[0]) / EtsdInfo.intervalTime;
+    return cnt < EtsdInfo.blockIntervals ? cnt : EtsdInfo.blockIntervals - 1;
+}
+
+// finishes the block in PBlock, see etsdCommit() and etsdSeal()
+static void commitPack(uint8_t interV){
+    uint8_t lp;
+    PBlock.data[2] |= interV; // pete
+    etsdPack();
+    for (lp=0; lp<EtsdInfo.channels; lp++)
+        if (EtsdChan[lp].codec)
+            etsdZFlush(lp);
+    EtsdBlockFull = 0;
 }
 
 // write etsd block to disk
 // returns zero on success, -1(DATA_INVALID) if can't rotate files, exits if can't save to current file
 int32_t etsdCommit(uint8_t interV){  // write etsd block to disk
-    PBlock.data[2] |= interV; // pete
+    uint32_t base;
+    int32_t sector = 0;
+    commitPack(interV);
     if (EtsdInfo.fileName != NULL){
-        if(etsdRW("a", 0)){   // if we can't write to etsd File, error and exit
+        if (EtsdInfo.alignSpan && (base = etsdAlignBase()) && PBlock.longD[0] >= base)
+            sector = (PBlock.longD[0] - base) / EtsdInfo.alignSpan + 1;     // the block's own slot, skipped slots are left as holes
+        if(etsdRW("a", sector)){   // if we can't write to etsd File, error and exit
             ELog(__func__, 1);
-            LogBlock(&PBlock.byteD, "ETSD", BLOCKSIZE); // try to save current ETSD block to the error log
+            LogBlock(&PBlock.byteD, "ETSD", ETSD_BSIZE); // try to save current ETSD block to the error log
             exit(1);
         }
-        if(RotateEtsd){
+        etsdJnlSeal(ETSD_OFFSET(EtsdInfo.sector, EtsdInfo.group), EtsdInfo.sector);    // replayed if it isn't synced before a power cut
+        etsdBlockWritten(&PBlock, EtsdInfo.sector);
+        if (EtsdInfo.group+1 == EtsdInfo.groups && etsdSync(EtsdInfo.fd, RotateEtsd || JNL_SYNC <= EtsdWrite.pending+1)){ // see EtsdWrite
+            ErrorCode |= E_CANT_WRITE;
+            ELog("etsdCommit sync", 1);
+        }
+        if(RotateEtsd && EtsdInfo.group+1 == EtsdInfo.groups){  // every group has to have committed this block first
             if (etsdRotate()){
                 ELog(__func__, 1);
                 return DATA_INVALID;
@@ -74,30 +143,135 @@ int32_t etsdCommit(uint8_t interV){  // write etsd block to disk
     return 0;   
 }
 
+int32_t etsdSeal(uint8_t interV, int64_t *offset){
+    static int32_t next = 0;    // first sector that isn't taken, counting blocks that were sealed but may not be written yet
+    static uint64_t ino = 0;    // file <next> belongs to, a rotated or reloaded file starts over
+    struct stat st;
+    int32_t sector;
+    uint32_t base;
+
+    commitPack(interV);
+    if ((!EtsdInfo.fdMode && etsdOpen('r')) || fstat(EtsdInfo.fd, &st) || 0 > (sector = etsdSectors())){
+        ErrorCode |= E_CANT_READ;
+        return DATA_INVALID;
+    }
+    if ((uint64_t)st.st_ino != ino){
+        ino = st.st_ino;
+        next = 0;
+    }
+    if (sector < next)
+        sector = next;
+    if (EtsdInfo.alignSpan){
+        if (1 == sector && !etsdAlignBase())
+            EtsdInfo.alignBase = PBlock.longD[0];   // block 1 isn't in the file yet, but every later block counts from it
+        if ((base = etsdAlignBase()) && PBlock.longD[0] >= base && sector < (PBlock.longD[0] - base) / EtsdInfo.alignSpan + 1)
+            sector = (PBlock.longD[0] - base) / EtsdInfo.alignSpan + 1;
+    }
+    if (EtsdInfo.group+1 == EtsdInfo.groups)    // every group of a block gets the same sector
+        next = sector + 1;
+    EtsdInfo.sector = sector;
+    *offset = ETSD_OFFSET(sector, EtsdInfo.group);
+    etsdJnlSeal(*offset, sector);
+    return 0;
+}
+
+void etsdBlockWritten(PBLOCK *blk, int32_t sector){
+    if (EtsdInfo.group)
+        return;     // grouped files use group 0's blocks
+    if (!EtsdInfo.alignSpan && etsdIdxAppend(blk, sector))  // index can be rebuilt, so just log it
+        ELog("etsdBlockWritten index", 1);
+    if (etsdRegAppend(blk, sector))     // so can the register index
+        ELog("etsdBlockWritten register index", 1);
+    if (etsdRollBlock(blk))     // and the rollup tiers
+        ELog("etsdBlockWritten rollup", 1);
+    if (etsdZoneBlock(blk, sector))     // and the zone map
+        ELog("etsdBlockWritten zone map", 1);
+}
+
 // backs up current etsd file and opens a new one with the current name.  Copies the first sector (db info) to new file
 // to avoid losing data, execute etsdCommit() before etsdRotate()
 // returns zero on success or error code
 int32_t etsdRotate() {
     char *backup;
+    uint8_t *hdrs = NULL;
+    ssize_t size = EtsdInfo.groups * ETSD_BSIZE;
     ELog(__func__, 1); // print out any existing errors before proceeding
     
     if (etsdRW("r", 0)){   // load pBlock with first sector (Header) of etsd file.
         return DATA_INVALID;      // if we can't read current header, then we can't create new file properly
     }
+    if (1 < EtsdInfo.groups){   // the other groups' header sectors go to the new file too
+        if (NULL == (hdrs = (uint8_t*)malloc(size)) || size != pread(EtsdInfo.fd, hdrs, size, 0)){
+            ErrorCode |= E_CANT_READ;
+            free(hdrs);
+            return DATA_INVALID;
+        }
+    }
     backup = (char*)malloc(strlen(EtsdInfo.fileName)+13);
     sprintf(backup,"%s.%d", EtsdInfo.fileName, ETSD_NOW() );
     rename(EtsdInfo.fileName, backup);
+    etsdIdxRename(backup);
+    etsdRegRename(backup);
+    etsdRollRename(backup);
+    etsdZoneRename(backup);
 
-    if(etsdRW("w", 0)){ // open new etsd file and write header 
+    if(etsdRW("w", 0) || (hdrs && size != pwrite(EtsdInfo.fd, hdrs, size, 0))){ // open new etsd file and write header 
+        ErrorCode |= E_CANT_WRITE;
         ELog(__func__, 1); // log error and exit if we can't open new file
         exit(1);
     }        
+    free(hdrs);
+    EtsdInfo.alignBase = 0;     // aligned files count from the new file's first block
+    if (!EtsdInfo.alignSpan)
+        etsdIdxAppend(&PBlock, 0);   // start a new index
     etsdBlockClear(0xffff);
     etsdBlockStart();
     free(backup);
     return 0;       
 }
 
+// the block each channel group is building, see etsdSaveGroup().  PBlock, Stage and EtsdBlockFull belong to the current group
+typedef struct {
+    PBLOCK blk;
+    uint32_t (*stage)[128];
+    uint8_t stageCnt;
+    uint8_t full;
+} SAVE_GRP;
+static SAVE_GRP *SaveGrp = NULL;
+static uint8_t SaveGrpCnt = 0;
+
+int32_t etsdSaveGroup(uint8_t group){
+    uint8_t cur = EtsdInfo.group, lp;
+
+    if (group == cur)
+        return 0;
+    if (SaveGrp && SaveGrpCnt != EtsdInfo.groups){   // a different ETSD was loaded
+        for (lp=0; lp<SaveGrpCnt; lp++)
+            if (SaveGrp[lp].stage != Stage)
+                free(SaveGrp[lp].stage);
+        free(SaveGrp);
+        SaveGrp = NULL;
+    }
+    if (!SaveGrp && !(SaveGrp = (SAVE_GRP*)calloc(EtsdInfo.groups, sizeof(SAVE_GRP)))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    SaveGrpCnt = EtsdInfo.groups;
+    memcpy(&SaveGrp[cur].blk, &PBlock, ETSD_BSIZE);
+    SaveGrp[cur].stage = Stage;
+    SaveGrp[cur].stageCnt = StageCnt;
+    SaveGrp[cur].full = EtsdBlockFull;
+    if (etsdGroup(group)){
+        memcpy(&PBlock, &SaveGrp[cur].blk, ETSD_BSIZE);    // loading the header may have used PBlock
+        return DATA_INVALID;
+    }
+    memcpy(&PBlock, &SaveGrp[group].blk, ETSD_BSIZE);
+    Stage = SaveGrp[group].stage;
+    StageCnt = SaveGrp[group].stageCnt;
+    EtsdBlockFull = SaveGrp[group].full;
+    return 0;
+}
+
 // src= ETSD source type that was Reset, interv is last good interval before source was reset
 // returns zero.  On return, calling program should reset interval to zero.  i.e. Interval = etsdSrcReset( type, Interval);
 uint8_t etsdSrcReset(uint8_t src, uint8_t interV){
@@ -123,7 +297,7 @@ uint32_t etsdFromSigned(uint8_t bits, int32_t data) {
             ErrorCode |= E_DATA;
             data = DATA_INVALID;
         } else {
-            data = negative & (1-data); 
+            data = negative | (-1-data);   // inverse of etsdToSigned()
         }
     } else {
         if (maxV < data){
@@ -147,60 +321,40 @@ uint8_t etsdReadByte(uint16_t addr) {
 
 //reg = 1-??,  registers (32bit values) are saved starting at end of Block, working back towards front.
 void saveReg(uint8_t reg, uint32_t data){
-	PBlock.longD[BLOCKSIZE/4-reg] = data;
+	PBlock.longD[ETSD_BSIZE/4-reg] = data;
 }
 
-// Auto-Scaling works on full streams only. Can handle any value up to 524,287, larger values save as all '1's (65535)
+// Auto-Scaling works on 8, 12, 16 and 20 bit streams.  Can handle any value up to ((2^bits - 2) << 3) + 7 (524,279 on full streams),
+// larger values are saved as invalid (all 1's).  Readings are only staged here, etsdCommit() picks the scale factor and saves them.
 // do NOT call when interV = 0
-// ASC = Auto-Scaling channel 0-7, QS = quarter stream ID.   
+// ASC = Auto-Scaling slot, QS is unused (kept so saveAutoS fits the save function table)
 void saveAutoS(uint8_t interV, uint8_t ASC, QS_SIZE, uint32_t data){
-    uint8_t currentScaling = (SCALING >> (2*ASC)) & 3;  // SCALING = PBlock.data[3]
-    uint8_t excess = data >> (16+currentScaling) ;  
-    uint8_t streamStart = 3 + QS/4 * EtsdInfo.blockIntervals;  // points to PBlock.data so 8 bits is enough
-    uint8_t lp;
-    uint16_t preVal;
-    if( 524287 > data ){    // check if data will fit
-        if (excess) {   // if excess then new scaling factor is larger than currentScaling and we need to rescale any previously stored data
-            excess >>=1;    //convert excess bits to scaling factor 
-            if(excess<3){    //second step
-                excess++;
-            }
-            for (lp=1; lp<interV; lp++) {  
-                preVal = PBlock.data[streamStart+lp];
-                if (preVal < 65535){    //only rescale valid data
-                    PBlock.data[streamStart+lp] = (preVal>>excess);
-                }
-            }
-            currentScaling += excess;   // update currentScaling
-            SCALING += excess<<(ASC*2); // update stored scaling factor
-            
-        } 
-        data >>= currentScaling;
-        if ( 65535 == data){
-            data--;                         // avoid saving valid data as all ones (invalid)
+    uint8_t chan;
+    if (stageAlloc())
+        return;
+    for (chan=0; chan<EtsdInfo.channels && interV && 127 >= interV; chan++){
+        if (EtsdChan[chan].scaled && ASC == EtsdChan[chan].AS){
+            Stage[chan][interV] = data;
+            return;
         }
-        PBlock.data[streamStart + interV ] = data;
-    } else {
-        ErrorCode |= E_DATA;
-Log("saveAutoS data = %u \n", data);  // Pete
     }
+    ErrorCode |= E_ARG;
 }
 
+
 // normally used to extended (add 2 bits to) a data stream, but can be used to store 2 bit data streams.  Only LSbx2 of data is stored
 // extS values 0 to (number of extended channels)  
 // 'dummy' variable to make function parameters the same as the other stream functions
 // pete test this
-void saveExtS(uint8_t interV, uint8_t extS, uint8_t dummy, uint32_t data){
-    uint16_t startP = EtsdInfo.extStart + (extS*EtsdInfo.blockIntervals/4);
-//    float fAddr =  (EtsdInfo.blockIntervals * (extS-1) + interV-1)/ 4.0;
-    float fAddr =  (EtsdInfo.blockIntervals * (extS) + interV-1)/ 4.0;
-    uint8_t bPos = (fAddr - (uint8_t)fAddr) * 8;
-    uint16_t bAddr = fAddr;   // pete check rules on converting floats to uints
+void saveExtS(uint8_t interV, uint8_t extS, uint16_t dummy, uint32_t data){
+    uint16_t pos = EtsdInfo.blockIntervals * extS + interV-1;   // 2 bit field, counted from extStart, see readExtS()
+    uint16_t bAddr = EtsdInfo.extStart + pos/4;
+    uint8_t bPos = (pos&3)*2;
     if (data > 3){
         ErrorCode |= E_DATA;
         data = 3;
     }
-    PBlock.byteD[bAddr+startP] = ( PBlock.byteD[bAddr+startP] & (uint8_t)(~(3<<bPos)) ) | ( (data&3) <<bPos );  // can't depend on current bits being zero
+    PBlock.byteD[bAddr] = ( PBlock.byteD[bAddr] & (uint8_t)(~(3<<bPos)) ) | ( (data&3) <<bPos );  // can't depend on current bits being zero
 }
 
 void save16(uint8_t interV, QS_SIZE, uint16_t data){
@@ -221,6 +375,30 @@ void save32(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
     save16(interV, QS+4, data>>16);
 }
 
+// data = single precision float bit pattern, DATA_INVALID (all ones) is saved as invalid
+// do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
+void saveHalf(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
+    save16(interV, QS, DATA_INVALID == data ? HALF_INVALID : etsdFloatToHalf(data));
+}
+
+// data = float bit pattern, DATA_INVALID (all ones) is saved as invalid
+// do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
+void saveFloat(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
+    if (DATA_INVALID != data && 0x7F800000 == (data & 0x7F800000) && (data & 0x007FFFFF))
+        data = FLOAT_NAN;
+    save32(interV, extS, QS, data);
+}
+
+// data = int32 (not converted by etsdFromSigned()), INT32_INVALID is reserved so -2147483648 is saved as -2147483647
+// do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
+void saveInt32(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
+    if (INT32_INVALID == data){
+        ErrorCode |= E_DATA;
+        data++;
+    }
+    save32(interV, extS, QS, data);
+}
+
 // QS = 0 - ??.  Valid Data = 0-16,777,214
 // do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
 void save24(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
@@ -239,7 +417,7 @@ void save20(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
             ErrorCode |= E_DATA;
             data = 4194303; 
         } 
-        saveExtS(interV, extS, 0, data>>16);    
+        saveExtS(interV, extS, 0, data>>20);    
     } else {
         if (1048574<data){
             ErrorCode |= E_DATA;
@@ -247,7 +425,7 @@ void save20(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
         }
     }
     
-    if(1&QS){
+    if(!(1&QS)){    // even QS: half streams first, the quarter stream goes last
         save8(interV, QS, data);
         save8(interV, QS+2, data>>8);
         save4(interV, QS+4, data>>16);
@@ -266,14 +444,14 @@ void save12(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data){
             ErrorCode |= E_DATA;
             data = 16383; 
         } 
-        saveExtS(interV, extS, 0, (data>>16));    
+        saveExtS(interV, extS, 0, (data>>12));    
     } else {
         if (4094<data){
             ErrorCode |= E_DATA;
             data=4095;
         }
     }
-    if(1&QS){
+    if(!(1&QS)){    // even QS: half streams first, the quarter stream goes last
         save8(interV, QS, data);
         save4(interV, QS+2, data>>8);
     } else {
@@ -329,6 +507,210 @@ void saveQS(uint8_t  interV, uint8_t extS, QS_SIZE, uint32_t data){
     save4(interV, QS, data);
 }
 
+// stream save functions by ETSD stream type, see saveChan()
+static void (*const saveFunct[16])(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data) = {
+    NULL,       //  0 = don't save to ETSD
+    saveExtS,   //  1 = Two bit Stream
+    saveQS,     //  2 = Quarter Stream
+    saveQS,     //  3 = Extended Quarter Stream
+    saveHS,     //  4 = Half Stream
+    saveHS,     //  5 = Extended Half Stream
+    save12,     //  6 = Short Stream
+    save12,     //  7 = Extended Short Stream
+    saveFS,     //  8 = Full Stream
+    saveFS,     //  9 = Extended Full Stream
+    save20,     // 10 = 20bit Stream
+    save20,     // 11 = Extended 20bit Stream
+    save24,     // 12 = Large Stream
+    save32,     // 13 = Double Stream
+    saveHalf,   // 14 = Half Precision Float, user passes the float's bit pattern
+    saveAutoS   // 15 = AutoScaling
+};
+
+// range checks <data> the same way the stream's save function does, returns the value that will be packed
+static uint32_t stageClamp(uint8_t chan, uint32_t data){
+    uint32_t allOnes = (1u << EtsdChan[chan].bits) - 1;
+    switch(ETSD_TYPE(chan)){
+        case 4:     // Half Streams, only the ext bits are limited
+        case 5:
+            if (EtsdChan[chan].extS && 3 < data>>8){
+                ErrorCode |= E_DATA;
+                data = 0x300 | (data & 255);
+            }
+            return data;
+        case 1:     // 2 bit and Quarter Streams, all ones is a valid value
+        case 2:
+        case 3:
+            if (allOnes < data){
+                ErrorCode |= E_DATA;
+                data = allOnes;
+            }
+            return data;
+        case 12:
+            return allOnes < data ? allOnes : data;
+        default:    // 12 bits and up, all ones = invalid
+            if (allOnes-1 < data){
+                ErrorCode |= E_DATA;
+                data = allOnes;
+            }
+            return data;
+    }
+}
+
+// Column packing, src[0 - n-1] = intervals 1 - n.  (value >> shift) is packed, same layouts as save4(), save8(), save16() and saveExtS()
+static void pack4(uint8_t *dst, const uint32_t *src, uint8_t n, uint8_t shift){
+    uint8_t lp;
+    for (lp=0; lp+1<n; lp+=2)
+        dst[lp/2] = ((src[lp] >> shift) & 15) << 4 | ((src[lp+1] >> shift) & 15);
+    if (1&n)    // odd number of intervals, last byte is shared with the next stream
+        dst[n/2] = (dst[n/2] & 15) | ((src[n-1] >> shift) & 15) << 4;
+}
+static void pack8(uint8_t *dst, const uint32_t *src, uint8_t n, uint8_t shift){
+    uint8_t lp;
+    for (lp=0; lp<n; lp++)
+        dst[lp] = src[lp] >> shift;
+}
+static void pack16(uint16_t *dst, const uint32_t *src, uint8_t n, uint8_t shift){
+    uint8_t lp;
+    for (lp=0; lp<n; lp++)
+        dst[lp] = src[lp] >> shift;
+}
+static void pack2(uint8_t *dst, uint16_t lane, const uint32_t *src, uint8_t n, uint8_t shift){
+    uint8_t lp;
+    uint16_t pos;
+    for (lp=0; lp<n; lp++){
+        pos = lane + lp;
+        dst[pos/4] = (dst[pos/4] & ~(3 << 2*(pos&3))) | ((src[lp] >> shift) & 3) << 2*(pos&3);
+    }
+}
+
+// packs a column of stream values (all pieces plus the extended stream bits) into PBlock, the inverse of etsdDecodeBlock()
+static void packChan(uint8_t chan, uint8_t type, const uint32_t *src){
+    uint8_t *b = PBlock.byteD + 8, bi = EtsdInfo.blockIntervals;   // first interval of stream 0, see save8()
+    uint16_t *w = PBlock.data + 4, q = EtsdChan[chan].QS, hs = q/2 * bi, e = EtsdChan[chan].extS;
+
+    switch(type){
+        case 2:     // Quarter Streams
+        case 3:
+            pack4(b + q*(bi/2), src, bi, 0);
+            break;
+        case 4:     // Half Streams
+        case 5:
+            pack8(b + hs, src, bi, 0);
+            break;
+        case 6:     // Short Streams
+        case 7:
+            if (!(1&q)){
+                pack8(b + hs, src, bi, 0);
+                pack4(b + (q+2)*(bi/2), src, bi, 8);
+            } else {
+                pack4(b + q*(bi/2), src, bi, 8);
+                pack8(b + (q+1)/2*bi, src, bi, 0);
+            }
+            break;
+        case 8:     // Full Streams
+        case 9:
+        case 15:
+            pack16(w + q/4*bi, src, bi, 0);
+            break;
+        case 10:    // 20bit Streams
+        case 11:
+            if (!(1&q)){
+                pack8(b + hs, src, bi, 0);
+                pack8(b + (q+2)/2*bi, src, bi, 8);
+                pack4(b + (q+4)*(bi/2), src, bi, 16);
+            } else {
+                pack4(b + q*(bi/2), src, bi, 16);
+                pack8(b + (q+1)/2*bi, src, bi, 0);
+                pack8(b + (q+3)/2*bi, src, bi, 8);
+            }
+            break;
+        case 12:    // Large Stream
+            pack8(b + hs, src, bi, 0);
+            pack8(b + (q+2)/2*bi, src, bi, 8);
+            pack8(b + (q+4)/2*bi, src, bi, 16);
+            break;
+    }
+    // ext bits are the top 2 bits of the value, type 1 is the ext stream alone
+    if (e--)
+        pack2(PBlock.byteD + EtsdInfo.extStart, e*bi, src, bi, 2*(type-1));
+}
+
+// packs the staged block into PBlock, called by etsdCommit().  Auto-scaled channels get the smallest scale factor
+// that fits the block's largest reading
+static void etsdPack(){
+    uint8_t chan, lp, scale, slot, intervals = EtsdInfo.blockIntervals;
+    uint32_t maxV, allOnes, data, *row, col[128];
+
+    if (!Stage)
+        return;
+    for (chan=0; chan<EtsdInfo.channels && chan<StageCnt; chan++){
+        if (!ETSD_TYPE(chan) || EtsdChan[chan].codec || (!EtsdChan[chan].scaled && 13 <= ETSD_TYPE(chan)))
+            continue;
+        row = Stage[chan] + 1;
+        if (EtsdChan[chan].scaled){
+            slot = EtsdChan[chan].AS;
+            allOnes = (1u << EtsdChan[chan].bits) - 1;
+            maxV = 0;
+            for (lp=0; lp<intervals; lp++){
+                data = row[lp];
+                if (DATA_INVALID == data)
+                    continue;
+                if (((allOnes-1) << 3) + 7 < data){    // too large for any scale factor
+                    ErrorCode |= E_DATA;
+                    row[lp] = DATA_INVALID;
+                } else if (maxV < data)
+                    maxV = data;
+            }
+            for (scale=0; scale<3 && (maxV >> scale) >= allOnes; scale++);
+
+            if (AS_DATA3_SLOTS > slot){
+                SCALING = (SCALING & ~(3 << (2*slot))) | scale << (2*slot);
+            } else {
+                data = slot - AS_DATA3_SLOTS;
+                PBlock.byteD[EtsdInfo.scaleStart + data/4] = (PBlock.byteD[EtsdInfo.scaleStart + data/4] & ~(3 << (2*(data&3)))) | scale << (2*(data&3));
+            }
+            for (lp=0; lp<intervals; lp++)
+                col[lp] = DATA_INVALID == row[lp] ? allOnes : row[lp] >> scale;
+            packChan(chan, ETSD_TYPE(chan), col);
+        } else
+            packChan(chan, ETSD_TYPE(chan), row);
+        memset(row, 0xFF, intervals*sizeof(uint32_t));
+    }
+}
+
+
+// saves etsdData (already converted by saveChan()) to intervals (interV-missed) thru interV of <chan>
+static void saveValue(uint8_t interV, uint8_t chan, uint8_t missed, uint8_t dataInvalid, uint32_t etsdData){
+    uint8_t lp;
+    void (*funct_ptr)(uint8_t  interV, uint8_t extS, QS_SIZE, uint32_t data);  // any float data needs to be converted BEFORE calling function_pointer
+
+    if (EtsdChan[chan].scaled || 13 > ETSD_TYPE(chan)){     // staged, etsdCommit() packs the whole block
+        if (!EtsdChan[chan].scaled)
+            etsdData = stageClamp(chan, etsdData);
+        if (!stageAlloc()){
+            for (lp=interV-missed; lp<=interV;lp++)   //update missing intervals 
+                Stage[chan][lp] = etsdData;
+        }
+        return;
+    }
+    // 32 bit and half float streams are whole words, saved straight to PBlock
+    funct_ptr = saveFunct[ETSD_TYPE(chan)];
+    if (13 == ETSD_TYPE(chan)){     // float32 / int32
+        if (FLOAT_BIT(chan))
+            funct_ptr = saveFloat;
+        else if (SIGNED(chan))
+            funct_ptr = saveInt32;
+        if (dataInvalid && funct_ptr != save32){  // save invalid marker instead of whatever is in data
+            etsdData = FLOAT_BIT(chan) ? DATA_INVALID : INT32_INVALID;
+            funct_ptr = save32;
+        }
+    }
+    for (lp=interV-missed; lp<=interV;lp++){  //update missing intervals 
+        funct_ptr(lp, EtsdChan[chan].extS, EtsdChan[chan].QS, etsdData);   
+    }
+}
+
 // saveChan() automagically determines the right type of stream to save data to based on header block info.  
 // Also tracks previous values on "counter" streams 
 // chan = 0 thru (EtsdInfo.channels-1)
@@ -338,49 +720,24 @@ void saveQS(uint8_t  interV, uint8_t extS, QS_SIZE, uint32_t data){
 // Pete: declaring data as 'int' should allows passing pointers to floats if needed for future upgrades??
 void saveChan(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data){
     uint32_t etsdData;
-    uint8_t lp, missed, extS=1, reg=1, AS=0, QS=0;  
-    void (*funct_ptr)(uint8_t  interV, uint8_t extS, QS_SIZE, uint32_t data);  // any float data needs to be converted BEFORE calling function_pointer
+    uint8_t missed;
     
     if(!(EtsdInfo.channels)){
         ErrorCode = E_NO_ETSD;
         ELog(__func__, 1);
         exit(1);
     }
-    for(lp=0; lp<chan; lp++) {
-        if(AUTOSC(lp))  // Count AutoScale streams up to this channel
-            AS++;
-        if(REG_BIT(lp))     // count saved registers up to this channel
-            reg++;
-/*        
-        if(10 > ETSD_TYPE(lp)){
-            extS += EXTS_BIT(lp);   // Count extended streams up to this channel
-            QS += (ETSD_TYPE(lp)&14)/2;
-        }else{
-            QS += 4;  // for AutoScale streams
-        }
-*/        
-
-//pete when adding extra types:
-        if(13 > ETSD_TYPE(lp)){
-            extS += EXTS_BIT(lp);   // Count extended streams up to this channel
-            QS += (ETSD_TYPE(lp)&14)/2;
-        }else{
-            if (15==(ETSD_TYPE(lp)))
-                QS += 4;  // for AutoScale streams
-            else 
-                QS +=8; // for 32 bit or single precission float
-        }
-         
-    }
 
     if (interV) {   
 //Log("saveChan Interval: %d - Channel #: %d - dataInvalid: %d  data = %u ", interV, chan, dataInvalid, data);
-        if(!EXTS_BIT(chan)) { // channel doesn't use an extended Stream
-            extS = 0;       
+        if (EtsdChan[chan].codec){  // compressed gauge, see etsdCodec.c
+            etsdZSave(interV, chan, dataInvalid, data);
+            ELog(__func__, 1);
+            return;
         }
 
         if(!CNT_BIT(chan) || dataInvalid){    // Gauge channel or invalid data
-            if(SIGNED(chan)){
+            if(SIGNED(chan) && 13 != ETSD_TYPE(chan) && !dataInvalid){     // int32 is saved as is, invalid data stays all ones
                 etsdData = etsdFromSigned(2*ETSD_TYPE(chan), data);
             } else {
                 etsdData = data; 
@@ -402,49 +759,8 @@ void saveChan(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data){
             }    
         }                
 //Log("etsdData: %d\n", etsdData); 
-        switch(ETSD_TYPE(chan)){
-            case 15:     // AutoScaling
-                funct_ptr=saveAutoS;
-                extS = AS;
-                break;
-            case 14:
-                // Pete can't think of a way to make sure platform is using 32 bit floats.
-                // need to work on this  for now assume user will convert it before sending it to saveChan()
-            case 13:     // Double Stream
-                funct_ptr=save32;
-                break;
-            case 12:     // Full Stream
-                funct_ptr=save24;
-                break;
-            case 11:     // Full Stream
-            case 10:  
-                funct_ptr=save20;
-                break;
-            case 9:     // Extended Full Stream
-            case 8:     // Full Stream
-                funct_ptr=saveFS;
-                break;
-            case 7:     // Extended Full Stream
-            case 6:     // Full Stream
-                funct_ptr=save12;
-                break;
-            case 5:     // Extended Half Stream
-            case 4:     // Half Stream
-                funct_ptr=saveHS;
-                break;
-            case 3:     // Extended Quarter Stream
-            case 2:     //  Quarter Stream
-                funct_ptr=saveQS;  
-                break;
-            case 1:     //  Two bit Stream
-                extS--;
-                funct_ptr=saveExtS;
-                break;
-        }
 //Log("saveChan calculating missed intervals.  Interval: %d  Missed: %d  QuarterStream: %d\n", interV, missed, QS); 
-        for (lp=interV-missed; lp<=interV;lp++){  //update missing intervals 
-            funct_ptr(lp, extS, QS, etsdData);   
-        }
+        saveValue(interV, chan, missed, dataInvalid, etsdData);
         if (CNT_BIT(chan)){
 //            if(goodUpdate){
             if(dataInvalid){
@@ -458,10 +774,12 @@ void saveChan(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data){
             }
         }
     } else {  // interV = 0, save registers
+        if (EtsdChan[chan].codec)
+            etsdZStart(chan);
         if (!dataInvalid && REG_BIT(chan)) {
             if( 0xffffffff == data && CNT_BIT(chan)) //all ones indicate error values
                 data++;
-            saveReg(reg, data);
+            saveReg(EtsdChan[chan].reg, data);
             if (  0xffffffff == LastReading[chan]){  //first valid reading
                 LastReading[chan] = data;
                 MissedUpdate[chan] = 0;
@@ -470,3 +788,66 @@ void saveChan(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data){
     }    
     ELog(__func__, 1);
 } // saveChan()
+
+// etsdSaveInterval() is saveChan() for every channel at once, values[chan] and status[chan] are saveChan()'s data and dataInvalid.
+// The counter deltas and signed conversions are worked out for the whole interval before anything is saved.
+void etsdSaveInterval(uint8_t interV, const uint32_t *values, const uint8_t *status){
+    uint16_t chan, channels = EtsdInfo.channels;
+    uint32_t etsdData[256], last;
+    uint8_t missed[256], type;
+
+    if(!channels){
+        ErrorCode = E_NO_ETSD;
+        ELog(__func__, 1);
+        exit(1);
+    }
+    if (!interV){   // registers and counter setup, nothing to batch
+        for (chan=0; chan<channels; chan++)
+            if (ETSD_TYPE(chan))
+                saveChan(0, chan, status[chan], values[chan]);
+        return;
+    }
+
+    for (chan=0; chan<channels; chan++){    // gauges and invalid data, see saveChan()
+        type = ETSD_TYPE(chan);
+        etsdData[chan] = SIGNED(chan) && 13 != type && type && !status[chan] ? etsdFromSigned(2*type, values[chan]) : values[chan];
+        missed[chan] = 0;
+        if (2&status[chan]){    // source reset
+            LastReading[chan] = 0xffffffff;
+            MissedUpdate[chan] = 0;
+        }
+    }
+    for (chan=0; chan<channels; chan++){    // counters with good data
+        last = LastReading[chan];
+        if (!CNT_BIT(chan) || status[chan])
+            continue;
+        if (0xffffffff != last){
+            missed[chan] = MissedUpdate[chan] < interV ? MissedUpdate[chan] : interV-1;
+            etsdData[chan] = (values[chan] - last)/(1+MissedUpdate[chan]);
+        } else
+            etsdData[chan] = 0xffffffff;
+    }
+
+    for (chan=0; chan<channels; chan++){
+        if (!ETSD_TYPE(chan))
+            continue;
+        if (EtsdChan[chan].codec)   // compressed gauge, see etsdCodec.c
+            etsdZSave(interV, chan, status[chan], values[chan]);
+        else
+            saveValue(interV, chan, missed[chan], status[chan], etsdData[chan]);
+    }
+
+    for (chan=0; chan<channels; chan++){
+        if (!CNT_BIT(chan))
+            continue;
+        if (status[chan]){
+            if (!++MissedUpdate[chan])  // missed more than 255 intervals, give up and start over
+                LastReading[chan] = 0xffffffff;
+        } else {
+            MissedUpdate[chan] = 0;
+            LastReading[chan] = values[chan];
+        }
+    }
+    etsdJnlInterval(interV, values, status);
+    ELog(__func__, 1);
+}
@@ -29,18 +29,40 @@ extern "C" {
 // set ETSD block to 'val'
 void etsdBlockClear(uint16_t val);
 
-// set current timestamp on block
+// set current timestamp on block.  Aligned files (see HX_ALIGN) get the start of the current block slot
 void etsdBlockStart();
 
-// write etsd block to disk
+// aligned files, returns how many intervals of the block started by etsdBlockStart() have already gone by, the writer's next interval
+// is one more.  Always zero in files that aren't aligned
+uint8_t etsdAlignInterval();
+
+// packs the intervals staged by saveChan() into the block and writes it to disk
 // returns zero on success, -1 if can't rotate files, exits if can't save to current file
 int32_t etsdCommit(uint8_t interV);
 
+// packs the block like etsdCommit() and picks its sector, but leaves writing it to the caller, i.e. a writer thread using
+// etsdWriteBlock() with its own file descriptor (see edd.c).  *offset = where the block goes in the file, EtsdInfo.sector = its
+// sector.  Blocks sealed but not written yet are counted so the next block gets the next sector.  The whole block is journaled
+// (etsdJnlSeal()), so the writer has to sync the file at least every JNL_SYNC blocks.  Once the block is written the caller
+// passes it to etsdBlockWritten(), and rotating is left to the caller too, once the writer has caught up.
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdSeal(uint8_t interV, int64_t *offset);
+
+// adds block <blk>, now written to sector #sector, to the index, register index, rollup tiers and zone map.  Called by etsdCommit(),
+// writers that use etsdSeal() call it after the write so those files never describe a block that isn't in the ETSD file.
+// Only group 0's blocks are added, call it with group 0 selected.  Errors are logged, the files can all be rebuilt
+void etsdBlockWritten(PBLOCK *blk, int32_t sector);
+
 // backs up current etsd file and opens a new one with the current name. Copies the first sector (db info) to new file
 // to avoid losing data, execute etsdCommit() before etsdRotate()
 // returns zero on success or error code (see above)
 int32_t etsdRotate();
 
+// switches the block being built to channel group <group>, see etsdGroup().  Each group keeps its own block, staged intervals
+// and block full flag, so a writer can save every group each interval and commit them all at the end of the block
+// returns zero on success, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdSaveGroup(uint8_t group);
+
 // src= ETSD source type that was Reset, interv is last good interval before source was reset
 // returns zero.  On return, calling program should reset interval to zero.  i.e. Interval = etsdSrcReset( type, Interval);
 uint8_t etsdSrcReset(uint8_t src, uint8_t interV);
@@ -61,8 +83,15 @@ uint8_t etsdReadByte(uint16_t addr);
 // valid chan = 0 thru (EtsdInfo.channels-1)
 // call with interV = 0 to save registers and reset counter variables.
 // call with interV > 0 to save data as either Relative or Absolute based on header block info.
+// Streams of 24 bits or less are only staged, etsdCommit() packs them into PBlock.  The save functions below write PBlock directly.
+// Not journaled, use etsdSaveInterval() if the block in progress has to survive a crash (see etsdJournal.h)
 void saveChan(uint8_t interV, uint8_t chan, uint8_t dataInvalid, uint32_t data);
 
+// saves one interval of every channel, same as calling saveChan() for each channel that's saved to ETSD
+// values[chan] = data, status[chan] = dataInvalid.  Both arrays need EtsdInfo.channels entries
+// The interval is journaled once etsdJnlOpen() has been called
+void etsdSaveInterval(uint8_t interV, const uint32_t *values, const uint8_t *status);
+
 #ifdef ALL_SYMBOLS
 // reg = 1-??,  registers are saved at the end of Block, working backwards
 void saveReg(uint8_t reg, uint32_t data);
@@ -71,6 +100,18 @@ void saveReg(uint8_t reg, uint32_t data);
 // do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
 void save32(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
 
+// data = float bit pattern, NaN's are saved as FLOAT_NAN, DATA_INVALID (all ones) is saved as invalid
+// do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
+void saveFloat(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
+
+// data = int32, saved without etsdFromSigned() conversion.  INT32_INVALID is reserved for invalid data
+// do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
+void saveInt32(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
+
+// data = single precision float bit pattern, saved as half precision (rounded to nearest), DATA_INVALID is saved as invalid
+// do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
+void saveHalf(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
+
 // QS = 0 - ??.  Valid Data = 0-16,777,214
 // do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
 void save24(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
@@ -79,9 +120,10 @@ void save24(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
 // do NOT call when interV = 0, valid intervals are 1 to (EtsdInfo.blockIntervals)
 void save20(uint8_t interV, uint8_t extS, QS_SIZE, uint32_t data);
 
-// Auto-Scaling (currently) works on full streams only. Can handle any value up to 524272, any larger values is saved as invalid (all 1's)
+// Auto-Scaling works on 8, 12, 16 and 20 bit streams. Can handle any value up to ((2^bits - 2) << 3) + 7, any larger value is saved as invalid (all 1's)
+// Readings are staged until etsdCommit(), which picks the block's scale factor and saves them
 // do NOT call when interV = 0
-// ASC = Auto-Scaling channel 0-7
+// ASC = Auto-Scaling slot, see ETSD_CHAN.AS
 void saveAutoS(uint8_t interV, uint8_t ASC, QS_SIZE, uint32_t data);
 
 // For FS/HS/QS if extS = 0: don't save extended data, otherwise indicates which extS stream to use
@@ -102,7 +144,7 @@ void saveQS(uint8_t  interV, uint8_t extS, QS_SIZE, uint32_t data);
 
 // normally used to extended (add 2 bits to) a data stream, but can be used alone to store 2 bit data streams.  Only LSbx2 of data is saved
 // extS values 1 to (number of extended channels)  
-void saveExtS(uint8_t interV, uint8_t extS, uint8_t dummy, uint32_t data);
+void saveExtS(uint8_t interV, uint8_t extS, uint16_t dummy, uint32_t data);
 #endif
 
 #ifdef __cplusplus
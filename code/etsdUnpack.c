@@ -0,0 +1,437 @@
+/*************************************************************************
+etsdUnpack.c bulk stream unpacking for an ETSD time series database
+ Expands whole streams (every interval in a block) to 32 bit values.  Used by etsdDecodeBlock().
+ Scalar, SSE2, AVX2 (x86) and NEON (ARM) versions, selected at runtime by etsdUnpackInit()
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "etsd.h"
+#include "etsdUnpack.h"
+#include "errorlog.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNPACK_X86
+#include <immintrin.h>
+#endif
+
+// 32 bit ARM only has NEON when the compiler is told the CPU has it, i.e. -mfpu=neon-fp16 on a Pi 2/3/4 running a 32 bit OS
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define UNPACK_ARM
+#include <arm_neon.h>
+#if defined(__aarch64__) || (defined(__ARM_FP) && (__ARM_FP & 2))
+#define UNPACK_ARM_F16      // half precision conversions, always on aarch64, -mfpu=neon-fp16 on 32 bit ARM
+#endif
+#endif
+
+// Note: vector loops only read bytes that belong to the stream.  The remainder of each run is done by the
+// scalar versions, so a stream ending at the end of a mmap'd file can't fault.
+
+//********************** Scalar (reference) *************************
+
+static void u4Scalar(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint16_t j;
+    uint32_t v;
+    for (j=0; j<n; j++){
+        v = (src[j/2] >> ((j&1)?0:4)) & 15;     // odd intervals in the high nibble
+        dst[j] = shift ? dst[j] | (v<<shift) : v;
+    }
+}
+
+static void u8Scalar(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint16_t j;
+    for (j=0; j<n; j++)
+        dst[j] = shift ? dst[j] | ((uint32_t)src[j]<<shift) : src[j];
+}
+
+static void u16Scalar(const uint16_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint16_t j;
+    for (j=0; j<n; j++)
+        dst[j] = shift ? dst[j] | ((uint32_t)src[j]<<shift) : src[j];
+}
+
+static void u2Scalar(const uint8_t *src, uint16_t lane, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint16_t j, p;
+    uint32_t v;
+    for (j=0; j<n; j++){
+        p = lane + j;
+        v = (src[p/4] >> ((p&3)*2)) & 3;
+        dst[j] = shift ? dst[j] | (v<<shift) : v;
+    }
+}
+
+static void f16Scalar(const uint16_t *src, uint32_t *dst, uint16_t n){
+    uint16_t j;
+    for (j=0; j<n; j++)
+        dst[j] = etsdHalfToFloat(src[j]);
+}
+
+// mask values j thru n-1, valid[] already zeroed
+static uint16_t maskTail(uint32_t *dst, uint16_t j, uint16_t n, uint32_t maxV, uint32_t *valid){
+    uint16_t cnt=0;
+    for (; j<n; j++){
+        if (!maxV || dst[j] < maxV){
+            valid[j/32] |= 1u << (j&31);
+            cnt++;
+        } else
+            dst[j] = 0;
+    }
+    return cnt;
+}
+
+static uint16_t maskScalar(uint32_t *dst, uint16_t n, uint32_t maxV, uint32_t *valid){
+    memset(valid, 0, (n+31)/32*sizeof(uint32_t));
+    return maskTail(dst, 0, n, maxV, valid);
+}
+
+const ETSD_UNPACK EtsdUnpackScalar = {u4Scalar, u8Scalar, u16Scalar, u2Scalar, f16Scalar, maskScalar, "scalar"};
+ETSD_UNPACK EtsdUnpack = {u4Scalar, u8Scalar, u16Scalar, u2Scalar, f16Scalar, maskScalar, "scalar"};
+uint8_t EtsdUnpackLevel = UNPACK_BEST;
+
+//********************** SSE2 *************************
+#ifdef UNPACK_X86
+
+__attribute__((target("sse2")))
+static inline void store4SSE2(uint32_t *dst, __m128i v, __m128i sh, uint8_t shift){
+    if (shift)
+        v = _mm_or_si128(_mm_loadu_si128((const __m128i*)dst), _mm_sll_epi32(v, sh));
+    _mm_storeu_si128((__m128i*)dst, v);
+}
+
+// 16 bytes to 16 uint32
+__attribute__((target("sse2")))
+static inline void store16SSE2(uint32_t *dst, __m128i v, __m128i sh, uint8_t shift){
+    __m128i z = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(v, z), hi = _mm_unpackhi_epi8(v, z);
+    store4SSE2(dst, _mm_unpacklo_epi16(lo, z), sh, shift);
+    store4SSE2(dst+4, _mm_unpackhi_epi16(lo, z), sh, shift);
+    store4SSE2(dst+8, _mm_unpacklo_epi16(hi, z), sh, shift);
+    store4SSE2(dst+12, _mm_unpackhi_epi16(hi, z), sh, shift);
+}
+
+__attribute__((target("sse2")))
+static void u4SSE2(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m128i sh = _mm_cvtsi32_si128(shift), m = _mm_set1_epi8(15), v, hiN, loN;
+    uint16_t j;
+    for (j=0; j+32<=n; j+=32){
+        v = _mm_loadu_si128((const __m128i*)(src + j/2));
+        hiN = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+        loN = _mm_and_si128(v, m);
+        store16SSE2(dst+j, _mm_unpacklo_epi8(hiN, loN), sh, shift);
+        store16SSE2(dst+j+16, _mm_unpackhi_epi8(hiN, loN), sh, shift);
+    }
+    u4Scalar(src + j/2, dst+j, n-j, shift);
+}
+
+__attribute__((target("sse2")))
+static void u8SSE2(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    uint16_t j;
+    for (j=0; j+16<=n; j+=16)
+        store16SSE2(dst+j, _mm_loadu_si128((const __m128i*)(src+j)), sh, shift);
+    u8Scalar(src+j, dst+j, n-j, shift);
+}
+
+__attribute__((target("sse2")))
+static void u16SSE2(const uint16_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m128i sh = _mm_cvtsi32_si128(shift), z = _mm_setzero_si128(), v;
+    uint16_t j;
+    for (j=0; j+8<=n; j+=8){
+        v = _mm_loadu_si128((const __m128i*)(src+j));
+        store4SSE2(dst+j, _mm_unpacklo_epi16(v, z), sh, shift);
+        store4SSE2(dst+j+4, _mm_unpackhi_epi16(v, z), sh, shift);
+    }
+    u16Scalar(src+j, dst+j, n-j, shift);
+}
+
+// unsigned compare done as signed compare with the sign bit flipped
+__attribute__((target("sse2")))
+static uint16_t maskSSE2(uint32_t *dst, uint16_t n, uint32_t maxV, uint32_t *valid){
+    __m128i bias = _mm_set1_epi32(0x80000000), lim = _mm_set1_epi32(maxV ^ 0x80000000), x, ok;
+    uint16_t j, cnt=0;
+    uint32_t bits;
+    if (!maxV)
+        return maskScalar(dst, n, maxV, valid);
+    memset(valid, 0, (n+31)/32*sizeof(uint32_t));
+    for (j=0; j+4<=n; j+=4){
+        x = _mm_loadu_si128((const __m128i*)(dst+j));
+        ok = _mm_cmplt_epi32(_mm_xor_si128(x, bias), lim);
+        _mm_storeu_si128((__m128i*)(dst+j), _mm_and_si128(x, ok));
+        bits = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        valid[j/32] |= bits << (j&31);
+        cnt += __builtin_popcount(bits);
+    }
+    return cnt + maskTail(dst, j, n, maxV, valid);
+}
+
+// SSE2 has no per lane variable shift, 2 bit streams use the scalar version.  Half floats need F16C, see etsdUnpackInit()
+static const ETSD_UNPACK UnpackSSE2 = {u4SSE2, u8SSE2, u16SSE2, u2Scalar, f16Scalar, maskSSE2, "sse2"};
+
+//********************** AVX2 *************************
+
+__attribute__((target("avx2")))
+static inline void store8AVX2(uint32_t *dst, __m256i v, __m128i sh, uint8_t shift){
+    if (shift)
+        v = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)dst), _mm256_sll_epi32(v, sh));
+    _mm256_storeu_si256((__m256i*)dst, v);
+}
+
+__attribute__((target("avx2")))
+static void u4AVX2(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m128i sh = _mm_cvtsi32_si128(shift), m = _mm_set1_epi8(15), v, hiN, loN, a, b;
+    uint16_t j;
+    for (j=0; j+32<=n; j+=32){
+        v = _mm_loadu_si128((const __m128i*)(src + j/2));
+        hiN = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+        loN = _mm_and_si128(v, m);
+        a = _mm_unpacklo_epi8(hiN, loN);
+        b = _mm_unpackhi_epi8(hiN, loN);
+        store8AVX2(dst+j, _mm256_cvtepu8_epi32(a), sh, shift);
+        store8AVX2(dst+j+8, _mm256_cvtepu8_epi32(_mm_srli_si128(a, 8)), sh, shift);
+        store8AVX2(dst+j+16, _mm256_cvtepu8_epi32(b), sh, shift);
+        store8AVX2(dst+j+24, _mm256_cvtepu8_epi32(_mm_srli_si128(b, 8)), sh, shift);
+    }
+    u4Scalar(src + j/2, dst+j, n-j, shift);
+}
+
+__attribute__((target("avx2")))
+static void u8AVX2(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    uint16_t j;
+    for (j=0; j+8<=n; j+=8)
+        store8AVX2(dst+j, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src+j))), sh, shift);
+    u8Scalar(src+j, dst+j, n-j, shift);
+}
+
+__attribute__((target("avx2")))
+static void u16AVX2(const uint16_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    uint16_t j;
+    for (j=0; j+8<=n; j+=8)
+        store8AVX2(dst+j, _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src+j))), sh, shift);
+    u16Scalar(src+j, dst+j, n-j, shift);
+}
+
+// 8 intervals = 16 bits, plus up to 6 bits when the lane doesn't start on a byte boundary
+__attribute__((target("avx2")))
+static void u2AVX2(const uint8_t *src, uint16_t lane, uint32_t *dst, uint16_t n, uint8_t shift){
+    __m256i pos = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14), m = _mm256_set1_epi32(3);
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    uint16_t j, p;
+    uint32_t w;
+    for (j=0; j+8<=n; j+=8){
+        p = lane + j;
+        w = src[p/4] | (src[p/4+1] << 8);
+        if ((p+7)/4 > p/4+1)
+            w |= src[p/4+2] << 16;
+        w >>= (p&3)*2;
+        store8AVX2(dst+j, _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(w), pos), m), sh, shift);
+    }
+    u2Scalar(src, lane+j, dst+j, n-j, shift);
+}
+
+__attribute__((target("avx2")))
+static uint16_t maskAVX2(uint32_t *dst, uint16_t n, uint32_t maxV, uint32_t *valid){
+    __m256i bias = _mm256_set1_epi32(0x80000000), lim = _mm256_set1_epi32(maxV ^ 0x80000000), x, ok;
+    uint16_t j, cnt=0;
+    uint32_t bits;
+    if (!maxV)
+        return maskScalar(dst, n, maxV, valid);
+    memset(valid, 0, (n+31)/32*sizeof(uint32_t));
+    for (j=0; j+8<=n; j+=8){
+        x = _mm256_loadu_si256((const __m256i*)(dst+j));
+        ok = _mm256_cmpgt_epi32(lim, _mm256_xor_si256(x, bias));
+        _mm256_storeu_si256((__m256i*)(dst+j), _mm256_and_si256(x, ok));
+        bits = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+        valid[j/32] |= bits << (j&31);
+        cnt += __builtin_popcount(bits);
+    }
+    return cnt + maskTail(dst, j, n, maxV, valid);
+}
+
+static const ETSD_UNPACK UnpackAVX2 = {u4AVX2, u8AVX2, u16AVX2, u2AVX2, f16Scalar, maskAVX2, "avx2"};
+
+//********************** F16C *************************
+// separate cpu flag, used with either SSE2 or AVX2 when available
+
+__attribute__((target("avx,f16c")))
+static void f16F16C(const uint16_t *src, uint32_t *dst, uint16_t n){
+    uint16_t j;
+    for (j=0; j+8<=n; j+=8)
+        _mm256_storeu_si256((__m256i*)(dst+j), _mm256_castps_si256(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src+j)))));
+    f16Scalar(src+j, dst+j, n-j);
+}
+#endif  // UNPACK_X86
+
+//********************** NEON *************************
+#ifdef UNPACK_ARM
+
+// sum of the 4 lanes, vaddvq_u32() is aarch64 only
+static inline uint32_t sum4NEON(uint32x4_t v){
+#ifdef __aarch64__
+    return vaddvq_u32(v);
+#else
+    uint32x2_t s = vadd_u32(vget_low_u32(v), vget_high_u32(v));
+    return vget_lane_u32(vpadd_u32(s, s), 0);
+#endif
+}
+
+static inline void store4NEON(uint32_t *dst, uint32x4_t v, uint8_t shift){
+    if (shift)
+        v = vorrq_u32(vld1q_u32(dst), vshlq_u32(v, vdupq_n_s32(shift)));
+    vst1q_u32(dst, v);
+}
+
+// 8 bytes to 8 uint32
+static inline void store8NEON(uint32_t *dst, uint8x8_t v, uint8_t shift){
+    uint16x8_t w = vmovl_u8(v);
+    store4NEON(dst, vmovl_u16(vget_low_u16(w)), shift);
+    store4NEON(dst+4, vmovl_u16(vget_high_u16(w)), shift);
+}
+
+static void u4NEON(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint8x16_t v;
+    uint8x16x2_t z;
+    uint16_t j;
+    for (j=0; j+32<=n; j+=32){
+        v = vld1q_u8(src + j/2);
+        z = vzipq_u8(vshrq_n_u8(v, 4), vandq_u8(v, vdupq_n_u8(15)));
+        store8NEON(dst+j, vget_low_u8(z.val[0]), shift);
+        store8NEON(dst+j+8, vget_high_u8(z.val[0]), shift);
+        store8NEON(dst+j+16, vget_low_u8(z.val[1]), shift);
+        store8NEON(dst+j+24, vget_high_u8(z.val[1]), shift);
+    }
+    u4Scalar(src + j/2, dst+j, n-j, shift);
+}
+
+static void u8NEON(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint16_t j;
+    for (j=0; j+8<=n; j+=8)
+        store8NEON(dst+j, vld1_u8(src+j), shift);
+    u8Scalar(src+j, dst+j, n-j, shift);
+}
+
+static void u16NEON(const uint16_t *src, uint32_t *dst, uint16_t n, uint8_t shift){
+    uint16x8_t v;
+    uint16_t j;
+    for (j=0; j+8<=n; j+=8){
+        v = vld1q_u16(src+j);
+        store4NEON(dst+j, vmovl_u16(vget_low_u16(v)), shift);
+        store4NEON(dst+j+4, vmovl_u16(vget_high_u16(v)), shift);
+    }
+    u16Scalar(src+j, dst+j, n-j, shift);
+}
+
+static void u2NEON(const uint8_t *src, uint16_t lane, uint32_t *dst, uint16_t n, uint8_t shift){
+    static const int32_t lo[4] = {0, -2, -4, -6}, hi[4] = {-8, -10, -12, -14};   // negative = shift right
+    uint32x4_t m = vdupq_n_u32(3), w4;
+    uint16_t j, p;
+    uint32_t w;
+    for (j=0; j+8<=n; j+=8){
+        p = lane + j;
+        w = src[p/4] | (src[p/4+1] << 8);
+        if ((p+7)/4 > p/4+1)
+            w |= src[p/4+2] << 16;
+        w4 = vdupq_n_u32(w >> (p&3)*2);
+        store4NEON(dst+j, vandq_u32(vshlq_u32(w4, vld1q_s32(lo)), m), shift);
+        store4NEON(dst+j+4, vandq_u32(vshlq_u32(w4, vld1q_s32(hi)), m), shift);
+    }
+    u2Scalar(src, lane+j, dst+j, n-j, shift);
+}
+
+static uint16_t maskNEON(uint32_t *dst, uint16_t n, uint32_t maxV, uint32_t *valid){
+    static const uint32_t bit[4] = {1, 2, 4, 8};
+    uint32x4_t lim = vdupq_n_u32(maxV), b = vld1q_u32(bit), x, ok;
+    uint16_t j, cnt=0;
+    uint32_t bits;
+    if (!maxV)
+        return maskScalar(dst, n, maxV, valid);
+    memset(valid, 0, (n+31)/32*sizeof(uint32_t));
+    for (j=0; j+4<=n; j+=4){
+        x = vld1q_u32(dst+j);
+        ok = vcltq_u32(x, lim);
+        vst1q_u32(dst+j, vandq_u32(x, ok));
+        bits = sum4NEON(vandq_u32(ok, b));
+        valid[j/32] |= bits << (j&31);
+        cnt += __builtin_popcount(bits);
+    }
+    return cnt + maskTail(dst, j, n, maxV, valid);
+}
+
+#ifdef UNPACK_ARM_F16
+static void f16NEON(const uint16_t *src, uint32_t *dst, uint16_t n){
+    uint16_t j;
+    for (j=0; j+4<=n; j+=4)
+        vst1q_u32(dst+j, vreinterpretq_u32_f32(vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src+j)))));
+    f16Scalar(src+j, dst+j, n-j);
+}
+#else
+#define f16NEON f16Scalar
+#endif
+
+static const ETSD_UNPACK UnpackNEON = {u4NEON, u8NEON, u16NEON, u2NEON, f16NEON, maskNEON, "neon"};
+#endif  // UNPACK_ARM
+
+
+// selects kernels, UNPACK_BEST picks the fastest this CPU supports
+// returns the level selected, or -1(DATA_INVALID) if <level> isn't supported on this CPU (EtsdUnpack is unchanged)
+int32_t etsdUnpackInit(uint8_t level){
+#ifdef UNPACK_X86
+    __builtin_cpu_init();
+#endif
+    if (UNPACK_BEST == level){
+        level = UNPACK_SCALAR;
+#ifdef UNPACK_X86
+        if (__builtin_cpu_supports("avx2"))
+            level = UNPACK_AVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            level = UNPACK_SSE2;
+#endif
+#ifdef UNPACK_ARM
+        level = UNPACK_NEON;
+#endif
+    }
+
+    switch(level){
+        case UNPACK_SCALAR:
+            EtsdUnpack = EtsdUnpackScalar;
+            return EtsdUnpackLevel = level;
+#ifdef UNPACK_X86
+        case UNPACK_SSE2:
+            if (!__builtin_cpu_supports("sse2"))
+                break;
+            EtsdUnpack = UnpackSSE2;
+            if (__builtin_cpu_supports("f16c"))
+                EtsdUnpack.f16 = f16F16C;
+            return EtsdUnpackLevel = level;
+        case UNPACK_AVX2:
+            if (!__builtin_cpu_supports("avx2"))
+                break;
+            EtsdUnpack = UnpackAVX2;
+            if (__builtin_cpu_supports("f16c"))
+                EtsdUnpack.f16 = f16F16C;
+            return EtsdUnpackLevel = level;
+#endif
+#ifdef UNPACK_ARM
+        case UNPACK_NEON:
+            EtsdUnpack = UnpackNEON;
+            return EtsdUnpackLevel = level;
+#endif
+    }
+    ErrorCode |= E_ARG;
+    return DATA_INVALID;
+}
@@ -0,0 +1,66 @@
+/*************************************************************************
+etsdUnpack.h bulk stream unpacking for an ETSD time series database
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdunpack_h__
+#define __etsdunpack_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Each kernel expands a run of <n> packed values (interval 1 thru n) from a block into 32 bit values.
+// shift = 0 stores the values in dst, shift > 0 ORs (value << shift) into dst.  This is how the pieces of
+// 12/20/24/32 bit streams and the extended stream bits are merged together.
+typedef struct {
+    // quarter stream, src = first byte of the stream.  Interval 1 is the high nibble, same as read4()
+    void (*u4)(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift);
+    // half stream, same as read8()
+    void (*u8)(const uint8_t *src, uint32_t *dst, uint16_t n, uint8_t shift);
+    // full stream, same as read16()
+    void (*u16)(const uint16_t *src, uint32_t *dst, uint16_t n, uint8_t shift);
+    // 2 bit extended stream, src = start of the ext stream, lane = first 2 bit position, same as readExtS()
+    void (*u2)(const uint8_t *src, uint16_t lane, uint32_t *dst, uint16_t n, uint8_t shift);
+    // half float stream to single precision float bit patterns, same as readHalf() without the invalid check
+    void (*f16)(const uint16_t *src, uint32_t *dst, uint16_t n);
+    // sets a valid bit for every dst[] < maxV, zeroes the rest.  maxV = 0, everything is valid
+    // valid[] must hold (n+31)/32 words.  returns number of valid values
+    uint16_t (*mask)(uint32_t *dst, uint16_t n, uint32_t maxV, uint32_t *valid);
+    const char *name;
+} ETSD_UNPACK;
+
+#define UNPACK_BEST   0
+#define UNPACK_SCALAR 1
+#define UNPACK_SSE2   2
+#define UNPACK_AVX2   3
+#define UNPACK_NEON   4
+
+// kernels currently in use, set by etsdUnpackInit()
+extern ETSD_UNPACK EtsdUnpack;
+extern uint8_t EtsdUnpackLevel;     // UNPACK_BEST until etsdUnpackInit() is called
+
+// reference version, every other version must return identical results
+extern const ETSD_UNPACK EtsdUnpackScalar;
+
+// selects kernels, UNPACK_BEST picks the fastest this CPU supports.  Called automatically by etsdDecodeInit()
+// returns the level selected, or -1(DATA_INVALID) if <level> isn't supported on this CPU (EtsdUnpack is unchanged)
+int32_t etsdUnpackInit(uint8_t level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,291 @@
+/*************************************************************************
+etsdZone.c block zone maps (.tsdz), a min/max/sum summary of every block of an ETSD time series database
+ With each block's min, max, sum and valid count per channel at hand, threshold, min/max and "first time over" queries only decode
+ the blocks that can change their answer, the rest are added up from their records.  See etsdZone.h for the file layout.
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "etsd.h"
+#include "etsdRead.h"
+#include "etsdZone.h"
+#include "errorlog.h"
+
+#define ZONE_AHEAD 256      // records read at a time by etsdZone()
+
+static int ZoneFd = -1;
+static char *ZoneFile = NULL;       // ETSD file the zone map belongs to
+static ETSD_ZHDR ZoneHdr;
+static uint8_t ZoneWrite = 0;       // kept up to date by this program, with ZoneFd < 0 the ETSD file has no zone map to keep
+static int32_t ZoneCnt = 0;         // sectors covered + 1, zero = no zone map
+static size_t ZoneRec = 0;          // bytes per record
+static uint8_t *ZoneBuf = NULL;     // ZONE_AHEAD records, the first one is sector ZoneFirst
+static int32_t ZoneFirst = 0, ZoneHave = 0;
+static ETSD_DBLOCK ZoneDb = {0};    // every channel
+
+static off_t zoneOffset(int32_t sector){
+    return sizeof(ETSD_ZHDR) + (off_t)(sector-1) * ZoneRec;
+}
+
+// the zone map is for the current ETSD file and layout
+static uint8_t zoneCurrent(){
+    return ZoneFile && !strcmp(ZoneFile, EtsdInfo.fileName) && ZoneHdr.sig == etsdLayoutSig();
+}
+
+// summarizes <blk> into record <rec>, RBlock is left as it was
+static void zoneFill(PBLOCK *blk, uint8_t *rec){
+    ETSD_ZREC *z = (ETSD_ZREC*)rec;
+    ETSD_ZONE *zn;
+    PBLOCK *save = RBlock;
+    uint8_t *cnt = ZONE_CNT(rec), lp;
+    uint16_t chan;
+    uint32_t data;
+    double v, mn = 0, mx = 0;
+
+    RBlock = blk;
+    etsdDecodeBlock(&ZoneDb);
+    RBlock = save;
+    memset(rec, 0, ZoneRec);
+    z->timeStamp = ZoneDb.timeStamp;
+    z->intervals = ZoneDb.intervals;
+    z->reset = ZoneDb.reset;
+    for (chan=0; chan<EtsdInfo.channels; chan++){
+        zn = ZONE_OF(rec, chan);
+        for (lp=1; lp<=ZoneDb.intervals; lp++){
+            if (!DB_VALID(&ZoneDb, chan, lp))
+                continue;
+            data = DB_VALUE(&ZoneDb, chan, lp);
+            v = etsdValue(chan, data);
+            if (v != v)     // NaN
+                continue;
+            if (!cnt[chan] || v < mn){
+                mn = v;
+                zn->min = data;
+            }
+            if (!cnt[chan] || v > mx){
+                mx = v;
+                zn->max = data;
+            }
+            zn->sum += v;
+            cnt[chan]++;
+        }
+    }
+}
+
+static int32_t zoneWrite(int32_t sector, uint8_t *rec){
+    if ((ssize_t)ZoneRec != pwrite(ZoneFd, rec, ZoneRec, zoneOffset(sector))){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    if (sector >= ZoneCnt)
+        ZoneCnt = sector + 1;
+    ZoneHave = 0;   // read ahead may be stale
+    return 0;
+}
+
+// starts the zone map file over, empty
+static int32_t zoneReset(){
+    ZoneCnt = 1;
+    ZoneHave = 0;
+    if (ftruncate(ZoneFd, 0) || sizeof(ETSD_ZHDR) != pwrite(ZoneFd, &ZoneHdr, sizeof(ETSD_ZHDR), 0)){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    return 0;
+}
+
+// summarizes every block of the ETSD file the zone map doesn't have yet.  Reads the file directly, doesn't touch PBlock or RBlock
+// returns ZoneCnt or -1(DATA_INVALID) and sets ErrorCode
+static int32_t zoneCatchUp(){
+    int32_t sectors = etsdGroupSectors(0), sector;
+    PBLOCK *blk;
+
+    if (0 > sectors)
+        return DATA_INVALID;
+    if (NULL == (blk = (PBLOCK*)malloc(ETSD_MAX_BLOCK))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    for (sector=ZoneCnt; sector<sectors; sector++){
+        if ((ssize_t)ETSD_BSIZE != pread(EtsdInfo.fd, blk, ETSD_BSIZE, ETSD_OFFSET(sector, 0))){
+            ErrorCode |= E_CANT_READ;
+            break;
+        }
+        if (!blk->longD[0])
+            continue;   // holes in an aligned file stay holes
+        zoneFill(blk, ZoneBuf);
+        if (zoneWrite(sector, ZoneBuf))
+            break;
+    }
+    free(blk);
+    if (sector < sectors)
+        return DATA_INVALID;
+    return ZoneCnt;
+}
+
+// looks for the zone map of the current ETSD file and opens it, create != 0 makes a new one if there isn't one
+// returns 1 if it's open, zero if there is none or -1(DATA_INVALID) and sets ErrorCode
+static int32_t zoneAttach(uint8_t write, uint8_t create){
+    char *name;
+
+    etsdZoneClose();
+    if (EtsdInfo.group || !EtsdInfo.channels){
+        ErrorCode |= E_ARG;
+        return DATA_INVALID;
+    }
+    if (!EtsdInfo.fdMode && etsdOpen('r'))
+        return DATA_INVALID;
+    ZoneFile = strdup(EtsdInfo.fileName);
+    memset(&ZoneHdr, 0, sizeof(ZoneHdr));
+    ZoneHdr.magic = ZONE_MAGIC;
+    ZoneHdr.sig = etsdLayoutSig();
+    ZoneHdr.channels = EtsdInfo.channels;
+    ZoneWrite = write;  // even if there's no zone map, etsdZoneBlock() then doesn't look for it again until the ETSD file changes
+    if (NULL == (name = etsdSidecarName(EtsdInfo.fileName, "z")))
+        return DATA_INVALID;
+    ZoneFd = open(name, write ? O_RDWR|(create ? O_CREAT : 0) : O_RDONLY, 0644);
+    free(name);
+    if (0 > ZoneFd)
+        return 0;
+    ZoneRec = sizeof(ETSD_ZREC) + ((EtsdInfo.channels+7) & ~7) + EtsdInfo.channels * sizeof(ETSD_ZONE);
+    if (etsdDecodeInit(&ZoneDb) || NULL == (ZoneBuf = (uint8_t*)malloc(ZONE_AHEAD * ZoneRec))){
+        ErrorCode |= E_MEM;
+        return DATA_INVALID;
+    }
+    return 1;
+}
+
+int32_t etsdZoneOpen(uint8_t write){
+    ETSD_ZHDR hdr;
+    struct stat st;
+    uint32_t stamps[2];
+    int32_t sectors, last, rval;
+
+    if (zoneCurrent() && 0 <= ZoneFd && ZoneCnt && (ZoneWrite || !write)){   // already open, just pick up any records added since
+        if (!fstat(ZoneFd, &st) && (off_t)sizeof(ETSD_ZHDR) <= st.st_size)
+            ZoneCnt = (st.st_size - sizeof(ETSD_ZHDR)) / ZoneRec + 1;
+        if (!ZoneWrite && 0 <= (sectors = etsdGroupSectors(0)) && ZoneCnt > sectors)
+            ZoneCnt = sectors;
+        return ZoneCnt;
+    }
+    if (1 != (rval = zoneAttach(write, 0)))
+        return rval;
+    if (0 > (sectors = etsdGroupSectors(0)))
+        return DATA_INVALID;
+    if (fstat(ZoneFd, &st) || sizeof(hdr) != pread(ZoneFd, &hdr, sizeof(hdr), 0) || memcmp(&hdr, &ZoneHdr, sizeof(hdr)))
+        ZoneCnt = 0;
+    else {
+        ZoneCnt = (st.st_size - sizeof(hdr)) / ZoneRec + 1;
+        last = ZoneCnt < sectors ? ZoneCnt-1 : sectors-1;   // make sure it still matches the ETSD file (i.e. not left over from before a rotate)
+        if (0 < last && (sizeof(stamps[0]) != pread(ZoneFd, &stamps[0], sizeof(stamps[0]), zoneOffset(last))
+                || sizeof(stamps[1]) != pread(EtsdInfo.fd, &stamps[1], sizeof(stamps[1]), ETSD_OFFSET(last, 0)) || stamps[0] != stamps[1]))
+            ZoneCnt = 0;
+    }
+    if (!write && ZoneCnt > sectors)
+        ZoneCnt = sectors;  // a record past the end of the ETSD file (i.e. a writer that crashed) describes a block that isn't there
+    if (!ZoneCnt){
+        if (!write){    // readers just don't use it
+            etsdZoneClose();
+            return 0;
+        }
+        Log("<5> Zone map of %s doesn't match the ETSD file, rebuilding it\n", EtsdInfo.fileName);
+        if (zoneReset())
+            return DATA_INVALID;
+    }
+    return write ? zoneCatchUp() : ZoneCnt;
+}
+
+int32_t etsdZoneBuild(){
+    if (1 != zoneAttach(1, 1)){
+        ErrorCode |= E_CANT_WRITE;
+        return DATA_INVALID;
+    }
+    if (zoneReset())
+        return DATA_INVALID;
+    return zoneCatchUp();
+}
+
+int32_t etsdZoneBlock(PBLOCK *blk, int32_t sector){
+    if (EtsdInfo.group)
+        return 0;
+    if ((!zoneCurrent() || !ZoneWrite) && 0 > etsdZoneOpen(1))
+        return DATA_INVALID;
+    if (0 > ZoneFd || !ZoneCnt)
+        return 0;   // no zone map for this file, remembered by zoneAttach()
+    zoneFill(blk, ZoneBuf);
+    return zoneWrite(sector, ZoneBuf);
+}
+
+ETSD_ZREC *etsdZone(int32_t sector){
+    ssize_t got;
+
+    if (0 > ZoneFd || sector < 1 || sector >= ZoneCnt)
+        return NULL;
+    if (sector < ZoneFirst || sector >= ZoneFirst + ZoneHave){
+        got = pread(ZoneFd, ZoneBuf, ZONE_AHEAD * ZoneRec, zoneOffset(sector));
+        ZoneHave = 0 < got ? got / ZoneRec : 0;
+        ZoneFirst = sector;
+        if (!ZoneHave)
+            return NULL;
+    }
+    return (ETSD_ZREC*)(ZoneBuf + (size_t)(sector - ZoneFirst) * ZoneRec);
+}
+
+void etsdZoneRename(char *newName){
+    char *from, *to;
+
+    if (0 > ZoneFd || !ZoneWrite)
+        return;
+    from = etsdSidecarName(ZoneFile, "z");
+    to = etsdSidecarName(newName, "z");
+    if (!from || !to){      // can't move it, stop keeping it up to date
+        free(from);
+        free(to);
+        etsdZoneClose();
+        return;
+    }
+    close(ZoneFd);
+    rename(from, to);
+    ZoneFd = open(from, O_RDWR|O_CREAT, 0644);  // the new ETSD file gets a new zone map
+    free(from);
+    free(to);
+    if (0 > ZoneFd || zoneReset()){
+        ErrorCode |= E_CANT_WRITE;
+        etsdZoneClose();
+    }
+}
+
+void etsdZoneClose(){
+    if (0 <= ZoneFd)
+        close(ZoneFd);
+    ZoneFd = -1;
+    free(ZoneFile);
+    free(ZoneBuf);
+    etsdDecodeFree(&ZoneDb);
+    ZoneFile = NULL;
+    ZoneBuf = NULL;
+    ZoneCnt = ZoneHave = ZoneFirst = 0;
+    ZoneWrite = 0;
+}
@@ -0,0 +1,86 @@
+/*************************************************************************
+etsdZone.h block zone maps (.tsdz), a min/max/sum summary of every block of an ETSD time series database
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#ifndef __etsdzone_h__
+#define __etsdzone_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The zone map is named after the ETSD file with a 'z' added i.e. garage.tsd -> garage.tsdz
+// An ETSD_ZHDR is followed by one record per sector from sector 1 on, found by arithmetic.  A record is an ETSD_ZREC, a valid count
+// per channel (padded to 8 bytes) and an ETSD_ZONE per channel, see ZONE_CNT() and ZONE_OF().  A record with a zero timestamp is a
+// hole (aligned files) or a block that hasn't been summarized, readers decode those blocks.
+// Zone maps are optional, they're only kept for channel group 0 and only once the file exists: etsdCmd zone builds it and from then on
+// every block is added once it is written, see etsdBlockWritten().
+#define ZONE_MAGIC  0x5A535445  // "ETSZ"
+typedef struct {
+    uint32_t magic;
+    uint32_t sig;           // etsdLayoutSig() of group 0
+    uint16_t channels;
+    uint16_t spare;
+    uint32_t spare2;
+} ETSD_ZHDR;
+
+typedef struct {
+    uint32_t timeStamp;     // of the block
+    uint8_t intervals;      // valid intervals in the block (VALID_INTERVALS)
+    uint8_t reset;          // source reset bits, same as BLOCK_RESET
+    uint16_t spare;
+} ETSD_ZREC;
+
+// one channel over one block.  min and max are readings as saved (signed and float channels hold int32/float bits, see etsdValue()),
+// sum is the total of etsdValue() of the valid readings.  NaN floats aren't counted
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    double sum;
+} ETSD_ZONE;
+
+#define ZONE_CNT(rec)       ((uint8_t*)(rec) + sizeof(ETSD_ZREC))   // valid readings of each channel, min/max/sum mean nothing if zero
+#define ZONE_OF(rec, chan)  ((ETSD_ZONE*)((uint8_t*)(rec) + sizeof(ETSD_ZREC) + ((EtsdInfo.channels+7) & ~7)) + (chan))
+
+// opens the zone map of the current ETSD file (group 0) if it has one.  write != 0 also summarizes any blocks it is behind on (a writer)
+// Readers only get the records of sectors that are in the ETSD file, checked again each time it's called
+// returns number of sectors covered + 1, zero if there is no zone map, or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdZoneOpen(uint8_t write);
+
+// creates the zone map, or discards the existing one, and summarizes every block of the ETSD file
+// returns number of sectors covered + 1 or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdZoneBuild();
+
+// adds block <blk> as sector #sector once it's written, see etsdBlockWritten().  Group 0 only.  An ETSD file without a zone map is
+// only checked once, a zone map built later is picked up when the writer opens another file (i.e. edd reloads)
+// returns zero on success or -1(DATA_INVALID) and sets ErrorCode
+int32_t etsdZoneBlock(PBLOCK *blk, int32_t sector);
+
+// record of sector #sector, read ahead a few hundred records at a time.  The record is only good until the next call
+// returns NULL if the sector isn't covered (or there is no zone map)
+ETSD_ZREC *etsdZone(int32_t sector);
+
+// moves the zone map to match an ETSD file that has been renamed to newName (see etsdRotate), the new file gets a new one
+void etsdZoneRename(char *newName);
+
+// closes the zone map
+void etsdZoneClose();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
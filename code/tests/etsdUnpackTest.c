@@ -0,0 +1,275 @@
+/*************************************************************************
+etsdUnpackTest.c checks every unpack kernel this CPU supports (SSE2/AVX2/F16C/NEON) against the scalar version
+ Runs each kernel on random streams, then decodes random blocks of random layouts (every stream type, signed, extended,
+ auto-scaled, float32, int32, registers, 512-4096 byte blocks) with etsdDecodeBlock().  Results have to match byte for byte.
+ usage: etsdUnpackTest [layouts] [seed]      returns zero if every kernel matches
+
+Copyright 2018 Peter VanDerWal
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2.0 as published by
+    the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*********************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "etsd.h"
+#include "etsdRead.h"
+#include "etsdUnpack.h"
+#include "errorlog.h"
+
+#define TEST_BLOCKS 20      // random blocks decoded per layout
+#define TEST_RUN 300        // longest kernel run, covers the vector loops and their scalar tails
+
+static uint32_t Seed = 1;
+static uint32_t rnd(){      // xorshift32, same sequence on every machine
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+static void rndFill(void *buf, size_t len){
+    uint8_t *b = (uint8_t*)buf;
+    while (len--)
+        *b++ = rnd();
+}
+
+static const uint8_t Levels[] = {UNPACK_SSE2, UNPACK_AVX2, UNPACK_NEON};
+static const char *LevelName[] = {"", "scalar", "sse2", "avx2", "neon"};
+
+// runs every kernel of EtsdUnpack and EtsdUnpackScalar on the same random input, returns number of mismatches
+static uint32_t testKernels(){
+    uint8_t src[2*TEST_RUN + 16];
+    uint32_t want[TEST_RUN], got[TEST_RUN], vWant[(TEST_RUN+31)/32], vGot[(TEST_RUN+31)/32], maxV, bad = 0;
+    const uint8_t shifts[] = {0, 2, 4, 8, 16, 20, 30};
+    uint16_t n, lane, off, cWant, cGot;
+    uint8_t sh, lp;
+
+    for (n=0; n<=TEST_RUN; n++){
+        for (sh=0; sh<sizeof(shifts); sh++){
+            off = rnd() & 7;    // unaligned sources
+            rndFill(src, sizeof(src));
+            rndFill(want, sizeof(want));
+            memcpy(got, want, sizeof(got));
+            EtsdUnpackScalar.u4(src+off, want, n, shifts[sh]);
+            EtsdUnpack.u4(src+off, got, n, shifts[sh]);
+            bad += !!memcmp(want, got, sizeof(got));
+            EtsdUnpackScalar.u8(src+off, want, n, shifts[sh]);
+            EtsdUnpack.u8(src+off, got, n, shifts[sh]);
+            bad += !!memcmp(want, got, sizeof(got));
+            EtsdUnpackScalar.u16((uint16_t*)(src+(off&6)), want, n, shifts[sh]);
+            EtsdUnpack.u16((uint16_t*)(src+(off&6)), got, n, shifts[sh]);
+            bad += !!memcmp(want, got, sizeof(got));
+            for (lp=0; lp<4; lp++){
+                lane = lp*n + (rnd() & 3);      // ext streams start anywhere in the 2 bit lanes
+                if (2*TEST_RUN < (lane + n + 3)/4 + off)
+                    continue;
+                EtsdUnpackScalar.u2(src+off, lane, want, n, shifts[sh]);
+                EtsdUnpack.u2(src+off, lane, got, n, shifts[sh]);
+                bad += !!memcmp(want, got, sizeof(got));
+            }
+        }
+        rndFill(src, sizeof(src));
+        EtsdUnpackScalar.f16((uint16_t*)src, want, n);
+        EtsdUnpack.f16((uint16_t*)src, got, n);
+        bad += !!memcmp(want, got, n*sizeof(uint32_t));
+
+        for (lp=0; lp<4; lp++){
+            maxV = 0 == lp ? 0 : 1 == lp ? DATA_INVALID : rnd() >> (rnd() & 31);
+            rndFill(want, sizeof(want));
+            for (off=0; off<n; off++)   // plenty of values right at maxV
+                if (!(rnd() & 7))
+                    want[off] = maxV - (rnd() & 1);
+            memcpy(got, want, sizeof(got));
+            rndFill(vWant, sizeof(vWant));
+            memcpy(vGot, vWant, sizeof(vGot));
+            cWant = EtsdUnpackScalar.mask(want, n, maxV, vWant);
+            cGot = EtsdUnpack.mask(got, n, maxV, vGot);
+            bad += cWant != cGot || memcmp(want, got, sizeof(got)) || memcmp(vWant, vGot, (n+31)/32*sizeof(uint32_t));
+        }
+    }
+    return bad;
+}
+
+// writes the header sector of a random layout to <fName>, returns number of channels
+static uint8_t makeLayout(char *fName){
+    PBLOCK hdr;
+    uint8_t dest[MAX_CHANNELS], asFlag[MAX_CHANNELS], fFlag[MAX_CHANNELS], channels = 1 + rnd() % 24;
+    uint8_t lp, type, quarter = 0, asCnt = 0, fCnt = 0, regs = 0, slots = 0, scaleBytes = 0;
+    uint16_t streams = 0, extCnt = 0, blockSize = BLOCKSIZE << (rnd() & 3), idx, labels;
+    int32_t intervals;
+    FILE *fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    for (lp=0; lp<channels; lp++){
+        type = 1 + rnd() % 15;
+        dest[lp] = type | (rnd() & 16);     // signed
+        asFlag[lp] = fFlag[lp] = 0;
+        if (13 == type && rnd() & 1){       // float32
+            dest[lp] = type;
+            fFlag[lp] = 1;
+            fCnt++;
+        } else if (14 > type && !(rnd() & 3)){     // counter, most with a register
+            dest[lp] |= 64 | (rnd() & 3 ? 32 : 0);
+            regs += !!(dest[lp] & 32);
+        }
+        if (14 == type)
+            dest[lp] = type;
+        if ((4 == type || 6 == type || 8 == type || 10 == type) && !(dest[lp] & 16) && rnd() & 1){
+            asFlag[lp] = 1;
+            asCnt++;
+        }
+        if (asFlag[lp] || 15 == type)
+            slots++;
+        streams += 13 == type ? 16 : 13 < type ? 8 : type;
+        if (1 & (13 == type ? 8 : 13 < type ? 4 : (type&14)/2))
+            quarter = 1;
+        if (1 & type && 13 > type)
+            extCnt++;
+    }
+    if (AS_DATA3_SLOTS < slots)
+        scaleBytes = (slots - AS_DATA3_SLOTS + 3) / 4;
+    // same sizing as createETSD
+    intervals = (blockSize-8-scaleBytes-regs*4) / (streams/4.0);
+    if (127 < intervals)
+        intervals = 127;
+    if (quarter && 1&intervals)
+        intervals--;
+    while (2 < intervals && 8 + ((streams-extCnt)*intervals+3)/4 + (extCnt*intervals+3)/4 > blockSize-scaleBytes-regs*4)
+        intervals -= quarter ? 2 : 1;
+    if (2 > intervals)
+        return 0;
+
+    hdr.longD[0] = ETSD_HEADER;
+    hdr.byteD[4] = intervals<<7 | channels;
+    hdr.byteD[5] = 1<<6 | intervals>>1;
+    hdr.byteD[6] = 10;
+    labels = 2*channels;    // "cNN" + null
+    hdr.byteD[8] = labels;
+    for (lp=0; lp<channels; lp++){
+        hdr.byteD[10 + 2*lp] = 64;
+        hdr.byteD[11 + 2*lp] = dest[lp];
+        sprintf((char*)hdr.byteD + 10 + 2*channels + 4*lp, "c%02u", lp);
+    }
+    idx = 10 + 2*channels + 2*labels;
+    hdr.byteD[idx++] = HX_MAGIC0;
+    hdr.byteD[idx++] = HX_MAGIC1;
+    if (asCnt){
+        hdr.byteD[idx++] = HX_ASCALE;
+        hdr.byteD[idx++] = channels;
+        for (lp=0; lp<channels; lp++)
+            hdr.byteD[idx++] = asFlag[lp];
+    }
+    if (fCnt){
+        hdr.byteD[idx++] = HX_FLOAT;
+        hdr.byteD[idx++] = channels;
+        for (lp=0; lp<channels; lp++)
+            hdr.byteD[idx++] = fFlag[lp];
+    }
+    if (BLOCKSIZE != blockSize){
+        hdr.byteD[idx++] = HX_BSIZE;
+        hdr.byteD[idx++] = 1;
+        hdr.byteD[idx++] = blockSize / BLOCKSIZE;
+    }
+    hdr.byteD[idx] = HX_END;
+
+    if (NULL == (fd = fopen(fName, "w")) || 1 != fwrite(&hdr, blockSize, 1, fd)){
+        perror(fName);
+        exit(2);
+    }
+    fclose(fd);
+    return channels;
+}
+
+// decodes <blk> with the kernels of <level>
+static void decode(uint8_t level, PBLOCK *blk, ETSD_DBLOCK *db){
+    PBLOCK *save = RBlock;
+
+    etsdUnpackInit(level);
+    RBlock = blk;
+    etsdDecodeBlock(db);
+    RBlock = save;
+}
+
+static uint8_t sameBlock(ETSD_DBLOCK *a, ETSD_DBLOCK *b){
+    uint16_t chans = EtsdInfo.channels;
+    return a->timeStamp == b->timeStamp && a->intervals == b->intervals && a->reset == b->reset
+        && !memcmp(a->data, b->data, chans * a->stride * sizeof(uint32_t))
+        && !memcmp(a->valid, b->valid, chans * a->words * sizeof(uint32_t))
+        && !memcmp(a->reg, b->reg, chans * sizeof(uint32_t));
+}
+
+int main(int argc, char *argv[]){
+    char fName[] = "/tmp/etsdUnpackTestXXXXXX";
+    uint32_t layouts = 1 < argc ? atoi(argv[1]) : 200, bad = 0, blocks = 0, kBad, lay;
+    uint8_t lp, blk, tested = 0;
+    ETSD_DBLOCK want, got;
+    PBLOCK block;
+    int fd;
+
+    Seed = 2 < argc && atoi(argv[2]) ? atoi(argv[2]) : 1;
+    LogLvl = 1;
+    if (0 > (fd = mkstemp(fName))){
+        perror(fName);
+        return 2;
+    }
+    close(fd);
+
+    for (lp=0; lp<sizeof(Levels); lp++){
+        if (0 > etsdUnpackInit(Levels[lp])){
+            printf("%-6s not supported, skipped\n", LevelName[Levels[lp]]);
+            ErrorCode = 0;
+            continue;
+        }
+        tested++;
+        kBad = testKernels();
+        printf("%-6s kernels (f16 %s) %s\n", EtsdUnpack.name, EtsdUnpack.f16 == EtsdUnpackScalar.f16 ? "scalar" : "vector", kBad ? "MISMATCH" : "ok");
+        bad += kBad;
+    }
+
+    for (lay=0; lay<layouts && tested; lay++){
+        if (!makeLayout(fName))
+            continue;
+        if (etsdInit(fName, 0) || etsdDecodeInit(&want) || etsdDecodeInit(&got)){
+            printf("layout %u: can't load the test header, ErrorCode %X\n", lay, ErrorCode);
+            bad++;
+            break;
+        }
+        for (blk=0; blk<TEST_BLOCKS; blk++){
+            rndFill(&block, sizeof(block));
+            block.longD[0] |= 1;
+            block.data[2] = (block.data[2] & ~127) | rnd() % (EtsdInfo.blockIntervals + 1);
+            decode(UNPACK_SCALAR, &block, &want);
+            for (lp=0; lp<sizeof(Levels); lp++){
+                if (0 > etsdUnpackInit(Levels[lp])){
+                    ErrorCode = 0;
+                    continue;
+                }
+                decode(Levels[lp], &block, &got);
+                if (!sameBlock(&want, &got)){
+                    if (!bad)
+                        printf("layout %u block %u: %s doesn't match scalar (seed %s)\n", lay, blk, LevelName[Levels[lp]], 2 < argc ? argv[2] : "1");
+                    bad++;
+                }
+            }
+            blocks++;
+        }
+        etsdDecodeFree(&want);
+        etsdDecodeFree(&got);
+    }
+    unlink(fName);
+    printf("%u random blocks decoded, %u mismatches\n", blocks, bad);
+    return !!bad;
+}